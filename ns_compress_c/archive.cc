@@ -0,0 +1,572 @@
+/*
+ * Copyright 2014, Stanford University. This file is licensed under Apache 2.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: nikhilh@cs.stanford.com (Nikhil Handigol)
+ *         jvimal@stanford.edu (Vimal Jeyakumar)
+ *         brandonh@cs.stanford.edu (Brandon Heller)
+ */
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "archive.hh"
+#include "instrument.hh"
+
+using namespace std;
+
+/* Same levels as the whole-stream compressors these replace */
+#define GZIP_LEVEL 1
+#define ZSTD_LEVEL 5
+
+BlockWriter::BlockWriter()
+{
+    fp = NULL;
+    raw = NULL;
+    raw_len = 0;
+    records = 0;
+    zctx = NULL;
+    comp_size = 0;
+    comp_raw = 0;
+    flushed_raw = 0;
+    worker = NULL;
+    sequencer = NULL;
+    buffers = 0;
+    nblocks = 0;
+}
+
+BlockWriter::~BlockWriter()
+{
+    if (!raw)
+        return;
+    if (zstd)
+        ZSTD_freeCCtx(zctx);
+    else
+        deflateEnd(&zs);
+    delete[] raw;
+    u8 *buf;
+    while (spare.try_pop(buf))
+        delete[] buf;
+}
+
+void
+BlockWriter::open(FILE *f, u8 stream_id, bool use_zstd, bool in_archive)
+{
+    fp = f;
+    stream = stream_id;
+    zstd = use_zstd;
+    archive = in_archive;
+    raw = new u8[ARCHIVE_BLOCK_SIZE];
+    buffers = 1;
+
+    if (zstd) {
+        zctx = ZSTD_createCCtx();
+        out.resize(ZSTD_compressBound(ARCHIVE_BLOCK_SIZE));
+    } else {
+        memset(&zs, 0, sizeof(zs));
+        /* 16: gzip wrapper, so that blocks concatenate into a gzip file */
+        if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 | 16, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK) {
+            ERR("Cannot initialize deflate\n");
+            exit(-1);
+        }
+        out.resize(deflateBound(&zs, ARCHIVE_BLOCK_SIZE));
+    }
+}
+
+/* Compresses and writes out the current block, if any, or hands it to
+ * the worker and carries on in a spare buffer */
+void
+BlockWriter::flush()
+{
+    if (!raw_len)
+        return;
+
+    nblocks++;
+    flushed_raw += raw_len;
+    if (worker) {
+        BlockJob job = { this, raw, raw_len, records, 0 };
+        if (sequencer)
+            job.seq = sequencer->next++;
+        worker->submit(job);
+        if (!spare.try_pop(raw)) {
+            if (buffers < BLOCK_BUFFERS) {
+                raw = new u8[ARCHIVE_BLOCK_SIZE];
+                buffers++;
+            } else {
+                STAGE_TIMER(STAGE_FLUSH);
+                raw = spare.pop();
+            }
+        }
+    } else {
+        write_block(compress(raw, raw_len), raw_len, records);
+    }
+    raw_len = 0;
+    records = 0;
+}
+
+/* Compresses block into out and returns the compressed length */
+size_t
+BlockWriter::compress(const u8 *block, u32 len_in)
+{
+    size_t len;
+
+    {
+        STAGE_TIMER(STAGE_FLUSH);
+        if (zstd) {
+            len = ZSTD_compressCCtx(zctx, out.data(), out.size(), block, len_in,
+                    ZSTD_LEVEL);
+            if (ZSTD_isError(len)) {
+                ERR("ERROR WITH ZSTD: %s\n", ZSTD_getErrorName(len));
+                exit(-1);
+            }
+        } else {
+            deflateReset(&zs);
+            zs.next_in = (u8 *) block;
+            zs.avail_in = len_in;
+            zs.next_out = out.data();
+            zs.avail_out = out.size();
+            if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+                ERR("ERROR WITH DEFLATE\n");
+                exit(-1);
+            }
+            len = zs.total_out;
+        }
+    }
+    return len;
+}
+
+/* Writes the len bytes compressed from a block_len byte block */
+void
+BlockWriter::write_block(size_t len, u32 block_len, u32 nrecords)
+{
+    if (archive) {
+        BlockHeader blk;
+        blk.stream = stream;
+        blk.records = nrecords;
+        blk.raw_len = block_len;
+        blk.comp_len = len;
+        fwrite(&blk, sizeof(blk), 1, fp);
+        if (sequencer) {
+            blocks.push_back(BlockInfo{ sequencer->offset, nrecords });
+            sequencer->offset += sizeof(blk) + len;
+        }
+    }
+    if (fwrite(out.data(), 1, len, fp) != len) {
+        ERR("Cannot write compressed block\n");
+        exit(-1);
+    }
+    fflush(fp);
+
+    comp_size += len;
+    comp_raw += block_len;
+}
+
+BlockWorker::BlockWorker()
+{
+    submitted = 0;
+    done = 0;
+}
+
+BlockWorker::~BlockWorker()
+{
+    stop();
+}
+
+void
+BlockWorker::start()
+{
+    th = thread(&BlockWorker::run, this);
+}
+
+void
+BlockWorker::submit(const BlockJob &job)
+{
+    submitted++;
+    jobs.push(job);
+}
+
+/* Waits until every submitted block is written; the writers' comp_size
+ * is up to date afterwards */
+void
+BlockWorker::drain()
+{
+    int spins = 0;
+    while (done.load(memory_order_acquire) != submitted)
+        ring_wait(spins);
+}
+
+/* Drains the queue and joins the thread, then adds its timers to those
+ * of the calling thread */
+void
+BlockWorker::stop()
+{
+    if (!th.joinable())
+        return;
+    BlockJob job = { NULL, NULL, 0, 0, 0 };
+    jobs.push(job);
+    th.join();
+    instr.merge(thread_instr);
+}
+
+void
+BlockWorker::run()
+{
+    for (;;) {
+        BlockJob job = jobs.pop();
+        if (!job.writer)
+            break;
+        BlockWriter *w = job.writer;
+        size_t len = w->compress(job.raw, job.raw_len);
+        /* The raw block can be refilled while this one waits its turn */
+        w->spare.push(job.raw);
+        if (w->sequencer) {
+            int spins = 0;
+            while (w->sequencer->written.load(memory_order_acquire) != job.seq)
+                ring_wait(spins);
+        }
+        w->write_block(len, job.raw_len, job.records);
+        if (w->sequencer)
+            w->sequencer->written.store(job.seq + 1, memory_order_release);
+        done.store(done.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+    thread_instr = instr;
+}
+
+/* Compresses the index into a block of its own and ends the archive;
+ * offset is where the index block starts */
+void
+archive_write_index(FILE *fp, bool zstd, const vector<u8> &index, u64 offset)
+{
+    BlockHeader blk;
+    ArchiveTrailer trailer;
+    vector<u8> out;
+    size_t len;
+
+    if (zstd) {
+        out.resize(ZSTD_compressBound(index.size()));
+        len = ZSTD_compress(out.data(), out.size(), index.data(), index.size(),
+                ZSTD_LEVEL);
+        if (ZSTD_isError(len)) {
+            ERR("ERROR WITH ZSTD: %s\n", ZSTD_getErrorName(len));
+            exit(-1);
+        }
+    } else {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 | 16, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK) {
+            ERR("Cannot initialize deflate\n");
+            exit(-1);
+        }
+        out.resize(deflateBound(&zs, index.size()));
+        zs.next_in = (u8 *) index.data();
+        zs.avail_in = index.size();
+        zs.next_out = out.data();
+        zs.avail_out = out.size();
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+            ERR("ERROR WITH DEFLATE\n");
+            exit(-1);
+        }
+        len = zs.total_out;
+        deflateEnd(&zs);
+    }
+
+    blk.stream = STREAM_INDEX;
+    blk.records = 1;
+    blk.raw_len = index.size();
+    blk.comp_len = len;
+    fwrite(&blk, sizeof(blk), 1, fp);
+    fwrite(out.data(), 1, len, fp);
+    archive_write_end(fp);
+
+    trailer.index_offset = offset;
+    memcpy(trailer.magic, ARCHIVE_INDEX_MAGIC, sizeof(trailer.magic));
+    fwrite(&trailer, sizeof(trailer), 1, fp);
+    fflush(fp);
+}
+
+void
+archive_write_header(FILE *fp, bool zstd)
+{
+    ArchiveHeader hdr;
+
+    memcpy(hdr.magic, ARCHIVE_MAGIC, sizeof(hdr.magic));
+    hdr.version = ARCHIVE_VERSION;
+    hdr.codec = zstd ? ARCHIVE_ZSTD : ARCHIVE_GZIP;
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+}
+
+void
+archive_write_end(FILE *fp)
+{
+    BlockHeader blk;
+
+    memset(&blk, 0, sizeof(blk));
+    blk.stream = STREAM_END;
+    fwrite(&blk, sizeof(blk), 1, fp);
+    fflush(fp);
+}
+
+bool
+archive_read_header(FILE *fp, ArchiveHeader &hdr)
+{
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1
+            || memcmp(hdr.magic, ARCHIVE_MAGIC, sizeof(hdr.magic))) {
+        ERR("Not a NetSight archive\n");
+        return false;
+    }
+    if (hdr.version < 1 || hdr.version > ARCHIVE_VERSION) {
+        ERR("Unsupported archive version %u\n", hdr.version);
+        return false;
+    }
+    return true;
+}
+
+/* Reads the next block header; false at the end of the archive */
+bool
+archive_read_block(FILE *fp, BlockHeader &blk)
+{
+    if (fread(&blk, sizeof(blk), 1, fp) != 1) {
+        ERR("Truncated archive\n");
+        return false;
+    }
+    if (blk.stream == STREAM_END)
+        return false;
+    if (blk.stream > STREAM_INDEX) {
+        ERR("Corrupt archive block\n");
+        return false;
+    }
+    return true;
+}
+
+/* Reads and decompresses the payload of blk, whose header was just read */
+bool
+archive_read_payload(FILE *fp, const BlockHeader &blk, u8 codec, vector<u8> &raw)
+{
+    vector<u8> comp(blk.comp_len);
+    BlockReader reader;
+
+    if (fread(comp.data(), 1, comp.size(), fp) != comp.size()) {
+        ERR("Truncated archive\n");
+        return false;
+    }
+    return reader.decompress(codec, comp.data(), comp.size(), blk.raw_len, raw);
+}
+
+/* Reads the index of a version 2 archive, found through the trailer */
+bool
+archive_read_index(FILE *fp, u8 codec, vector<u8> &index)
+{
+    ArchiveTrailer trailer;
+    BlockHeader blk;
+
+    if (fseek(fp, -(long) sizeof(trailer), SEEK_END) != 0
+            || fread(&trailer, sizeof(trailer), 1, fp) != 1
+            || memcmp(trailer.magic, ARCHIVE_INDEX_MAGIC, sizeof(trailer.magic))) {
+        ERR("The archive has no index\n");
+        return false;
+    }
+    if (fseek(fp, trailer.index_offset, SEEK_SET) != 0
+            || fread(&blk, sizeof(blk), 1, fp) != 1
+            || blk.stream != STREAM_INDEX) {
+        ERR("Corrupt archive index\n");
+        return false;
+    }
+    return archive_read_payload(fp, blk, codec, index);
+}
+
+/* Maps the whole file behind fd, whatever its position */
+bool
+MappedFile::open(int fd)
+{
+    struct stat sb;
+
+    close();
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+        void *p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            data = (const u8 *) p;
+            size = sb.st_size;
+            mapped = true;
+            return true;
+        }
+    }
+
+    u8 buf[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        copy.insert(copy.end(), buf, buf + n);
+    if (n < 0) {
+        ERR("Cannot read the archive: %s\n", strerror(errno));
+        return false;
+    }
+    data = copy.data();
+    size = copy.size();
+    return true;
+}
+
+void
+MappedFile::close()
+{
+    if (mapped)
+        munmap((void *) data, size);
+    data = NULL;
+    size = 0;
+    mapped = false;
+    copy.clear();
+}
+
+BlockReader::BlockReader()
+{
+    memset(&zs, 0, sizeof(zs));
+    zs_ready = false;
+    zctx = NULL;
+}
+
+BlockReader::~BlockReader()
+{
+    if (zs_ready)
+        inflateEnd(&zs);
+    if (zctx)
+        ZSTD_freeDCtx(zctx);
+}
+
+/* Decompresses comp_len bytes of one block into raw_len bytes of raw */
+bool
+BlockReader::decompress(u8 codec, const u8 *comp, size_t comp_len, u32 raw_len,
+        vector<u8> &raw)
+{
+    raw.resize(raw_len);
+
+    if (codec == ARCHIVE_ZSTD) {
+        if (!zctx)
+            zctx = ZSTD_createDCtx();
+        size_t len = ZSTD_decompressDCtx(zctx, raw.data(), raw.size(), comp, comp_len);
+        if (ZSTD_isError(len) || len != raw.size()) {
+            ERR("Corrupt archive block\n");
+            return false;
+        }
+        return true;
+    }
+
+    int ret = zs_ready ? inflateReset(&zs) : inflateInit2(&zs, 15 | 16);
+    if (ret != Z_OK) {
+        ERR("Cannot initialize inflate\n");
+        return false;
+    }
+    zs_ready = true;
+    zs.next_in = (u8 *) comp;
+    zs.avail_in = comp_len;
+    zs.next_out = raw.data();
+    zs.avail_out = raw.size();
+    ret = inflate(&zs, Z_FINISH);
+    if (ret != Z_STREAM_END || zs.total_out != raw.size()) {
+        ERR("Corrupt archive block\n");
+        return false;
+    }
+    return true;
+}
+
+/* Decompresses the gzip member or zstd frame at comp, whose sizes aren't
+ * known, into raw; used is set to the compressed bytes it took */
+bool
+BlockReader::decompress_member(u8 codec, const u8 *comp, size_t avail, vector<u8> &raw,
+        size_t &used)
+{
+    if (codec == ARCHIVE_ZSTD) {
+        used = ZSTD_findFrameCompressedSize(comp, avail);
+        unsigned long long len = ZSTD_getFrameContentSize(comp, avail);
+        if (ZSTD_isError(used) || len == ZSTD_CONTENTSIZE_UNKNOWN
+                || len == ZSTD_CONTENTSIZE_ERROR || len > ~0u) {
+            ERR("Corrupt stream file\n");
+            return false;
+        }
+        return decompress(codec, comp, used, len, raw);
+    }
+
+    int ret = zs_ready ? inflateReset(&zs) : inflateInit2(&zs, 15 | 16);
+    if (ret != Z_OK) {
+        ERR("Cannot initialize inflate\n");
+        return false;
+    }
+    zs_ready = true;
+    zs.next_in = (u8 *) comp;
+    zs.avail_in = avail;
+    /* Members are single blocks; whole-stream files just take longer */
+    raw.resize(ARCHIVE_BLOCK_SIZE);
+    zs.next_out = raw.data();
+    zs.avail_out = raw.size();
+    while ((ret = inflate(&zs, Z_NO_FLUSH)) == Z_OK && zs.avail_out == 0) {
+        raw.resize(raw.size() * 2);
+        zs.next_out = raw.data() + zs.total_out;
+        zs.avail_out = raw.size() - zs.total_out;
+    }
+    if (ret != Z_STREAM_END) {
+        ERR("Corrupt stream file\n");
+        return false;
+    }
+    raw.resize(zs.total_out);
+    used = zs.total_in;
+    return true;
+}
+
+/* Decodes stream from offset on in f: the blocks of stream in an archive,
+ * or the members of a stream file if stream is -1 */
+void
+StreamCursor::open(const MappedFile &f, u8 c, int s, size_t offset)
+{
+    file = &f;
+    stream = s;
+    codec = c;
+    next = f.data + min(offset, f.size);
+    pos = end = NULL;
+    error = false;
+}
+
+/* Moves on to the next block of the stream that has records */
+bool
+StreamCursor::refill()
+{
+    const u8 *file_end = file->data + file->size;
+
+    pos = end = NULL;
+    while (next && next < file_end) {
+        size_t used;
+        if (stream < 0) {
+            if (!reader.decompress_member(codec, next, file_end - next, raw, used))
+                goto corrupt;
+            next += used;
+        } else {
+            BlockHeader blk;
+            if ((size_t) (file_end - next) < sizeof(blk))
+                goto corrupt;
+            memcpy(&blk, next, sizeof(blk));
+            if (blk.stream == STREAM_END) {
+                next = NULL;
+                return false;
+            }
+            if (blk.stream > STREAM_INDEX
+                    || (size_t) (file_end - next) - sizeof(blk) < blk.comp_len)
+                goto corrupt;
+            next += sizeof(blk) + blk.comp_len;
+            if (blk.stream != stream)
+                continue;
+            if (!reader.decompress(codec, next - blk.comp_len, blk.comp_len, blk.raw_len, raw))
+                goto corrupt;
+        }
+        if (!raw.empty()) {
+            pos = raw.data();
+            end = pos + raw.size();
+            return true;
+        }
+    }
+    if (stream < 0)
+        return false;
+
+corrupt:
+    ERR("Corrupt stream at byte %zu\n", (size_t) (next - file->data));
+    error = true;
+    next = NULL;
+    return false;
+}
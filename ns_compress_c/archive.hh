@@ -0,0 +1,285 @@
+/*
+ * Copyright 2014, Stanford University. This file is licensed under Apache 2.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: nikhilh@cs.stanford.com (Nikhil Handigol)
+ *         jvimal@stanford.edu (Vimal Jeyakumar)
+ *         brandonh@cs.stanford.edu (Brandon Heller)
+ */
+
+#ifndef ARCHIVE_HH
+#define ARCHIVE_HH
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <zlib.h>
+#include <zstd.h>
+#include "types.hh"
+#include "helper.hh"
+#include "ring.hh"
+#include "instrument.hh"
+
+using namespace std;
+
+/* The ts, firstpkt and diff streams are compressed in blocks of at most
+ * ARCHIVE_BLOCK_SIZE bytes, each on its own (a gzip member or a zstd
+ * frame), so the compressor holds one block per stream however long the
+ * capture is. An archive interleaves the blocks of the three streams in
+ * the order they fill up:
+ *   ArchiveHeader
+ *   { BlockHeader, comp_len compressed bytes }*
+ *   BlockHeader with stream STREAM_INDEX, compressed index   (version 2)
+ *   BlockHeader with stream STREAM_END
+ *   ArchiveTrailer                                           (version 2)
+ * Records never straddle blocks. Version 2 added the index, version 3
+ * first packets encoded against earlier ones (FIRSTPKT_DELTA), version 4
+ * against the headers of other flows (FIRSTPKT_FIELDS). */
+#define ARCHIVE_MAGIC "NSCA"
+#define ARCHIVE_VERSION 4
+#define ARCHIVE_BLOCK_SIZE (1 << 20)
+
+enum ArchiveCodec {
+    ARCHIVE_GZIP,
+    ARCHIVE_ZSTD,
+};
+
+enum ArchiveStream {
+    STREAM_TS,
+    STREAM_FIRSTPKT,
+    STREAM_DIFF,
+
+    NUM_STREAMS,
+    STREAM_INDEX = NUM_STREAMS,
+    STREAM_END = 0xff,
+};
+
+struct ArchiveHeader {
+    char magic[4];
+    u8 version;
+    u8 codec;
+} __attribute__((packed));
+
+struct BlockHeader {
+    u8 stream;
+    u32 records;
+    u32 raw_len;
+    u32 comp_len;
+} __attribute__((packed));
+
+/* The index lists every block, so that a reader can seek to the blocks it
+ * needs, and every flow with the diff blocks its packets are in:
+ *   IndexHeader
+ *   IndexBlock[num_blocks]         in archive order
+ *   IndexFlow[num_flows]           in order of their first packet
+ *   u32 first_ids[num_first_ids]   first packet ids of the flows
+ *   u32 chunks[num_chunks]         diff blocks of the flows, numbered
+ *                                  within the diff stream
+ * Record i of the ts stream is the timestamp of packet i (record 0 is the
+ * TimestampHeader), record i of the diff stream the diff of packet i and
+ * record i of the firstpkt stream first packet i. */
+#define ARCHIVE_INDEX_MAGIC "NSCI"
+#define FLOW_KEY_LEN 16
+
+struct IndexHeader {
+    u8 tsresol;
+    u32 num_blocks;
+    u32 num_flows;
+    u32 num_first_ids;
+    u32 num_chunks;
+} __attribute__((packed));
+
+struct IndexBlock {
+    u64 offset;         /* of its BlockHeader in the archive */
+    u8 stream;
+    u32 records;
+    u64 first_record;   /* within the stream */
+    /* ts blocks: decoder state after the record before first_record */
+    u64 ts_prev;        /* ticks */
+    u64 ts_delta;
+    u32 ts_ifid;
+} __attribute__((packed));
+
+struct IndexFlow {
+    u8 key[FLOW_KEY_LEN];   /* FlowKey::key */
+    u32 packets;
+    u64 first_ns;
+    u64 last_ns;
+    u32 first_ids;      /* index of its first id in first_ids */
+    u32 num_first_ids;  /* more than one if the flow restarted */
+    u32 chunks;
+    u32 num_chunks;
+} __attribute__((packed));
+
+/* Last bytes of a version 2 archive */
+struct ArchiveTrailer {
+    u64 index_offset;
+    char magic[4];
+} __attribute__((packed));
+
+/* Where a block went; known once it is written */
+struct BlockInfo {
+    u64 offset;
+    u32 records;
+};
+
+/* Raw blocks per stream with a worker, double buffered: one filling up
+ * while the other is compressed */
+#define BLOCK_BUFFERS 2
+
+struct BlockWorker;
+
+/* Shared by the writers of one archive: the workers compress at the same
+ * time, but write their blocks in the order the blocks filled up, so
+ * that the archive is the same as when written by a single thread */
+struct BlockSequencer {
+    u64 next;               /* of the next block to submit */
+    atomic<u64> written;    /* blocks written so far */
+    u64 offset;             /* archive bytes written so far */
+
+    BlockSequencer() : next(0), written(0), offset(0) {}
+};
+
+/* Buffers the records of one stream and compresses them a block at a
+ * time, either into a file of its own as a plain concatenation of gzip
+ * members or zstd frames, or into an archive shared with the other
+ * streams */
+struct BlockWriter {
+    FILE *fp;
+    u8 stream;
+    bool zstd;
+    bool archive;
+
+    u8 *raw;
+    u32 raw_len;
+    u32 records;
+    vector<u8> out;
+    z_stream zs;
+    ZSTD_CCtx *zctx;
+
+    atomic<u64> comp_size;  /* compressed bytes written, without headers */
+    atomic<u64> comp_raw;   /* raw bytes of the blocks in comp_size */
+    u64 flushed_raw;        /* raw bytes of the blocks flushed */
+
+    BlockWorker *worker;    /* compresses full blocks, if set */
+    BlockSequencer *sequencer;  /* orders the blocks in an archive */
+    SpscRing<u8 *, BLOCK_BUFFERS> spare;   /* raw blocks the worker is done with */
+    u32 buffers;
+
+    u32 nblocks;        /* blocks flushed, the number of the current one */
+    vector<BlockInfo> blocks;   /* written to an archive, once flushed */
+
+    BlockWriter();
+    ~BlockWriter();
+    void open(FILE *f, u8 stream, bool zstd, bool archive);
+
+    /* Room for one record of len bytes */
+    u8 *append(int len)
+    {
+        if (unlikely(raw_len + len > ARCHIVE_BLOCK_SIZE))
+            flush();
+        u8 *ret = raw + raw_len;
+        raw_len += len;
+        records++;
+        return ret;
+    }
+    void write(const void *buf, int len)
+    {
+        memcpy(append(len), buf, len);
+    }
+    void flush();
+    size_t compress(const u8 *block, u32 len);
+    void write_block(size_t len, u32 block_len, u32 nrecords);
+};
+
+struct BlockJob {
+    BlockWriter *writer;    /* NULL: stop */
+    u8 *raw;
+    u32 raw_len;
+    u32 records;
+    u64 seq;                /* position in the archive */
+};
+
+/* Compresses and writes out the blocks of one writer on a thread of its
+ * own, so the caller only copies records into the raw blocks */
+struct BlockWorker : CacheAligned {
+    SpscRing<BlockJob, BLOCK_BUFFERS> jobs;
+    thread th;
+    u64 submitted;
+    atomic<u64> done;
+    Instrument thread_instr;    /* the worker's timers, once stopped */
+
+    BlockWorker();
+    ~BlockWorker();
+    void start();
+    void submit(const BlockJob &job);
+    void drain();
+    void stop();
+    void run();
+};
+
+/* A file mapped read-only, so that blocks decompress straight out of the
+ * page cache; files that can't be mapped (pipes) are read into memory */
+struct MappedFile {
+    const u8 *data;
+    size_t size;
+    bool mapped;
+    vector<u8> copy;
+
+    MappedFile() : data(NULL), size(0), mapped(false) {}
+    ~MappedFile() { close(); }
+    bool open(int fd);
+    void close();
+};
+
+/* Decompression contexts kept from block to block. Blocks decompress
+ * into the caller's buffer, whose capacity is reused. */
+struct BlockReader {
+    z_stream zs;
+    bool zs_ready;
+    ZSTD_DCtx *zctx;
+
+    BlockReader();
+    ~BlockReader();
+    bool decompress(u8 codec, const u8 *comp, size_t comp_len, u32 raw_len,
+            vector<u8> &raw);
+    bool decompress_member(u8 codec, const u8 *comp, size_t avail, vector<u8> &raw,
+            size_t &used);
+};
+
+/* The records of one stream, decoded a block at a time, from the blocks
+ * of the stream in a mapped archive or from the members of a mapped
+ * stream file, as the compressor writes them without an archive. Records
+ * never straddle blocks, so they are parsed in place between pos and
+ * end. */
+struct StreamCursor {
+    const MappedFile *file;
+    int stream;         /* -1 for a stream file */
+    u8 codec;
+    const u8 *next;     /* where the next block is looked for */
+    BlockReader reader;
+    vector<u8> raw;
+    const u8 *pos;
+    const u8 *end;
+    bool error;         /* the stream ended on a corrupt block */
+
+    StreamCursor() : file(NULL), next(NULL), pos(NULL), end(NULL), error(false) {}
+    void open(const MappedFile &f, u8 codec, int stream, size_t offset);
+    /* false at the end of the stream */
+    bool more()
+    {
+        return pos < end || refill();
+    }
+    bool refill();
+};
+
+void archive_write_header(FILE *fp, bool zstd);
+void archive_write_end(FILE *fp);
+bool archive_read_header(FILE *fp, ArchiveHeader &hdr);
+bool archive_read_block(FILE *fp, BlockHeader &blk);
+bool archive_read_payload(FILE *fp, const BlockHeader &blk, u8 codec, vector<u8> &raw);
+void archive_write_index(FILE *fp, bool zstd, const vector<u8> &index, u64 offset);
+bool archive_read_index(FILE *fp, u8 codec, vector<u8> &index);
+
+#endif //ARCHIVE_HH
@@ -0,0 +1,217 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "batch.h"
+#include "cpz_codec.h"
+#include "helper.hh"
+
+using namespace std;
+
+struct BatchFile {
+    string path;
+    string name;
+    u64 size;
+    vector<char> ok;        /* per codec; written by the worker of the run */
+    vector<JSON> runs;
+};
+
+/* Jobs are (file, codec) runs. Each worker takes jobs from the front of
+ * its own queue and, once that is empty, steals from the back of the
+ * others', so a few large captures don't leave the other threads idle. */
+struct WorkQueue {
+    mutex lock;
+    deque<int> jobs;
+};
+
+static bool next_job(vector<WorkQueue> &queues, int self, int &job) {
+    int n = queues.size();
+
+    REP(i, n) {
+        WorkQueue &q = queues[(self + i) % n];
+        lock_guard<mutex> guard(q.lock);
+        if (q.jobs.empty())
+            continue;
+        if (i == 0) {
+            job = q.jobs.front();
+            q.jobs.pop_front();
+        } else {
+            job = q.jobs.back();
+            q.jobs.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+static void batch_worker(vector<WorkQueue> *queues, int self, vector<BatchFile> *files) {
+    int job;
+
+    while (next_job(*queues, self, job)) {
+        BatchFile &f = (*files)[job / NUM_CODECS];
+        int c = job % NUM_CODECS;
+        JSON j;
+        f.ok[c] = cpz_run(CODECS[c], f.path.c_str(), j);
+        f.runs[c] = j;
+    }
+}
+
+static bool is_capture(const char *name) {
+    size_t len = strlen(name);
+    return (len > 5 && strcmp(name + len - 5, ".pcap") == 0)
+        || (len > 7 && strcmp(name + len - 7, ".pcapng") == 0);
+}
+
+/* The pcap and pcapng files of dir, by name */
+static bool find_captures(const char *dir, vector<BatchFile> &files) {
+    DIR *d = opendir(dir);
+    struct dirent *ent;
+
+    if (!d) {
+        ERR("Cannot open directory %s\n", dir);
+        return false;
+    }
+    while ((ent = readdir(d))) {
+        struct stat sb;
+        BatchFile f;
+        if (!is_capture(ent->d_name))
+            continue;
+        f.name = ent->d_name;
+        f.path = string(dir) + "/" + f.name;
+        if (stat(f.path.c_str(), &sb) < 0 || !S_ISREG(sb.st_mode))
+            continue;
+        f.size = sb.st_size;
+        f.ok.assign(NUM_CODECS, 0);
+        f.runs.resize(NUM_CODECS);
+        files.push_back(f);
+    }
+    closedir(d);
+    sort(files.begin(), files.end(), [](const BatchFile &a, const BatchFile &b) {
+        return a.name < b.name;
+    });
+    return true;
+}
+
+/* result.csv has the columns compress.py wrote, result.json the --json
+ * report of every file */
+static bool write_results(const char *out_dir, const vector<BatchFile> &files) {
+    string csv_name = string(out_dir) + "/result.csv";
+    string json_name = string(out_dir) + "/result.json";
+    FILE *csv = fopen(csv_name.c_str(), "w");
+    FILE *json = fopen(json_name.c_str(), "w");
+    picojson::array reports;
+
+    if (!csv || !json) {
+        ERR("Cannot write the results to %s\n", out_dir);
+        if (csv)
+            fclose(csv);
+        if (json)
+            fclose(json);
+        return false;
+    }
+
+    fprintf(csv, "file");
+    REP(c, NUM_CODECS) {
+        const char *name = strcmp(CODECS[c].name, "netsight_gzip") == 0 ? "ns_gzip"
+            : strcmp(CODECS[c].name, "netsight_zstd") == 0 ? "ns_zstd"
+            : strcmp(CODECS[c].name, "zstandard") == 0 ? "zstd" : CODECS[c].name;
+        fprintf(csv, ",%s c_ratio,%s c_t", name, name);
+    }
+    fprintf(csv, "\n");
+
+    EACH(f, files) {
+        picojson::array runs;
+        fprintf(csv, "%s", f->name.c_str());
+        REP(c, NUM_CODECS) {
+            if (!f->ok[c]) {
+                fprintf(csv, ",,");
+                continue;
+            }
+            JSON j = f->runs[c];
+            fprintf(csv, ",%.6g%%,%s μs", j["compression_rate"].get<double>(),
+                    j["time_us"].to_str().c_str());
+            runs.push_back(V(j));
+        }
+        fprintf(csv, "\n");
+
+        JSON report;
+        report["file"] = V(f->path);
+        report["runs"] = V(runs);
+        reports.push_back(V(report));
+    }
+    fprintf(json, "%s\n", V(reports).serialize().c_str());
+    fclose(csv);
+    fclose(json);
+    return true;
+}
+
+static void batch_usage() {
+    fprintf(stderr, "usage: ns_compress bench [-j threads] [-o output_dir] dir\n"
+            "runs every codec on the pcap and pcapng files of dir and writes\n"
+            "result.csv and result.json to output_dir (default .)\n");
+    exit(1);
+}
+
+/* ns_compress bench dir: the benchmark compress.py ran, in-process, on a
+ * pool of threads sized to the machine */
+int batch_main(int argc, char *argv[]) {
+    const char *out_dir = ".";
+    int threads = thread::hardware_concurrency();
+    vector<BatchFile> files;
+    int o;
+
+    while ((o = getopt(argc, argv, "j:o:h")) != -1) {
+        switch (o) {
+            case 'j': threads = atoi(optarg); break;
+            case 'o': out_dir = optarg; break;
+            default: batch_usage();
+        }
+    }
+    if (optind + 1 != argc)
+        batch_usage();
+    if (threads <= 0)
+        threads = 1;
+    if (!find_captures(argv[optind], files))
+        return 1;
+
+    /* Largest captures first, dealt round-robin over the queues */
+    vector<int> order;
+    REP(i, (int)files.size()) order.push_back(i);
+    stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return files[a].size > files[b].size;
+    });
+    vector<WorkQueue> queues(threads);
+    int next = 0;
+    EACH(it, order) {
+        REP(c, NUM_CODECS) queues[next++ % threads].jobs.push_back(*it * NUM_CODECS + c);
+    }
+
+    u64 start = now_ns();
+    vector<thread> workers;
+    REP(i, threads) workers.push_back(thread(batch_worker, &queues, i, &files));
+    EACH(it, workers) it->join();
+    u64 time_ns = now_ns() - start;
+
+    int failed = 0;
+    EACH(f, files) {
+        REP(c, NUM_CODECS) failed += !f->ok[c];
+    }
+    fprintf(stderr, "%zu files, %zu runs (%d failed) on %d threads in %.3f s\n",
+            files.size(), files.size() * NUM_CODECS, failed, threads, time_ns / 1e9);
+    return write_results(out_dir, files) && !failed ? 0 : 1;
+}
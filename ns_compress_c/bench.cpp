@@ -0,0 +1,174 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+/*
+ * ns_bench: generates deterministic synthetic traces and runs every codec
+ * on them end-to-end, each run in its own process so that its peak RSS
+ * can be measured.
+ *
+ *   ns_bench [-n packets] [-s seed] [-S snaplen] [-p profile] [-r runs]
+ *            [-d trace_dir] [-o result.csv] [-k]
+ *
+ * Traces are removed after the run unless -k is given.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "cpz_codec.h"
+#include "trace_gen.h"
+#include "helper.hh"
+
+using namespace std;
+
+thread_local ulong PACKET_BUFF_SIZE;
+thread_local ulong MAX_PKT_SIZE;
+
+struct BenchResult {
+    bool ok;
+    CodecStats st;
+    u64 time_ns;
+    u64 peak_rss_kb;
+};
+
+static BenchResult run_isolated(const Codec &codec, const char *file_name)
+{
+    BenchResult res{};
+    int fds[2];
+
+    if (pipe(fds) < 0)
+        return res;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        struct rusage ru;
+        close(fds[0]);
+        u64 start = now_ns();
+        res.ok = codec.run(file_name, NULL, res.st);
+        res.time_ns = now_ns() - start;
+        getrusage(RUSAGE_SELF, &ru);
+        res.peak_rss_kb = ru.ru_maxrss;
+        if (write(fds[1], &res, sizeof(res)) != sizeof(res))
+            _exit(1);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    if (pid < 0 || read(fds[0], &res, sizeof(res)) != sizeof(res))
+        res.ok = false;
+    close(fds[0]);
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+    return res;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n packets] [-s seed] [-S snaplen] [-p profile] "
+            "[-r runs] [-d trace_dir] [-o result.csv] [-k]\n", prog);
+    fprintf(stderr, "profiles:");
+    REP(i, NUM_TRACE_PROFILES) fprintf(stderr, " %s", trace_profile_name(i));
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    u64 num_packets = 200000, seed = 1;
+    u32 snaplen = 128;
+    int runs = 3, only = -1, opt;
+    bool keep = false;
+    string dir = "/tmp", csv;
+
+    while ((opt = getopt(argc, argv, "n:s:S:p:r:d:o:kh")) != -1) {
+        switch (opt) {
+            case 'n': num_packets = strtoull(optarg, NULL, 10); break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            case 'S': snaplen = strtoul(optarg, NULL, 10); break;
+            case 'r': runs = max(1, atoi(optarg)); break;
+            case 'd': dir = optarg; break;
+            case 'o': csv = optarg; break;
+            case 'k': keep = true; break;
+            case 'p':
+                only = trace_profile_find(optarg);
+                if (only < 0)
+                    usage(argv[0]);
+                break;
+            default: usage(argv[0]);
+        }
+    }
+
+    FILE *out = csv.empty() ? NULL : fopen(csv.c_str(), "w");
+    if (out)
+        fprintf(out, "profile,codec,packets,input_bytes,compressed_bytes,ratio,mb_per_s,packets_per_s,peak_rss_kb\n");
+
+    printf("%-10s %-14s %10s %8s %10s %12s %10s\n",
+            "profile", "codec", "bytes", "ratio", "MB/s", "packets/s", "rss MB");
+
+    REP(p, NUM_TRACE_PROFILES) {
+        if (only >= 0 && p != only)
+            continue;
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/ns_bench_%s_%llu_%llu_%u.pcap", dir.c_str(),
+                trace_profile_name(p), seed, num_packets, snaplen);
+        TraceGen gen(p, seed, num_packets, snaplen);
+        if (gen.write(path) != num_packets) {
+            ERR("Cannot write trace %s\n", path);
+            return 1;
+        }
+        u64 input_bytes = get_file_size(path);
+
+        REP(c, NUM_CODECS) {
+            vector<BenchResult> res;
+            REP(r, runs) {
+                BenchResult one = run_isolated(CODECS[c], path);
+                if (one.ok)
+                    res.push_back(one);
+            }
+            if (res.empty()) {
+                printf("%-10s %-14s failed\n", trace_profile_name(p), CODECS[c].name);
+                continue;
+            }
+
+            /* median time, largest footprint */
+            sort(res.begin(), res.end(), [](const BenchResult &a, const BenchResult &b) {
+                return a.time_ns < b.time_ns;
+            });
+            BenchResult &med = res[res.size() / 2];
+            u64 rss = 0;
+            EACH(it, res) rss = max(rss, it->peak_rss_kb);
+
+            /* All ratios and rates are relative to the pcap file, the
+             * input every codec is given */
+            double secs = med.time_ns / 1e9;
+            double ratio = input_bytes * 1.0 / med.st.comp_size;
+            double mbps = input_bytes / 1e6 / secs;
+            double pps = num_packets / secs;
+
+            printf("%-10s %-14s %10llu %8.2f %10.1f %12.0f %10.1f\n",
+                    trace_profile_name(p), CODECS[c].name, med.st.comp_size,
+                    ratio, mbps, pps, rss / 1024.0);
+            if (out)
+                fprintf(out, "%s,%s,%llu,%llu,%llu,%.4f,%.2f,%.0f,%llu\n",
+                        trace_profile_name(p), CODECS[c].name, num_packets,
+                        input_bytes, med.st.comp_size, ratio, mbps, pps, rss);
+        }
+        if (!keep)
+            unlink(path);
+    }
+
+    if (out)
+        fclose(out);
+    return 0;
+}
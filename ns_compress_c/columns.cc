@@ -0,0 +1,227 @@
+/*
+ * Copyright 2014, Stanford University. This file is licensed under Apache 2.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: nikhilh@cs.stanford.com (Nikhil Handigol)
+ *         jvimal@stanford.edu (Vimal Jeyakumar)
+ *         brandonh@cs.stanford.edu (Brandon Heller)
+ */
+
+#include <algorithm>
+#include <strings.h>
+#include <arpa/inet.h>
+#include "columns.hh"
+#include "flow_index.hh"
+#include "compress.hh"
+#include "util.hh"
+
+using namespace std;
+
+/* The field, or COLUMN_TIME, named name; -1 if there is none */
+int
+column_find(const char *name)
+{
+    if (strcasecmp(name, "time") == 0)
+        return COLUMN_TIME;
+    REP(i, NUM_FIELDS) {
+        if (strcasecmp(name, FIELDS[i].name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const char *
+column_name(int column)
+{
+    return column == COLUMN_TIME ? "time" : FIELDS[column].name;
+}
+
+static bool
+is_address(int column)
+{
+    return column == IP_SRC || column == IP_DST
+        || column == OUTER_IP_SRC || column == OUTER_IP_DST;
+}
+
+void
+ColumnQuery::add(const FlowColumns &cols, u64 ts_ns)
+{
+    QueryKey key;
+
+    EACH(it, where) {
+        u32 v = cols.values[it->field];
+        if (v == ~0u || (v & it->mask) != it->value)
+            return;
+    }
+
+    memset(&key, 0, sizeof(key));
+    REP(i, (int)group.size()) {
+        if (group[i] == COLUMN_TIME)
+            key.v[i] = ts_ns / bucket_ns * bucket_ns / NSEC_PER_SEC;
+        else
+            key.v[i] = cols.values[group[i]];
+    }
+
+    auto ins = rows.insert(make_pair(key, QueryRow()));
+    QueryRow &row = ins.first->second;
+    if (ins.second) {
+        REP(i, (int)aggs.size())
+            row.v[i] = aggs[i].agg == AGG_MIN ? ~0ULL : 0;
+    }
+    REP(i, (int)aggs.size()) {
+        const QueryAggregate &a = aggs[i];
+        u32 v = a.agg == AGG_PACKETS || a.agg == AGG_BYTES ? 0 : cols.values[a.field];
+        switch (a.agg) {
+            case AGG_PACKETS:
+                row.v[i]++;
+                break;
+            case AGG_BYTES:
+                if (cols.values[IP_LEN] != ~0u)
+                    row.v[i] += cols.l3_off + cols.values[IP_LEN];
+                break;
+            case AGG_SUM:
+                if (v != ~0u)
+                    row.v[i] += v;
+                break;
+            case AGG_MIN:
+                if (v != ~0u)
+                    row.v[i] = min(row.v[i], (u64)v);
+                break;
+            case AGG_MAX:
+                if (v != ~0u)
+                    row.v[i] = max(row.v[i], (u64)v);
+                break;
+        }
+    }
+}
+
+/* Scans the diff stream of an archive with an index, carrying the
+ * fields of the last packet of every flow forward */
+bool
+ColumnQuery::run(FILE *fp)
+{
+    ArchiveIndex idx;
+    vector<FlowColumns> flows;
+    unordered_map<u32, u32> last;       /* packet number -> flow */
+    bool need_ts = find(group.begin(), group.end(), COLUMN_TIME) != group.end();
+
+    if (!idx.open(fp))
+        return false;
+    FlowExtractor ex(fp, idx);
+
+    EACH(b, idx.stream_blocks[STREAM_DIFF]) {
+        const IndexBlock *blk = &idx.blocks[*b];
+        if (!ex.load(blk))
+            return false;
+
+        const vector<u8> &buf = ex.raw[STREAM_DIFF];
+        size_t off = 0;
+        for (u64 seq = blk->first_record; off < buf.size(); seq++) {
+            DiffRecord diff;
+            u32 values[NUM_FIELDS];
+            u64 fields = 0;
+            u32 flow;
+
+            if (off + sizeof(diff) > buf.size())
+                return false;
+            memcpy(&diff, buf.data() + off, sizeof(diff));
+            off += sizeof(diff);
+
+            if (diff.num_changes != FIRST_PACKET_ENCODE) {
+                REP(i, diff.num_changes) {
+                    if (off >= buf.size())
+                        return false;
+                    const FieldRecord *field = (const FieldRecord *) (buf.data() + off);
+                    int len = field->value_len + 1;
+                    if (field->field_nr >= NUM_FIELDS || off + 1 + len > buf.size())
+                        return false;
+                    values[field->field_nr] = varint_decode(len, (u8 *) field->field_value);
+                    fields |= 1ULL << field->field_nr;
+                    off += 1 + len;
+                }
+                auto ref = last.find(diff.packet_ref);
+                if (ref == last.end()) {
+                    ERR("Packet %llu refers to unknown packet %u\n", seq, diff.packet_ref);
+                    return false;
+                }
+                flow = ref->second;
+                last.erase(ref);
+
+                /* Packet::apply_diff, on the values alone. Fields of
+                 * headers the flow doesn't have stay absent, as
+                 * set_headers would leave them. */
+                FlowColumns &cols = flows[flow];
+                u32 curr[NUM_FIELDS];
+                REP(i, NUM_FIELDS) {
+                    Header h = static_cast<Header>(i);
+                    curr[i] = cols.values[i] == ~0u ? ~0u
+                        : field_undiff(h, cols.values, curr, (fields >> i) & 1, values[i]);
+                }
+                memcpy(cols.values, curr, sizeof(curr));
+            } else {
+                Packet *p = ex.first_packet(diff.packet_ref, seq);
+                if (!p)
+                    return false;
+                FlowColumns cols;
+                p->get_headers_opt(cols.values);
+                cols.l3_off = p->l3_off;
+                delete[] p->buff;
+                delete p;
+                flow = flows.size();
+                flows.push_back(cols);
+            }
+            last[seq] = flow;
+
+            u64 ts_ns = 0;
+            u32 ifid;
+            if (need_ts && !ex.timestamp(seq, ts_ns, ifid))
+                return false;
+            add(flows[flow], ts_ns);
+            packets++;
+        }
+    }
+    return true;
+}
+
+void
+ColumnQuery::print(FILE *out)
+{
+    vector<pair<QueryKey, QueryRow> > sorted(rows.begin(), rows.end());
+    sort(sorted.begin(), sorted.end(),
+            [](const pair<QueryKey, QueryRow> &a, const pair<QueryKey, QueryRow> &b) {
+                return a.first < b.first;
+            });
+
+    EACH(it, group) fprintf(out, "%-16s", column_name(*it));
+    EACH(it, aggs) {
+        char label[32];
+        switch (it->agg) {
+            case AGG_PACKETS: snprintf(label, sizeof(label), "packets"); break;
+            case AGG_BYTES: snprintf(label, sizeof(label), "bytes"); break;
+            case AGG_SUM: snprintf(label, sizeof(label), "sum:%s", column_name(it->field)); break;
+            case AGG_MIN: snprintf(label, sizeof(label), "min:%s", column_name(it->field)); break;
+            case AGG_MAX: snprintf(label, sizeof(label), "max:%s", column_name(it->field)); break;
+        }
+        fprintf(out, "%20s", label);
+    }
+    fprintf(out, "\n");
+
+    EACH(it, sorted) {
+        REP(i, (int)group.size()) {
+            u64 v = it->first.v[i];
+            if (group[i] != COLUMN_TIME && v == ~0u) {
+                fprintf(out, "%-16s", "-");
+            } else if (is_address(group[i])) {
+                char addr[INET_ADDRSTRLEN];
+                struct in_addr in;
+                in.s_addr = htonl(v);
+                inet_ntop(AF_INET, &in, addr, sizeof(addr));
+                fprintf(out, "%-16s", addr);
+            } else {
+                fprintf(out, "%-16llu", v);
+            }
+        }
+        REP(i, (int)aggs.size()) fprintf(out, "%20llu", it->second.v[i]);
+        fprintf(out, "\n");
+    }
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2014, Stanford University. This file is licensed under Apache 2.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: nikhilh@cs.stanford.com (Nikhil Handigol)
+ *         jvimal@stanford.edu (Vimal Jeyakumar)
+ *         brandonh@cs.stanford.edu (Brandon Heller)
+ */
+
+#ifndef COLUMNS_HH
+#define COLUMNS_HH
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <unordered_map>
+#include "types.hh"
+#include "helper.hh"
+#include "fields.hh"
+
+using namespace std;
+
+#define QUERY_MAX_COLUMNS 8
+
+/* Group columns beyond the header fields */
+#define COLUMN_TIME NUM_FIELDS      /* start of the time bucket, in seconds */
+
+enum Aggregate {
+    AGG_PACKETS,
+    AGG_BYTES,          /* on the wire, as the decoder infers them */
+    AGG_SUM,
+    AGG_MIN,
+    AGG_MAX,
+};
+
+struct QueryAggregate {
+    int agg;
+    int field;          /* of AGG_SUM, AGG_MIN and AGG_MAX */
+};
+
+/* A packet passes if (field & mask) == value */
+struct QueryCondition {
+    int field;
+    u32 mask;
+    u32 value;
+};
+
+struct QueryKey {
+    u64 v[QUERY_MAX_COLUMNS];
+
+    bool operator==(const QueryKey &o) const
+    {
+        return memcmp(v, o.v, sizeof(v)) == 0;
+    }
+    bool operator<(const QueryKey &o) const
+    {
+        REP(i, QUERY_MAX_COLUMNS) {
+            if (v[i] != o.v[i])
+                return v[i] < o.v[i];
+        }
+        return false;
+    }
+};
+
+struct QueryKeyHash {
+    size_t operator()(const QueryKey &k) const
+    {
+        u64 h = 0;
+        REP(i, QUERY_MAX_COLUMNS) h = (h ^ k.v[i]) * 0x9e3779b97f4a7c15ULL;
+        return h;
+    }
+};
+
+struct QueryRow {
+    u64 v[QUERY_MAX_COLUMNS];
+};
+
+/* The header fields of the last packet of a flow, in place of the packet */
+struct FlowColumns {
+    u32 values[NUM_FIELDS];
+    u16 l3_off;
+};
+
+/*
+ * Group-by aggregates over the header fields of the packets of archives.
+ * Diff records are applied to the field values with field_undiff, as
+ * Packet::apply_diff would, but no packet is rebuilt: a Packet is only
+ * parsed for the first packet of each flow, and the timestamp stream is
+ * only decoded if the query groups by time.
+ */
+struct ColumnQuery {
+    vector<int> group;              /* fields, or COLUMN_TIME */
+    vector<QueryAggregate> aggs;
+    vector<QueryCondition> where;
+    u64 bucket_ns;
+
+    unordered_map<QueryKey, QueryRow, QueryKeyHash> rows;
+    u64 packets;                    /* scanned */
+
+    ColumnQuery()
+    {
+        bucket_ns = 0;
+        packets = 0;
+    }
+    bool run(FILE *fp);
+    void add(const FlowColumns &cols, u64 ts_ns);
+    void print(FILE *out);
+};
+
+int column_find(const char *name);
+const char *column_name(int column);
+
+#endif //COLUMNS_HH
@@ -9,11 +9,13 @@
 
 #include <cassert>
 #include <climits>
+#include <algorithm>
 
 #include "compress.hh"
 #include "util.hh"
 #include "helper.hh"
 #include "types.hh"
+#include "instrument.hh"
 
 using namespace std;
 /* DiffRecord functions */
@@ -39,7 +41,7 @@ DiffRecord::print(u32 seq)
         value = varint_decode(len, field->field_value);
         offset += 1 + len;
         /* Finish decoding */
-        printf("\t%s: 0x%llx,\n", HEADER_NAMES[key].c_str(), (u64)value);
+        printf("\t%s: 0x%llx,\n", FIELDS[key].name, (u64)value);
     }
 
 done:
@@ -51,20 +53,38 @@ done:
  * http://videolectures.net/wsdm09_dean_cblirs/
  */
 
-Compressor::Compressor(bool zstd)
+Compressor::Compressor(bool zstd, FILE *archive)
 {
-    fp_ts = dieopenw();
-    fp_firstpkt = dieopenw();
-    fp_diff = dieopenw();
-
-    if (!zstd) {
-        fp_ts_comp = compressed_write_stream(fp_ts);
-        fp_firstpkt_comp = compressed_write_stream(fp_firstpkt);
-        fp_diff_comp = compressed_write_stream(fp_diff);
+    fp_archive = archive;
+    writers[STREAM_TS] = &ts_out;
+    writers[STREAM_FIRSTPKT] = &firstpkt_out;
+    writers[STREAM_DIFF] = &diff_out;
+    REP(i, NUM_STREAMS) workers[i] = NULL;
+    if (archive) {
+        fp_ts = fp_firstpkt = fp_diff = NULL;
+        archive_write_header(archive, zstd);
+        sequencer.offset = sizeof(ArchiveHeader);
+        ts_out.open(archive, STREAM_TS, zstd, true);
+        firstpkt_out.open(archive, STREAM_FIRSTPKT, zstd, true);
+        diff_out.open(archive, STREAM_DIFF, zstd, true);
+        ts_out.sequencer = firstpkt_out.sequencer = diff_out.sequencer = &sequencer;
+    } else {
+        fp_ts = dieopenw();
+        fp_firstpkt = dieopenw();
+        fp_diff = dieopenw();
+        ts_out.open(fp_ts, STREAM_TS, zstd, false);
+        firstpkt_out.open(fp_firstpkt, STREAM_FIRSTPKT, zstd, false);
+        diff_out.open(fp_diff, STREAM_DIFF, zstd, false);
     }
 
-    ts_prev.tv_sec = ~0;
+    ts_prev = ~0ULL;
+    ts_delta = 0;
+    ts_resol = TSRESOL_USEC;
+    ts_ifid = 0;
     first_packet_id = 0;
+    REP(i, FIRSTPKT_CACHE_SIZE) first_cache[i].block = ~0u;
+    first_last.block = ~0u;
+    cross_flow = false;
 
     diff_size = 0, diff_csize = 0;
     firstpkt_size = 0, firstpkt_csize = 0;
@@ -72,6 +92,8 @@ Compressor::Compressor(bool zstd)
     desc_size = 0;
     num_packets = 0;
     use_zstd = zstd;
+    lookahead = FLOW_LOOKAHEAD;
+    exporter = NULL;
 
     bzero(NumFieldChanged, sizeof NumFieldChanged);
     bzero(NumChangePerPacket, sizeof NumChangePerPacket);
@@ -82,48 +104,64 @@ Compressor::Compressor(bool zstd)
 Compressor::~Compressor()
 {
     close();
+    delete[] first_pkt.buff;
 }
 
-void 
-Compressor::seek_end() 
+/* Moves the compression of each stream to a thread of its own; must be
+ * called before the first packet */
+void
+Compressor::start_workers()
 {
-    fseek(fp_ts, 0, SEEK_END);
-    fseek(fp_firstpkt, 0, SEEK_END);
-    fseek(fp_diff, 0, SEEK_END);
-
-    ts_delta_csize = ftell(fp_ts);
-    firstpkt_csize = ftell(fp_firstpkt);
-    diff_csize = ftell(fp_diff);
-
-
+    REP(i, NUM_STREAMS) {
+        workers[i] = new BlockWorker();
+        writers[i]->worker = workers[i];
+        workers[i]->start();
+    }
 }
 
 void 
-Compressor::flush(bool zstd)
+Compressor::flush()
 {
-    flush_compress(zstd);
-    seek_end();
+    flush_compress();
+
+    ts_delta_csize = ts_out.comp_size;
+    firstpkt_csize = firstpkt_out.comp_size;
+    diff_csize = diff_out.comp_size;
 }
 
+/* Compresses the partial blocks; packets written afterwards start new
+ * ones */
 void 
-Compressor::flush_compress(bool zstd)
+Compressor::flush_compress()
 {
-    if (!this->use_zstd) {
-        gzflush(fp_ts_comp, Z_FINISH);
-        gzflush(fp_firstpkt_comp, Z_FINISH);
-        gzflush(fp_diff_comp, Z_FINISH);
-    } else {
-        cpz_zstd_flush(fp_ts);
-        cpz_zstd_flush(fp_firstpkt);
-        cpz_zstd_flush(fp_diff);
+    ts_out.flush();
+    firstpkt_out.flush();
+    diff_out.flush();
+    REP(i, NUM_STREAMS) {
+        if (workers[i])
+            workers[i]->drain();
     }
 }
 
 void 
 Compressor::close() 
 {
-    if (!fp_ts) return;
+    if (!fp_ts && !fp_archive) return;
     flush();
+    REP(i, NUM_STREAMS) {
+        delete workers[i];
+        workers[i] = NULL;
+        writers[i]->worker = NULL;
+    }
+
+    if (exporter)
+        exporter->close_flows(flows);
+
+    if (fp_archive) {
+        write_index();
+        fp_archive = NULL;
+        return;
+    }
 
     fclose(fp_ts);
     fclose(fp_firstpkt);
@@ -134,6 +172,67 @@ Compressor::close()
     fp_diff = NULL;
 }
 
+/* Ends the archive with the index of its blocks and flows */
+void
+Compressor::write_index()
+{
+    IndexHeader hdr;
+    vector<IndexBlock> blocks;
+    vector<u8> index;
+    vector<u32> first_ids, chunks;
+    vector<IndexFlow> iflows;
+
+    REP(s, NUM_STREAMS) {
+        u64 first_record = 0;
+        REP(b, (int)writers[s]->blocks.size()) {
+            const BlockInfo &info = writers[s]->blocks[b];
+            IndexBlock blk;
+            memset(&blk, 0, sizeof(blk));
+            if (s == STREAM_TS)
+                blk = ts_block_state[b];
+            blk.offset = info.offset;
+            blk.stream = s;
+            blk.records = info.records;
+            blk.first_record = first_record;
+            first_record += info.records;
+            blocks.push_back(blk);
+        }
+    }
+    sort(blocks.begin(), blocks.end(), [](const IndexBlock &a, const IndexBlock &b) {
+        return a.offset < b.offset;
+    });
+
+    static_assert(sizeof(((FlowKey *) 0)->key) == FLOW_KEY_LEN, "FlowKey size");
+    EACH(it, flows) {
+        const Flow &flow = (*it)->second;
+        IndexFlow f;
+        memcpy(f.key, (*it)->first.key, FLOW_KEY_LEN);
+        f.packets = flow.packets;
+        f.first_ns = flow.first.ts.tv_sec * NSEC_PER_SEC + flow.first.ts.tv_nsec;
+        f.last_ns = flow.curr.ts.tv_sec * NSEC_PER_SEC + flow.curr.ts.tv_nsec;
+        f.first_ids = first_ids.size();
+        f.num_first_ids = flow.first_ids.size();
+        f.chunks = chunks.size();
+        f.num_chunks = flow.chunks.size();
+        first_ids.insert(first_ids.end(), flow.first_ids.begin(), flow.first_ids.end());
+        chunks.insert(chunks.end(), flow.chunks.begin(), flow.chunks.end());
+        iflows.push_back(f);
+    }
+
+    hdr.tsresol = ts_resol;
+    hdr.num_blocks = blocks.size();
+    hdr.num_flows = iflows.size();
+    hdr.num_first_ids = first_ids.size();
+    hdr.num_chunks = chunks.size();
+    index.insert(index.end(), (u8 *) &hdr, (u8 *) (&hdr + 1));
+    index.insert(index.end(), (u8 *) blocks.data(), (u8 *) (blocks.data() + blocks.size()));
+    index.insert(index.end(), (u8 *) iflows.data(), (u8 *) (iflows.data() + iflows.size()));
+    index.insert(index.end(), (u8 *) first_ids.data(), (u8 *) (first_ids.data() + first_ids.size()));
+    index.insert(index.end(), (u8 *) chunks.data(), (u8 *) (chunks.data() + chunks.size()));
+
+    archive_write_index(fp_archive, use_zstd, index, sequencer.offset);
+}
+
 double 
 Compressor::bpp_normal() 
 {
@@ -201,7 +300,7 @@ Compressor::stats(JSON &j)
     REP(i, NUM_FIELDS) {
         if (!NumFieldChanged[i]) continue;
         float bpp = TotalFieldBytes[i] * 1.0 / num_packets;
-        string header = HEADER_NAMES[static_cast<Header>(i)];
+        string header = FIELDS[i].name;
         JSON ele;
         ele["count"] = V((u64)NumFieldChanged[i]);
         ele["bytes"] = V((u64)TotalFieldBytes[i]);
@@ -231,6 +330,18 @@ Compressor::stats(JSON &j)
     }
     printf("Average: %.3f fchgs/packet\n", avg/total);
     j["FieldChangePerPacket"] = V(jstat);
+
+    /* Per-flow totals are only known at the end */
+    flow_stats.PacketsPerFlow = LogHistogram();
+    EACH(it, flows) {
+        const Flow &flow = (*it)->second;
+        flow_stats.PacketsPerFlow.add(flow.packets);
+        flow_stats.max_duration_sec = max(flow_stats.max_duration_sec,
+                (u64)(flow.curr.ts.tv_sec - flow.first.ts.tv_sec));
+    }
+    jstat = JSON();
+    flow_stats.stats(jstat);
+    j["flow_stats"] = V(jstat);
 }
 
 /* These are for non-compressed diff records */
@@ -238,74 +349,268 @@ template<class T>
 int 
 Compressor::EmitTimestamp(T *obj) 
 {
-    if (!this->use_zstd) {
-        gzwrite(fp_ts_comp, (void *)obj, sizeof(T));
-    } else {
-        cpz_zstd_file(fp_ts, (void *)obj, sizeof(T));
-    }
+    STAGE_TIMER(STAGE_EMIT);
+    ts_out.write(obj, sizeof(T));
     return sizeof(T);
 }
 
 int 
-Compressor::EmitFirstpacket(const u8 *payload, u8 caplen) 
+Compressor::EmitTimestamp(const u8 *buff, int len) 
 {
-    if (!this->use_zstd) {
-        gzwrite(fp_firstpkt_comp, (void *)&caplen, sizeof(caplen));
-        gzwrite(fp_firstpkt_comp, (void *)payload, caplen);
+    STAGE_TIMER(STAGE_EMIT);
+    ts_out.write(buff, len);
+    return len;
+}
+
+/* A FIRSTPKT_DELTA record of payload against ref, back records before
+ * it; against nothing if ref is NULL */
+static int
+encode_first_delta(u8 *out, const u8 *payload, u8 caplen, const FirstPacketRef *ref, u32 back)
+{
+    int ref_len = ref ? ref->caplen : 0;
+    int len = 0;
+    u8 *bitmap;
+
+    out[len++] = FIRSTPKT_DELTA;
+    len += uvarint_encode(back, out + len);
+    out[len++] = caplen;
+    bitmap = out + len;
+    memset(bitmap, 0, (caplen + 7) / 8);
+    len += (caplen + 7) / 8;
+    REP(i, caplen) {
+        if (i < ref_len && payload[i] == ref->data[i])
+            continue;
+        bitmap[i / 8] |= 1 << (i % 8);
+        out[len++] = payload[i];
+    }
+    return len;
+}
+
+/* A FIRSTPKT_FIELDS record of pkt against ref, rebuilt into first_pkt;
+ * 0 if pkt has headers the fields can't turn ref's into */
+int
+Compressor::encode_first_fields(u8 *out, Packet &pkt, const FirstPacketRef *ref)
+{
+    u32 prev[NUM_FIELDS], curr[NUM_FIELDS], values[NUM_FIELDS];
+    u64 written = 0;
+    int len = 0, diffsize = 0;
+    u8 caplen = pkt.caplen;
+    u8 *num_fields;
+
+    if (!caplen)
+        return 0;
+    first_packet_ref(first_pkt, ref->data, ref->caplen, caplen);
+    first_pkt.get_headers_opt(prev);
+    pkt.get_headers_opt(curr);
+
+    out[len++] = FIRSTPKT_FIELDS;
+    len += uvarint_encode(first_packet_id - ref->id, out + len);
+    out[len++] = caplen;
+    num_fields = out + len++;
+    *num_fields = 0;
+    FieldRecord *field = (FieldRecord *) (out + len);
+    REP(i, NUM_FIELDS) {
+        Header key = static_cast<Header>(i);
+        if (!field_diff_fixed(key, prev, curr, values[i]))
+            continue;
+        written |= 1ULL << i;
+        field->field_nr = i;
+        int size = varint_encode(values[i], field->field_value);
+        field->value_len = size - 1;
+        diffsize += 1 + size;
+        field = (FieldRecord *) ((u8 *) field + 1 + size);
+        (*num_fields)++;
+    }
+
+    /* The decoder parses the bytes afresh, so they are checked that way */
+    first_pkt.apply_diff(prev, values, written, true);
+    memset(first_pkt.buff + caplen, 0, PACKET_SLACK);
+    first_pkt.unpack();
+    if (first_pkt.hdr_len != pkt.hdr_len || first_pkt.l3_off != pkt.l3_off
+            || memcmp(first_pkt.buff, pkt.buff, pkt.hdr_len) != 0)
+        return 0;
+    return len + diffsize;
+}
+
+/* Writes a first packet as its bytes, or as a FIRSTPKT_DELTA record
+ * against the last first packet to the same server (key) or the last
+ * first packet, or, with cross_flow, as a FIRSTPKT_FIELDS record against
+ * either of them, whichever is shortest */
+int 
+Compressor::EmitFirstpacket(Packet &pkt, u64 key) 
+{
+    STAGE_TIMER(STAGE_EMIT);
+    FirstPacketRef *slot = &first_cache[(key * 0x9e3779b97f4a7c15ULL >> 32) % FIRSTPKT_CACHE_SIZE];
+    const FirstPacketRef *refs[] = { slot, &first_last };
+    const u8 *payload = pkt.payload;
+    u8 caplen = pkt.caplen;
+    u8 bufs[2][FIRSTPKT_MAX_LEN];
+    int best = -1, len = sizeof(caplen) + caplen;
+    bool fields = false;
+    FirstPacketRef rebuilt;
+
+    /* References can't be made from the next block, should this record
+     * fill up the current one */
+    if (firstpkt_out.raw_len + FIRSTPKT_MAX_LEN <= ARCHIVE_BLOCK_SIZE) {
+        for (const FirstPacketRef *ref : refs) {
+            if (ref->block != firstpkt_out.nblocks)
+                continue;
+            int cur = best == 0;
+            int n = encode_first_delta(bufs[cur], payload, caplen, ref, first_packet_id - ref->id);
+            if (n < len) {
+                len = n;
+                best = cur;
+                fields = false;
+            }
+            /* Only headers parsed from the bytes as captured are kept */
+            if (!cross_flow || pkt.skip_ethernet || (ref == &first_last && ref->id == slot->id))
+                continue;
+            cur = best == 0;
+            n = encode_first_fields(bufs[cur], pkt, ref);
+            if (n && n + FIRSTPKT_FIELDS_MARGIN < len) {
+                len = n;
+                best = cur;
+                fields = true;
+                rebuilt.caplen = caplen;
+                memcpy(rebuilt.data, first_pkt.buff, caplen);
+            }
+        }
+    }
+    /* 0 and 1 byte literals would read as FIRSTPKT_DELTA and
+     * FIRSTPKT_FIELDS */
+    if (best < 0 && caplen <= FIRSTPKT_FIELDS) {
+        len = encode_first_delta(bufs[0], payload, caplen, NULL, 0);
+        best = 0;
+    }
+
+    u8 *rec = firstpkt_out.append(len);
+    if (best >= 0) {
+        COUNT(CTR_FIRST_DELTAS, 1);
+        if (fields)
+            COUNT(CTR_FIRST_FIELDS, 1);
+        memcpy(rec, bufs[best], len);
     } else {
-        cpz_zstd_file(fp_firstpkt, (void *)&caplen, sizeof(caplen));
-        cpz_zstd_file(fp_firstpkt, (void *)payload, caplen);
+        rec[0] = caplen;
+        memcpy(rec + sizeof(caplen), payload, caplen);
     }
-    return caplen + sizeof(caplen);
+
+    /* Later records refer to the packet as the decoder has it */
+    slot->id = first_packet_id;
+    slot->block = firstpkt_out.nblocks;
+    slot->caplen = caplen;
+    memcpy(slot->data, fields ? rebuilt.data : payload, caplen);
+    first_last = *slot;
+    return len;
 }
 
 int 
 Compressor::EmitDiffRecord(u8 *buff, int diffsize) 
 {
+    STAGE_TIMER(STAGE_EMIT);
     int sz = sizeof(struct DiffRecord) + diffsize;
-    if (!this->use_zstd) {
-        gzwrite(fp_diff_comp, (void *)buff, sz);
-    } else {
-        cpz_zstd_file(fp_diff, (void *)buff, sz);
-    }
+    diff_out.write(buff, sz);
     return sz;
 }
 
+/* Must be called before the first packet; timestamps finer than the
+ * resolution are truncated */
+void 
+Compressor::set_ts_resolution(u8 tsresol) 
+{
+    assert(ts_prev == ~0ULL);
+    ts_resol = tsresol;
+}
+
 void 
-Compressor::write_time_stamp(struct timeval &ts) 
+Compressor::write_time_stamp(const struct timespec &ts, u32 ifid) 
 {
+    u64 ticks = ns_to_ticks(ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec, ts_resol);
+    IndexBlock state;
+
+    /* Where decoding can start, if this record begins a block */
+    memset(&state, 0, sizeof(state));
+    state.ts_prev = ts_prev;
+    state.ts_delta = ts_delta;
+    state.ts_ifid = ts_ifid;
+
     /* First timestamp */
-    if (unlikely(ts_prev.tv_sec == ~0)) {
-        ts_delta_size += EmitTimestamp(&ts);
+    if (unlikely(ts_prev == ~0ULL)) {
+        TimestampHeader hdr;
+        hdr.tsresol = ts_resol;
+        hdr.ifid = ifid;
+        hdr.ticks = ticks;
+        ts_delta_size += EmitTimestamp(&hdr);
+        ts_ifid = ifid;
     } 
     else {
-        u64 usec_delta = (ts.tv_sec - ts_prev.tv_sec) * int(1e6);
-        usec_delta += (ts.tv_usec - ts_prev.tv_usec);
+        u8 buff[4 * UVARINT_MAX_LEN];
+        int len = 0;
+        u64 delta = ticks - ts_prev;
+        u64 dod = zigzag_encode(delta - ts_delta);
+        u64 zdelta = zigzag_encode(delta);
+
+        if (unlikely(ifid != ts_ifid)) {
+            len += uvarint_encode(TS_ESC_IFID, buff + len);
+            len += uvarint_encode(ifid, buff + len);
+            ts_ifid = ifid;
+        }
 
-        if (usec_delta >= UINT_MAX) {
-            ERR("Timestamp is wrapping\n");
+        /* Periodic traffic has a dod of 0 (1 byte), bursts a small one;
+         * after a long pause both the pause and the next gap would have
+         * a large dod, so the gap is written directly */
+        if (likely(dod <= zdelta && dod < ~0ULL - TS_NUM_ESC)) {
+            len += uvarint_encode(dod + TS_NUM_ESC, buff + len);
+        } else {
+            len += uvarint_encode(TS_ESC_DELTA, buff + len);
+            len += uvarint_encode(zdelta, buff + len);
         }
 
-        u32 val = usec_delta;
-        ts_delta_size += EmitTimestamp(&val);
+        ts_delta_size += EmitTimestamp(buff, len);
+        ts_delta = delta;
     }
 
-    ts_prev = ts;
+    if (ts_out.records == 1 && fp_archive)
+        ts_block_state.push_back(state);
+    ts_prev = ticks;
+}
+
+/* The server a first packet goes to, by protocol, address and port, or
+ * its MAC addresses if it has no IP header */
+static u64
+first_packet_key(Packet &pkt)
+{
+    u32 hv[NUM_FIELDS];
+    u64 macs = 0;
+    u32 tail = 0;
+
+    pkt.get_headers_opt(hv);
+    if (hv[IP_DST] != ~0u) {
+        u32 port = hv[TCP_DST] != ~0u ? hv[TCP_DST] : hv[UDP_DST];
+        return (u64) hv[IP_DST] << 32 ^ (u64) hv[IP_PROTO] << 16 ^ port;
+    }
+    if (pkt.caplen >= 12) {
+        memcpy(&macs, pkt.payload, sizeof(macs));
+        memcpy(&tail, pkt.payload + sizeof(macs), sizeof(tail));
+    }
+    return macs ^ (u64) tail << 16;
 }
 
 u32 Compressor::write_first_header(Packet &pkt) 
 {
-    firstpkt_size += EmitFirstpacket(pkt.payload, pkt.caplen);
+    COUNT(CTR_FIRST_PACKETS, 1);
+    firstpkt_size += EmitFirstpacket(pkt, first_packet_key(pkt));
     return first_packet_id++;
 }
 
 /* TODO: Switch to using "Emit()" functions as a narrow waist for marshalling data */
 void Compressor::write_diff_packet(Flow &flow, Packet &curr, int first_packet_id) 
 {
-    u8 buff[100];
+    u8 buff[sizeof(DiffRecord) + NUM_FIELDS * (1 + sizeof(u32))];
     DiffRecord *diff = (DiffRecord *)(&buff[0]);
     FieldRecord *field = diff->records;
     int diffsize = 0;
+    int num_changes = 0;
+    int sz;
     u32 *hv_prev = NULL;
     u32 hv_curr[NUM_FIELDS];
 
@@ -325,51 +630,156 @@ void Compressor::write_diff_packet(Flow &flow, Packet &curr, int first_packet_id
         diff->num_changes = 0;
     }
 
-    for (int i = IP_TOS_F; i < NUM_FIELDS; i++) {
+    /* The flow key is the innermost 5-tuple, but the decoder applies the
+     * fields at the offsets of the previous packet of the flow: a packet
+     * with its headers elsewhere restarts the flow. */
+    if (unlikely(!curr.same_layout(flow.prev)))
+        goto restart;
+
+    for (int i = 0; i < NUM_FIELDS; i++) {
         Header key = static_cast<Header>(i);
-        auto value = hv_curr[i];
+        u32 value;
 
-        if (key != IP_ID and (value == hv_prev[key] or value == ~0))
+        if (!field_diff(key, hv_prev, hv_curr, value))
             continue;
 
-        if (key == TCP_SEQ or key == TCP_ACK or key == IP_ID) {
-            value = hv_curr[i] - hv_prev[i];
-        }
-
-        if (key == IP_ID) {
-            if (value == 1) {
-                continue;
-            } else {
-                NumNonOneIPID++;
-            }
-        }
-
-        if (HEADER_WRITE_BITS[key] == 16)
-            value = value & 0xffff;
+        if (key == IP_ID)
+            NumNonOneIPID++;
+        else if (key == TCP_SEQ)
+            flow_stats.TCPSeqDeltas.add(value);
+        else if (key == TCP_ACK)
+            flow_stats.TCPAckDeltas.add(value);
 
         NumFieldChanged[key]++;
-        diff->num_changes++;
+        flow_stats.FieldsChanged[key]++;
+        num_changes++;
         field = encode(field, key, value, diffsize);
     }
 
+    /* num_changes is 4 bits wide and FIRST_PACKET_ENCODE is reserved:
+     * a packet with more changes (typically an inner and outer header
+     * changing together) restarts the flow from a new first packet. */
+    if (unlikely(num_changes >= FIRST_PACKET_ENCODE))
+        goto restart;
+    diff->num_changes = num_changes;
+    flow_stats.NumCompressedFields[num_changes]++;
+    goto write;
+
+restart:
+    COUNT(CTR_FLOW_RESTARTS, 1);
+    diff->packet_ref = write_first_header(curr);
+    diff->num_changes = FIRST_PACKET_ENCODE;
+    diffsize = 0;
+
 write:
-    diff_size += EmitDiffRecord(buff, diffsize);
+    sz = EmitDiffRecord(buff, diffsize);
+    if (fp_archive) {
+        if (diff->num_changes == FIRST_PACKET_ENCODE)
+            flow.first_ids.push_back(diff->packet_ref);
+        if (flow.chunks.empty() || flow.chunks.back() != diff_out.nblocks)
+            flow.chunks.push_back(diff_out.nblocks);
+    }
+    diff_size += sz;
+    flow_stats.total_compressed_bytes += sz;
+    flow_stats.total_compressed_bits += sz * 8;
     NumChangePerPacket[diff->num_changes]++;
 }
 
 void Compressor::write_pkt(Packet &pkt) 
 {
-    FlowKey key(pkt);
-    Flow &flow = flows[key];
-    int first = flow.add_packet(pkt, &flow_stats);
+    FlowKey key;
+    {
+        STAGE_TIMER(STAGE_FLOW_LOOKUP);
+        key = FlowKey(pkt);
+    }
+    write_pkt(pkt, key);
+}
+
+/* key is the FlowKey of pkt, when it was computed ahead, e.g. by the
+ * parse stage of a pipeline */
+void Compressor::write_pkt(Packet &pkt, const FlowKey &key) 
+{
+    Flow *flow;
+
+    {
+        STAGE_TIMER(STAGE_FLOW_LOOKUP);
+        flow = &flows[key];
+    }
+    write_flow_pkt(*flow, pkt);
+    num_packets++;
+    COUNT(CTR_PACKETS, 1);
+    COUNT(CTR_BYTES, pkt.caplen);
+}
+
+/* Same as write_pkt on each of the n packets, in phases over the batch:
+ * all the flow keys, then all the flow table lookups, then the encoding,
+ * so that each phase runs out of a warm cache. Both the lookups and the
+ * encoding prefetch lookahead packets ahead. keys may be NULL. */
+void Compressor::write_pkts(Packet *pkts, const FlowKey *keys, int n)
+{
+    FlowKey batch_keys[WRITE_BATCH];
+    Flow *batch_flows[WRITE_BATCH];
+    u64 bytes = 0;
+
+    for (int base = 0; base < n; base += WRITE_BATCH) {
+        int len = min(n - base, WRITE_BATCH);
+        Packet *p = pkts + base;
+        const FlowKey *k = keys ? keys + base : batch_keys;
+
+        {
+            STAGE_TIMER(STAGE_FLOW_LOOKUP);
+            if (!keys) {
+                REP(i, len) batch_keys[i] = FlowKey(p[i]);
+            }
+            /* The slots of the next packets are fetched while this one
+             * is looked up. Flows are created in packet order, as by
+             * write_pkt. */
+            REP(i, min(lookahead, len)) flows.prefetch(k[i]);
+            REP(i, len) {
+                if (lookahead > 0 && i + lookahead < len)
+                    flows.prefetch(k[i + lookahead]);
+                batch_flows[i] = &flows[k[i]];
+            }
+        }
+        REP(i, len) {
+            if (lookahead > 0 && i + lookahead < len) {
+                __builtin_prefetch(batch_flows[i + lookahead]);
+                __builtin_prefetch(batch_flows[i + lookahead]->hacurr);
+            }
+            write_flow_pkt(*batch_flows[i], p[i]);
+            bytes += p[i].caplen;
+        }
+    }
+    num_packets += n;
+    COUNT(CTR_PACKETS, n);
+    COUNT(CTR_BYTES, bytes);
+}
+
+/* Encodes pkt, which belongs to flow */
+void Compressor::write_flow_pkt(Flow &flow, Packet &pkt)
+{
+    int first;
     int first_packet_id = -1;
+
+    {
+        STAGE_TIMER(STAGE_FLOW_LOOKUP);
+        first = flow.add_packet(pkt, &flow_stats);
+    }
     if (first) {
+        COUNT(CTR_FLOWS, 1);
         first_packet_id = write_first_header(pkt);
     }
 
-    write_time_stamp(pkt.ts);
-    write_diff_packet(flow, pkt, first_packet_id);
-    num_packets++;
+    {
+        STAGE_TIMER(STAGE_TIMESTAMP);
+        write_time_stamp(pkt.ts, pkt.ifid);
+    }
+    {
+        STAGE_TIMER(STAGE_DIFF);
+        write_diff_packet(flow, pkt, first_packet_id);
+    }
+    if (exporter)
+        exporter->add(flows, flow, first);
 }
 
 /* Encodes key, value into curr and returns the next pointer */
@@ -384,5 +794,6 @@ Compressor::encode(FieldRecord *curr, Header key, u32 value, int &diffsize)
     assert (1 <= size and size <= 4);
     diffsize += 1 + size;
     desc_size += 1;
+    COUNT(CTR_FIELDS, 1);
     return (FieldRecord *)(((u8 *) curr) + 1 + size);
 }
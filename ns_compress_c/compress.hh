@@ -18,14 +18,51 @@
 #include "flow.hh"
 #include "helper.hh"
 #include "picojson.h"
-#include "cpz_zstd.h"
+#include "archive.hh"
+#include "pcap_file.h"
 
 using namespace std;
 
-typedef unordered_map<FlowKey, Flow, HashFlowKey> FlowHashTable;
+/* The ts stream starts with a TimestampHeader for the first packet,
+ * followed by one uvarint per packet: the zigzag encoded change of the
+ * inter-packet gap (delta-of-delta, in ticks of 10^-tsresol seconds)
+ * plus TS_NUM_ESC. Values below TS_NUM_ESC are escapes:
+ *   TS_ESC_IFID  uvarint interface id of this and the next packets
+ *   TS_ESC_DELTA uvarint zigzag encoded gap of this packet, used when
+ *                it is shorter than the delta-of-delta (large gaps)
+ * Both escapes precede the packet they apply to. */
+#define TS_ESC_IFID  (0)
+#define TS_ESC_DELTA (1)
+#define TS_NUM_ESC   (2)
 
-extern u8 HEADER_WRITE_BITS[NUM_FIELDS];
-extern map<Header, string> HEADER_NAMES;
+struct TimestampHeader {
+	u8 tsresol;
+	u32 ifid;
+	u64 ticks;
+} __attribute__((packed));
+
+/* Decodes the ts stream after its TimestampHeader one uvarint at a time,
+ * from the state at the start of the stream or of a block */
+struct TsDecoder {
+	u64 ticks;
+	u64 delta;
+	u32 ifid;
+	u64 escape;		/* waiting for its argument, TS_NUM_ESC if none */
+
+	void start(u64 first_ticks, u64 first_delta, u32 first_ifid);
+	/* true once value completes the timestamp of a packet */
+	bool feed(u64 value);
+	bool pending() const
+	{
+		return escape != TS_NUM_ESC;
+	}
+};
+
+/* Packets per phase of Compressor::write_pkts */
+#define WRITE_BATCH 256
+
+/* Packets between the prefetch of a flow table slot and its lookup */
+#define FLOW_LOOKAHEAD 8
 
 struct FieldRecord {
 	/* TODO: ensure endian-ness is correct. */
@@ -42,20 +79,100 @@ struct DiffRecord {
 
 } __attribute__((packed));
 
+/* A firstpkt record is the u8 caplen of a first packet followed by its
+ * caplen bytes, or, from archive version 3 on, a first packet encoded
+ * against an earlier one of the same block:
+ *   u8 FIRSTPKT_DELTA
+ *   uvarint   records back to the reference, 0 for none
+ *   u8 caplen
+ *   (caplen + 7) / 8 bytes of bitmap, bit i set if byte i differs
+ *   the bytes that differ
+ * Bytes past the end of the reference always differ. From version 4 on,
+ * with Compressor::cross_flow, a first packet may also be encoded as the
+ * headers of an earlier one with some fields changed:
+ *   u8 FIRSTPKT_FIELDS
+ *   uvarint   records back to the reference, at least 1
+ *   u8 caplen
+ *   u8 number of FieldRecords, then the FieldRecords of field_diff_fixed
+ * The packet is the reference cut or zero-padded to caplen, with the
+ * fields changed by Packet::apply_diff. Only its headers are the ones
+ * captured (the bytes after them are the reference's), which is all the
+ * decoder outputs. References never leave their block, so each block
+ * decodes on its own. */
+#define FIRSTPKT_DELTA 0
+#define FIRSTPKT_FIELDS 1
+#define FIRSTPKT_CACHE_SIZE 256
+/* Bytes a FIRSTPKT_FIELDS record must save over the other records to be
+ * chosen: field records compress worse than the bytes of a delta */
+#define FIRSTPKT_FIELDS_MARGIN 2
+#define FIRSTPKT_MAX_LEN (1 + UVARINT_MAX_LEN + 1 + 32 + 255)
+
+/* A first packet the next ones of its block can refer to */
+struct FirstPacketRef {
+	u32 id;
+	u32 block;      /* of the firstpkt stream, ~0 if unused */
+	u8 caplen;
+	u8 data[255];
+};
+
+/* Loads into p the reference of a FIRSTPKT_FIELDS record, ref_len bytes
+ * at ref, cut or zero-padded to caplen */
+void first_packet_ref(Packet &p, const u8 *ref, int ref_len, int caplen);
+
+/* The first packets of one firstpkt block, rebuilt from its records */
+struct FirstPacketBlock {
+	u8 version;             /* of the archive, which records may occur */
+	vector<u8> data;        /* caplen and bytes of each first packet */
+	vector<u32> off;        /* of each first packet in data */
+	Packet pkt;             /* FIRSTPKT_FIELDS records are rebuilt in */
+
+	FirstPacketBlock() : version(ARCHIVE_VERSION) {}
+	~FirstPacketBlock()
+	{
+		delete[] pkt.buff;
+	}
+	void clear()
+	{
+		data.clear();
+		off.clear();
+	}
+	int decode(const u8 *rec, size_t avail);
+	/* caplen, then the bytes of first packet i of the block */
+	const u8 *get(u32 i) const
+	{
+		return data.data() + off[i];
+	}
+};
+
 
-struct Compressor {
+/* Without an archive, each stream is written to a temp file of its own
+ * (fp_ts, fp_firstpkt, fp_diff) that reads back as one gzip or zstd file */
+struct Compressor : CacheAligned {
     FILE *fp_ts;
     FILE *fp_firstpkt;
     FILE *fp_diff;
+    FILE *fp_archive;
 
-    gzFile fp_ts_comp;
-    gzFile fp_firstpkt_comp;
-    gzFile fp_diff_comp;
+    BlockWriter ts_out;
+    BlockWriter firstpkt_out;
+    BlockWriter diff_out;
+    BlockWriter *writers[NUM_STREAMS];
+    BlockWorker *workers[NUM_STREAMS];  /* one per stream, if started */
+    BlockSequencer sequencer;
+    vector<IndexBlock> ts_block_state;  /* ts decoder state per ts block */
 
     bool use_zstd;
 
-    struct timeval ts_prev;
+    u64 ts_prev;            /* ticks, ~0 before the first packet */
+    u64 ts_delta;           /* previous gap */
+    u8 ts_resol;
+    u32 ts_ifid;
     u32 first_packet_id;
+    /* Earlier first packets, by the server they go to, and the last one */
+    FirstPacketRef first_cache[FIRSTPKT_CACHE_SIZE];
+    FirstPacketRef first_last;
+    bool cross_flow;        /* FIRSTPKT_FIELDS records may be written */
+    Packet first_pkt;       /* which are rebuilt here as the decoder will */
 
     size_t diff_size, diff_csize;
     size_t firstpkt_size, firstpkt_csize;
@@ -71,57 +188,79 @@ struct Compressor {
 
     FlowHashTable flows;
     FlowStats flow_stats;
+    int lookahead;          /* FLOW_LOOKAHEAD, 0 for no prefetching */
+    FlowExporter *exporter; /* gets the flow records, if set */
 
-    Compressor(bool zstd = false);
+    Compressor(bool zstd = false, FILE *archive = NULL);
     ~Compressor();
-    void seek_end();
-    void flush_compress(bool zstd=false);
-    void flush(bool zstd=false);
+    void start_workers();
+    void flush_compress();
+    void flush();
     void close();
+    void write_index();
     double bpp_normal();
     double bpp_compress();
     void stats(JSON &j);
     template<class T> int EmitTimestamp(T *obj);
-    int EmitFirstpacket(const u8 *payload, u8 caplen);
+    int EmitTimestamp(const u8 *buff, int len);
+    int EmitFirstpacket(Packet &pkt, u64 key);
+    int encode_first_fields(u8 *out, Packet &pkt, const FirstPacketRef *ref);
     int EmitDiffRecord(u8 *buff, int diffsize);
     FieldRecord *encode(FieldRecord *curr, Header key, u32 value, int &diffsize);
     u32 write_first_header(Packet &pkt);
-    void write_time_stamp(struct timeval &ts);
+    void set_ts_resolution(u8 tsresol);
+    void write_time_stamp(const struct timespec &ts, u32 ifid);
     void write_diff_packet(Flow &flow, Packet &curr, int first_packet_id);
     void write_pkt(Packet &pkt);
+    void write_pkt(Packet &pkt, const FlowKey &key);
+    void write_pkts(Packet *pkts, const FlowKey *keys, int n);
+    void write_flow_pkt(Flow &flow, Packet &pkt);
 };
 
-struct Decompressor {
+/* The last packet decoded of a flow, which the diff of its next packet
+ * refers to; flow is -1 when the flows aren't known */
+struct LastPacket {
+    Packet *pkt;
+    int flow;
+};
 
-    FILE *fp_ts;
-    FILE *fp_firstpkt;
-    FILE *fp_diff;
+struct Decompressor {
 
-    gzFile fp_ts_comp;
-    gzFile fp_firstpkt_comp;
-    gzFile fp_diff_comp;
-    gzFile fp_out_comp;
+    /* The archive, or the stream files, mapped; the streams are decoded a
+     * block at a time and their records parsed where they were decoded */
+    MappedFile files[NUM_STREAMS];
+    StreamCursor in[NUM_STREAMS];
 
-    // Data initialized from the files.
-    vector<struct timeval> ts;
-    vector<Packet*> first_packets;
-    struct timeval ts_first;
+    TimestampHeader ts_first;
 
     // Intermediate data structures used during decompression:
-    struct timeval ts_prev;
+    TsDecoder ts_dec;
     // recent_packets stores the most recently-seen packet for each flow.
     // Required because the compressor output format gives a reference to
     // either:
     //    (1) the first packet of a flow, if nchanges is zero
     // or (2) the last-seen packet of a flow
-    unordered_map<uint, Packet*> recent_packets;
+    // The packet of a flow is updated in place by the flow's next diff.
+    unordered_map<uint, LastPacket> recent_packets;
+
+    // First packets are parsed when a diff refers to them. Those read
+    // ahead of their diff wait here as raw bytes.
+    u32 first_next;             // id of the next record of the firstpkt stream
+    FirstPacketBlock first_block;   // rebuilt so far of the current block
+    unordered_map<u32, vector<u8> > first_pending;
+
+    // With the index of a version 2 archive, the state of a flow is freed
+    // after its last packet, and when it restarts from a new first packet
+    vector<u32> first_flow;     // first packet id -> flow
+    vector<u32> flow_left;      // packets still to come
+    vector<u32> flow_last;      // its packet in recent_packets, ~0 if none
+    Packet *retired;            // returned last, freed on the next call
 
-    // Total no. of packets in the system (inferred from reading the timestamps)
-    int num_packets;
     // Sequence no. of the next packet to be decoded
     u32 seq;
 
-    Decompressor(int fd_ts, int fd_firstpkt, int fd_diff);
+    Decompressor(int fd_ts, int fd_firstpkt, int fd_diff, bool zstd = false);
+    Decompressor(FILE *archive);
     ~Decompressor() 
     {
         close();
@@ -129,25 +268,15 @@ struct Decompressor {
     void close();
     void setup();
     void read_first_timestamp();
-    void read_ts_deltas();
-    void read_all_ts() 
-    {
-        read_ts_deltas();
-        num_packets = ts.size();
-    }
-    void print_all_ts() 
-    {
-        EACH(it, ts) {
-            print_timestamp((struct timeval) *it);
-        }
-    }
-    inline u8 read_caplen();
-    void read_one_packet();
-    void read_all_first_packets();
-    u64 read_nbytes(int len);
+    bool read_ts_uvarint(u64 &value);
+    void read_timestamp(u64 &ts_ns, u32 &ifid);
+    Packet *first_packet(u32 id, uint packet_index);
     Packet *read_one_diff(struct pcap_pkthdr* hdr);
-    Packet *reconstruct_pcap(DiffRecord* diff, uint packet_index, struct pcap_pkthdr* hdr);
+    Packet *reconstruct_pcap(const DiffRecord* diff, uint packet_index, struct pcap_pkthdr* hdr);
+    /* The packet returned is valid until the next call */
     Packet *read_pkt(struct pcap_pkthdr *hdr);
+    Packet *read_pkt(CaptureRecord &rec);
+    u64 write_capture(CaptureWriter &out);
     void stats(JSON &json);
 };
 
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include "helper.hh"
+#include "cpz_codec.h"
+#include "cpz_gzip.h"
+#include "cpz_zstd.h"
+#include "cpz_ns.h"
+#include "instrument.hh"
+
+/* In the order of the result.csv columns */
+const Codec CODECS[] = {
+    { "netsight_gzip", cpz_ns_gzip_run, true },
+    { "netsight_zstd", cpz_ns_zstd_run, true },
+    { "gzip", cpz_gzip_run, false },
+    { "zstandard", cpz_zstd_run, false },
+};
+
+const int NUM_CODECS = sizeof(CODECS) / sizeof(CODECS[0]);
+
+u64 now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const Codec *codec_find(const char *name) {
+    REP(i, NUM_CODECS) {
+        if (strcmp(CODECS[i].name, name) == 0)
+            return &CODECS[i];
+    }
+    return NULL;
+}
+
+/* "-" is stdin */
+FILE *open_input(const char *file_name) {
+    FILE *fp = strcmp(file_name, "-") == 0 ? stdin : fopen(file_name, "rb");
+    if (!fp)
+        ERR("Cannot open %s\n", file_name);
+    return fp;
+}
+
+void close_input(FILE *fp) {
+    if (fp && fp != stdin)
+        fclose(fp);
+}
+
+bool write_output(FILE *out, const void *buf, size_t len) {
+    if (out && fwrite(buf, 1, len, out) != len) {
+        ERR("Cannot write output\n");
+        return false;
+    }
+    return true;
+}
+
+/* Runs codec on file_name and describes the run in j, with the stage
+ * timers and counters of the instrumentation layer */
+bool cpz_run(const Codec &codec, const char *file_name, JSON &j, FILE *out) {
+    CodecStats st{};
+
+    instr.reset();
+    u64 start = now_ns();
+    if (!codec.run(file_name, out, st))
+        return false;
+    u64 time_ns = now_ns() - start;
+
+    j["codec"] = V(codec.name);
+    j["input"] = V(file_name);
+    j["packets"] = V(st.packets);
+    j["uncomp_size"] = V(st.uncomp_size);
+    j["comp_size"] = V(st.comp_size);
+    j["compression_rate"] = V(((double) st.uncomp_size - st.comp_size) / st.uncomp_size * 100);
+    j["time_us"] = V(time_ns / 1000);
+    instr.stats(j);
+    return true;
+}
+
+/* Prints the two lines per codec of the text report; every codec is
+ * timed with the same clock around the same scope */
+int cpz_run_and_report(const Codec &codec, const char *file_name, FILE *out, ostream &os) {
+    JSON j;
+
+    if (!cpz_run(codec, file_name, j, out))
+        return 0;
+    os << codec.name << " compression rate: " << j["compression_rate"].get<double>() << "%" << endl;
+    os << codec.name << " time consumption: " << j["time_us"].to_str() << " μs" << endl;
+    return 1;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+#ifndef NS_COMPRESS_CPZ_CODEC_H
+#define NS_COMPRESS_CPZ_CODEC_H
+
+#include <cstdio>
+#include <iostream>
+#include "types.hh"
+
+using namespace std;
+
+/* Result of compressing one input end-to-end, from opening the file to
+ * the last compressed byte */
+struct CodecStats {
+    u64 packets;        /* 0 for codecs that don't parse packets */
+    u64 uncomp_size;    /* bytes the codec compressed */
+    u64 comp_size;
+};
+
+/* Inputs and outputs are streamed through fixed-size buffers: file_name
+ * may be "-" for stdin, and the compressed output goes to out, or is only
+ * counted when out is NULL */
+typedef bool (*CodecRun)(const char *file_name, FILE *out, CodecStats &st);
+
+struct Codec {
+    const char *name;
+    CodecRun run;
+    bool netsight;      /* parses packets, accepts .ns dumps */
+};
+
+extern const Codec CODECS[];
+extern const int NUM_CODECS;
+
+#define STREAM_CHUNK (256 << 10)
+
+u64 now_ns();
+const Codec *codec_find(const char *name);
+FILE *open_input(const char *file_name);
+void close_input(FILE *fp);
+bool write_output(FILE *out, const void *buf, size_t len);
+bool cpz_run(const Codec &codec, const char *file_name, JSON &j, FILE *out = NULL);
+int cpz_run_and_report(const Codec &codec, const char *file_name, FILE *out = NULL,
+        ostream &os = cout);
+
+#endif //NS_COMPRESS_CPZ_CODEC_H
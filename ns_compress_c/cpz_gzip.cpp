@@ -7,59 +7,64 @@
 
 #include "cpz_gzip.h"
 
-// gzCompress: do the compressing
-int cpz_gzip(const char *file_name) {
+// gzCompress: do the compressing, STREAM_CHUNK bytes at a time
+bool cpz_gzip_run(const char *file_name, FILE *out, CodecStats &st) {
     z_stream c_stream;
-    int err = 0;
+    int err = Z_OK;
     int windowBits = 15;
     int GZIP_ENCODING = 16;
-    string tmp;
-    char *dest, *src;
-    struct timeval start{}, end{};
-    struct timezone tz{};
-    ull time = 0, start_time;
+    int flush;
+    vector<u8> src(STREAM_CHUNK), dest(STREAM_CHUNK);
 
-    ifstream in(file_name, ios::in | ios::binary);
-    if (!in.is_open()) {
-        cout << "Error opening file";
-        exit(1);
-    }
-    stringstream ss;
-    ss << in.rdbuf();
-    tmp = ss.str();
-    int len = tmp.length();
-    src = new char[len];
-    memcpy(src, tmp.c_str(), len * sizeof(char));
-    dest = new char[len];
+    FILE *in = open_input(file_name);
+    if (!in)
+        return false;
 
     c_stream.zalloc = (alloc_func) nullptr;
     c_stream.zfree = (free_func) nullptr;
     c_stream.opaque = (voidpf) nullptr;
     if (deflateInit2(&c_stream, 6, Z_DEFLATED,
-                     windowBits | GZIP_ENCODING, 9, Z_DEFAULT_STRATEGY) != Z_OK)
-        return -1;
-    c_stream.next_in = (Bytef *) src;
-    c_stream.avail_in = len;
-    c_stream.next_out = (Bytef *) dest;
-    c_stream.avail_out = len;
-
-    gettimeofday(&start, &tz);
-    start_time = start.tv_sec * 1000000 + start.tv_usec;
-    while (c_stream.avail_in != 0 && c_stream.total_out < len) {
-        if (deflate(&c_stream, Z_NO_FLUSH) != Z_OK) return -1;
+                     windowBits | GZIP_ENCODING, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        close_input(in);
+        return false;
     }
-    if (c_stream.avail_in != 0) return c_stream.avail_in;
-    for (;;) {
-        if ((err = deflate(&c_stream, Z_FINISH)) == Z_STREAM_END) break;
-        if (err != Z_OK) {
-            cout << err;
-            return -1;
+
+    do {
+        {
+            STAGE_TIMER(STAGE_READ);
+            c_stream.avail_in = fread(src.data(), 1, src.size(), in);
+        }
+        if (ferror(in)) {
+            err = Z_ERRNO;
+            break;
         }
+        flush = feof(in) ? Z_FINISH : Z_NO_FLUSH;
+        c_stream.next_in = (Bytef *) src.data();
+
+        do {
+            c_stream.next_out = (Bytef *) dest.data();
+            c_stream.avail_out = dest.size();
+            {
+                STAGE_TIMER(STAGE_FLUSH);
+                err = deflate(&c_stream, flush);
+            }
+            if (!write_output(out, dest.data(), dest.size() - c_stream.avail_out))
+                err = Z_ERRNO;
+        } while (c_stream.avail_out == 0 && err != Z_ERRNO);
+    } while (flush != Z_FINISH && err != Z_ERRNO);
+    close_input(in);
+
+    if (err != Z_STREAM_END) {
+        ERR("ERROR WITH GZIP: %d\n", err);
+        deflateEnd(&c_stream);
+        return false;
     }
-    gettimeofday(&end, &tz);
-    time += (end.tv_sec * 1000000 + end.tv_usec - start_time);
-    if (deflateEnd(&c_stream) != Z_OK) return -1;
-    cout << "gzip compression rate: " << ((double) c_stream.total_in - c_stream.total_out) / c_stream.total_in * 100 << "%" << endl;
-    cout << "gzip time consumption: " << time << " μs" << endl;
-    return 1;
-}
\ No newline at end of file
+    st.uncomp_size = c_stream.total_in;
+    st.comp_size = c_stream.total_out;
+    return deflateEnd(&c_stream) == Z_OK;
+}
+
+int cpz_gzip(const char *file_name) {
+    Codec codec = { "gzip", cpz_gzip_run, false };
+    return cpz_run_and_report(codec, file_name);
+}
@@ -16,8 +16,11 @@
 #include <ctime>
 #include <sys/time.h>
 #include "types.hh"
+#include "cpz_codec.h"
+#include "instrument.hh"
 using namespace std;
 
+bool cpz_gzip_run(const char *file_name, FILE *out, CodecStats &st);
 int cpz_gzip(const char* file_name);
 
 #endif //NS_COMPRESS_CPZ_GZIP_H
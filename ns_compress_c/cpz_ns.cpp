@@ -5,83 +5,255 @@
  * Author: linh20@mails.tsinghua.eud.cn
  */
 
+#include <thread>
 #include "cpz_ns.h"
+#include "ring.hh"
 
-int cpz_ns_gzip(const vector<string> &packets) {
-    Compressor c;
+bool cpz_ns_pipeline = false;
+int cpz_ns_lookahead = FLOW_LOOKAHEAD;
+bool cpz_ns_cross_flow = false;
+const char *cpz_ns_flow_records = NULL;
+
+template<class Source>
+static inline bool read_record(Source &src, CaptureRecord &rec) {
+    STAGE_TIMER(STAGE_READ);
+    return src.next(rec);
+}
+
+/* Loads rec into p and unpacks it. Touches no globals, so that it can
+ * run on the parse thread of the pipeline. */
+static void load_packet(Packet &p, const CaptureRecord &rec, u32 packet_number) {
+    p.load(rec.data, rec.caplen, packet_number, rec.caplen);
+    p.ts.tv_sec = rec.ts_ns / NSEC_PER_SEC;
+    p.ts.tv_nsec = rec.ts_ns % NSEC_PER_SEC;
+    p.ifid = rec.ifid;
+    {
+        STAGE_TIMER(STAGE_PARSE);
+        p.unpack();
+    }
+}
+
+/* load_packet for a p reused across packets, which also sizes the
+ * global packet buffers after rec */
+void load_record(Packet &p, const CaptureRecord &rec, u32 packet_number) {
+    PACKET_BUFF_SIZE = rec.caplen + 4;
+    MAX_PKT_SIZE = PACKET_BUFF_SIZE + 4096;
+    load_packet(p, rec, packet_number);
+}
+
+/* Sets up c as the options of the netsight codecs ask */
+static bool configure(Compressor &c, FlowExporter &exporter) {
+    c.lookahead = cpz_ns_lookahead;
+    c.cross_flow = cpz_ns_cross_flow;
+    if (cpz_ns_flow_records) {
+        if (!exporter.open(cpz_ns_flow_records))
+            return false;
+        c.exporter = &exporter;
+    }
+    return true;
+}
+
+/* Without out, the streams go to temp files */
+template<class Source>
+static bool cpz_ns(Source &src, bool zstd, FILE *out, CodecStats &st) {
+    FlowExporter exporter;
+    Compressor c(zstd, out);
+    if (!configure(c, exporter))
+        return false;
+    CaptureRecord rec{};
+    vector<Packet> batch(WRITE_BATCH);
+    int n = 0;
     int packet_number = 0;
     size_t uncomp_size = 0;
-    struct timeval start{}, end{};
-    ull time = 0, start_time;
-    struct timezone tz{};
-
-    int k = 0;
-
-    for (auto &i : packets) {
-        PACKET_BUFF_SIZE = i.size() + 1;
-        MAX_PKT_SIZE = PACKET_BUFF_SIZE + 4096;
-        u8 *buf = new u8[PACKET_BUFF_SIZE];
-        bzero(buf, PACKET_BUFF_SIZE);
-        size_t buflen;
-        byteify_packet(i.c_str(), buf, &buflen);
-        Packet p(buf, buflen, 0, packet_number++, buflen);
-
-        gettimeofday(&start, &tz);
-        start_time = start.tv_sec * 1000000 + start.tv_usec;
-        c.write_pkt(p);
-        gettimeofday(&end, &tz);
-        time += (end.tv_sec * 1000000 + end.tv_usec - start_time);
-
-        uncomp_size += buflen;
-        k++;
-        delete[] buf;
+
+    /* Interfaces are declared before their first packet; timestamps are
+     * kept at the finest resolution among those of the first packet */
+    bool more = read_record(src, rec);
+    c.set_ts_resolution(src.finest_tsresol());
+    for (; more; more = read_record(src, rec)) {
+        load_record(batch[n++], rec, packet_number++);
+        uncomp_size += rec.caplen;
+        if (n == WRITE_BATCH) {
+            c.write_pkts(batch.data(), NULL, n);
+            n = 0;
+        }
     }
-    gettimeofday(&start, &tz);
-    start_time = start.tv_sec * 1000000 + start.tv_usec;
-    c.flush();
-    gettimeofday(&end, &tz);
-    time += (end.tv_sec * 1000000 + end.tv_usec - start_time);
+    c.write_pkts(batch.data(), NULL, n);
+    c.close();
 
-    size_t comp_size = c.diff_csize + c.ts_delta_csize + c.firstpkt_csize;
-    cout << "netsight_gzip compression rate: " << ((double) uncomp_size - comp_size) / uncomp_size * 100 << "%" << endl;
-    cout << "netsight_gzip time consumption: " << time << " μs" << endl;
+    st.packets = packet_number;
+    st.uncomp_size = uncomp_size;
+    st.comp_size = c.diff_csize + c.ts_delta_csize + c.firstpkt_csize;
+    return true;
+}
+
+/* Pipelined mode: reading and parsing run on threads of their own and
+ * hand batches of packets, with their flow keys, to the calling thread,
+ * which encodes them; the Compressor's workers compress the blocks of
+ * each stream. Each pair of stages shares two SPSC rings, one of full batches and one
+ * of batches to refill, so nothing is allocated once the batches are
+ * warm. The archive is the same as without the pipeline. */
+#define PIPELINE_BATCH WRITE_BATCH
+#define PIPELINE_DEPTH 8        /* batches between two stages */
+
+struct RecordBatch {
+    int n;
+    u8 tsresol;                 /* finest_tsresol() after its first record */
+    CaptureRecord recs[PIPELINE_BATCH];
+    u32 offset[PIPELINE_BATCH]; /* of the record bytes in data */
+    vector<u8> data;
+};
 
-    return 1;
+struct PacketBatch {
+    int n;
+    u8 tsresol;
+    Packet pkts[PIPELINE_BATCH];
+    FlowKey keys[PIPELINE_BATCH];
+};
+
+/* A NULL batch on full ends the stream */
+template<class Batch>
+struct BatchLink : CacheAligned {
+    SpscRing<Batch *, PIPELINE_DEPTH> full;
+    SpscRing<Batch *, PIPELINE_DEPTH> empty;
+    Batch batches[PIPELINE_DEPTH];
+
+    BatchLink()
+    {
+        REP(i, PIPELINE_DEPTH) empty.push(&batches[i]);
+    }
+};
+
+template<class Source>
+static void pipeline_read(Source *src, BatchLink<RecordBatch> *out, Instrument *thread_instr) {
+    CaptureRecord rec{};
+    RecordBatch *b = NULL;
+
+    while (read_record(*src, rec)) {
+        if (!b) {
+            b = out->empty.pop();
+            b->n = 0;
+            b->tsresol = src->finest_tsresol();
+            b->data.clear();
+        }
+        b->offset[b->n] = b->data.size();
+        b->data.insert(b->data.end(), rec.data, rec.data + rec.caplen);
+        b->recs[b->n++] = rec;
+        if (b->n == PIPELINE_BATCH) {
+            out->full.push(b);
+            b = NULL;
+        }
+    }
+    if (b)
+        out->full.push(b);
+    out->full.push(NULL);
+    *thread_instr = instr;
 }
 
-int cpz_ns_zstd(const vector<string> &packets) {
-    Compressor c(true);
-    int packet_number = 0;
+static void pipeline_parse(BatchLink<RecordBatch> *in, BatchLink<PacketBatch> *out,
+        Instrument *thread_instr) {
+    u32 packet_number = 0;
+    RecordBatch *rb;
+
+    while ((rb = in->full.pop())) {
+        PacketBatch *pb = out->empty.pop();
+        pb->n = rb->n;
+        pb->tsresol = rb->tsresol;
+        REP(i, rb->n) {
+            CaptureRecord &rec = rb->recs[i];
+            rec.data = rb->data.data() + rb->offset[i];
+            load_packet(pb->pkts[i], rec, packet_number++);
+            STAGE_TIMER(STAGE_FLOW_LOOKUP);
+            pb->keys[i] = FlowKey(pb->pkts[i]);
+        }
+        in->empty.push(rb);
+        out->full.push(pb);
+    }
+    out->full.push(NULL);
+    *thread_instr = instr;
+}
+
+template<class Source>
+static bool cpz_ns_pipelined(Source &src, bool zstd, FILE *out, CodecStats &st) {
+    FlowExporter exporter;
+    Compressor c(zstd, out);
+    if (!configure(c, exporter))
+        return false;
+    BatchLink<RecordBatch> *records = new BatchLink<RecordBatch>();
+    BatchLink<PacketBatch> *packets = new BatchLink<PacketBatch>();
+    Instrument read_instr, parse_instr;
+    u64 packet_number = 0;
     size_t uncomp_size = 0;
-    struct timeval start{}, end{};
-    ull time = 0, start_time;
-    struct timezone tz{};
-
-    int k = 0;
-
-    for (auto &i : packets) {
-        PACKET_BUFF_SIZE = i.size() + 1;
-        MAX_PKT_SIZE = PACKET_BUFF_SIZE + 4096;
-        u8 *buf = new u8[PACKET_BUFF_SIZE];
-        bzero(buf, PACKET_BUFF_SIZE);
-        size_t buflen;
-        byteify_packet(i.c_str(), buf, &buflen);
-        Packet p(buf, buflen, 0, packet_number++, buflen);
-        c.write_pkt(p);
-
-        uncomp_size += buflen;
-        k++;
-        delete[] buf;
+    PacketBatch *b;
+
+    c.start_workers();
+    thread reader(pipeline_read<Source>, &src, records, &read_instr);
+    thread parser(pipeline_parse, records, packets, &parse_instr);
+
+    while ((b = packets->full.pop())) {
+        if (packet_number == 0)
+            c.set_ts_resolution(b->tsresol);
+        c.write_pkts(b->pkts, b->keys, b->n);
+        REP(i, b->n) uncomp_size += b->pkts[i].caplen;
+        packet_number += b->n;
+        packets->empty.push(b);
     }
-    gettimeofday(&start, &tz);
-    start_time = start.tv_sec * 1000000 + start.tv_usec;
-    c.flush(true);
-    gettimeofday(&end, &tz);
-    time += (end.tv_sec * 1000000 + end.tv_usec - start_time);
-
-    size_t comp_size = c.diff_csize + c.ts_delta_csize + c.firstpkt_csize;
-    cout << "netsight_zstd compression rate: " << ((double) uncomp_size - comp_size) / uncomp_size * 100 << "%" << endl;
-    cout << "netsight_zstd time consumption: " << time << " μs" << endl;
-
-    return 1;
-}
\ No newline at end of file
+    reader.join();
+    parser.join();
+    instr.merge(read_instr);
+    instr.merge(parse_instr);
+    c.close();
+    delete records;
+    delete packets;
+
+    st.packets = packet_number;
+    st.uncomp_size = uncomp_size;
+    st.comp_size = c.diff_csize + c.ts_delta_csize + c.firstpkt_csize;
+    return true;
+}
+
+/* .ns hex dumps, or pcap/pcapng captures (also from stdin) */
+static bool cpz_ns_file(const char *file_name, bool zstd, FILE *out, CodecStats &st) {
+    size_t len = strlen(file_name);
+
+    if (len > 3 && strcmp(file_name + len - 3, ".ns") == 0) {
+        NsReader reader;
+        if (!reader.open(file_name))
+            return false;
+        if (cpz_ns_pipeline)
+            return cpz_ns_pipelined(reader, zstd, out, st);
+        return cpz_ns(reader, zstd, out, st);
+    }
+
+    CaptureReader reader;
+    if (!reader.open(file_name))
+        return false;
+    if (cpz_ns_pipeline)
+        return cpz_ns_pipelined(reader, zstd, out, st);
+    return cpz_ns(reader, zstd, out, st);
+}
+
+bool cpz_ns_gzip_run(const char *file_name, FILE *out, CodecStats &st) {
+    return cpz_ns_file(file_name, false, out, st);
+}
+
+bool cpz_ns_zstd_run(const char *file_name, FILE *out, CodecStats &st) {
+    return cpz_ns_file(file_name, true, out, st);
+}
+
+/* The captures of src, merged by timestamp, into one archive */
+bool cpz_ns_merge_run(CaptureMerger &src, bool zstd, FILE *out, CodecStats &st) {
+    if (cpz_ns_pipeline)
+        return cpz_ns_pipelined(src, zstd, out, st);
+    return cpz_ns(src, zstd, out, st);
+}
+
+int cpz_ns_gzip(const char *file_name) {
+    Codec codec = { "netsight_gzip", cpz_ns_gzip_run, true };
+    return cpz_run_and_report(codec, file_name);
+}
+
+int cpz_ns_zstd(const char *file_name) {
+    Codec codec = { "netsight_zstd", cpz_ns_zstd_run, true };
+    return cpz_run_and_report(codec, file_name);
+}
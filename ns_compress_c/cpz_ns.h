@@ -20,10 +20,28 @@
 #include "helper.hh"
 #include "cpz_gzip.h"
 #include "cpz_zstd.h"
+#include "pcap_file.h"
+#include "ns_file.h"
+#include "cpz_codec.h"
+#include "instrument.hh"
 
 using namespace std;
 
-int cpz_ns_gzip(const vector<string>& packets);
-int cpz_ns_zstd(const vector<string>& packets);
+/* Runs the netsight codecs as a reader, parser, encoder and compressor
+ * thread pipeline */
+extern bool cpz_ns_pipeline;
+/* Compressor::lookahead of the netsight codecs */
+extern int cpz_ns_lookahead;
+/* Compressor::cross_flow of the netsight codecs */
+extern bool cpz_ns_cross_flow;
+/* File for a record per flow of the netsight codecs, NULL for none */
+extern const char *cpz_ns_flow_records;
+
+void load_record(Packet &p, const CaptureRecord &rec, u32 packet_number);
+bool cpz_ns_gzip_run(const char *file_name, FILE *out, CodecStats &st);
+bool cpz_ns_zstd_run(const char *file_name, FILE *out, CodecStats &st);
+bool cpz_ns_merge_run(CaptureMerger &src, bool zstd, FILE *out, CodecStats &st);
+int cpz_ns_gzip(const char *file_name);
+int cpz_ns_zstd(const char *file_name);
 
 #endif //NS_COMPRESS_CPZ_NS_H
@@ -8,64 +8,60 @@
 #include "cpz_zstd.h"
 
 
-int cpz_zstd(const char* file_name)
+/* Streams the input through a ZSTD_CStream, one input buffer at a time */
+bool cpz_zstd_run(const char *file_name, FILE *out, CodecStats &st)
 {
-    string tmp;
-    char *dest, *src;
-    struct timeval start{}, end{};
-    struct timezone tz{};
-    ull time = 0, start_time;
-
-    ifstream in(file_name, ios::in | ios::binary);
-    if (!in.is_open()) {
-        cout << "Error opening file";
-        exit(1);
-    }
-    stringstream ss;
-    ss << in.rdbuf();
-    tmp = ss.str();
-    int len = tmp.length();
-    src = new char[len];
-    memcpy(src, tmp.c_str(), len * sizeof(char));
-    dest = new char[len];
-
-    gettimeofday(&start, &tz);
-    start_time = start.tv_sec * 1000000 + start.tv_usec;
-    size_t const c_size = ZSTD_compress(dest, len, src, len, 15);
-    gettimeofday(&end, &tz);
-    time += (end.tv_sec * 1000000 + end.tv_usec - start_time);
-    cout << "zstandard compression rate: " << ((double) len - c_size) / len * 100 << "%" << endl;
-    cout << "zstandard time consumption: " << time << " μs" << endl;
-    return 1;
-}
+    vector<u8> src(ZSTD_CStreamInSize()), dest(ZSTD_CStreamOutSize());
+    ZSTD_EndDirective mode;
+    size_t remaining = 0;
+    bool ok = true;
 
-int cpz_zstd_flush(FILE* file)
-{
-    void *dest, *src;
+    FILE *in = open_input(file_name);
+    if (!in)
+        return false;
 
-    fseek(file, 0L, SEEK_END);
-    size_t len = ftell(file);
-    size_t dst_cap = ZSTD_compressBound(len);
-    rewind(file);
-    src = malloc(len);
-    dest = malloc(dst_cap);
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, 15);
+    st.uncomp_size = 0;
+    st.comp_size = 0;
 
-    if (fread(src, 1, len, file) != len) {
-        ERR("ERROR READ\n");
-    }
+    do {
+        size_t len;
+        {
+            STAGE_TIMER(STAGE_READ);
+            len = fread(src.data(), 1, src.size(), in);
+        }
+        if (ferror(in)) {
+            ok = false;
+            break;
+        }
+        st.uncomp_size += len;
+        mode = feof(in) ? ZSTD_e_end : ZSTD_e_continue;
 
-    size_t const c_size = ZSTD_compress(dest, dst_cap, src, len, 5);
-    if (ZSTD_isError(c_size)) {
-        ERR("ERROR WITH ZSTD\n");
-    }
+        ZSTD_inBuffer input = { src.data(), len, 0 };
+        do {
+            ZSTD_outBuffer output = { dest.data(), dest.size(), 0 };
+            {
+                STAGE_TIMER(STAGE_FLUSH);
+                remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+            }
+            if (ZSTD_isError(remaining)) {
+                ERR("ERROR WITH ZSTD\n");
+                ok = false;
+                break;
+            }
+            ok = write_output(out, dest.data(), output.pos);
+            st.comp_size += output.pos;
+        } while (ok && (mode == ZSTD_e_end ? remaining != 0 : input.pos != input.size));
+    } while (ok && mode != ZSTD_e_end);
 
-    ftruncate(fileno(file), 0);
-    fseek(file, 0L, SEEK_SET);
-    fwrite(dest, 1, c_size, file);
-    return 1;
+    ZSTD_freeCCtx(cctx);
+    close_input(in);
+    return ok;
 }
 
-void cpz_zstd_file(FILE* file, void* buf, int len) {
-    fseek(file, 0L, SEEK_END);
-    fwrite(buf, 1, len, file);
-}
\ No newline at end of file
+int cpz_zstd(const char* file_name)
+{
+    Codec codec = { "zstandard", cpz_zstd_run, false };
+    return cpz_run_and_report(codec, file_name);
+}
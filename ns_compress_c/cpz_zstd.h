@@ -21,11 +21,12 @@
 #include <unistd.h>
 #include "types.hh"
 #include "helper.hh"
+#include "cpz_codec.h"
+#include "instrument.hh"
 
 using namespace std;
 
+bool cpz_zstd_run(const char *file_name, FILE *out, CodecStats &st);
 int cpz_zstd(const char* file_name);
-int cpz_zstd_flush(FILE* file);
-void cpz_zstd_file(FILE* file, void* buf, int len);
 
 #endif //NS_COMPRESS_CPZ_ZSTD_H
@@ -17,7 +17,6 @@
 #include <math.h>
 #include <unistd.h>
 #include <limits.h>
-#include <zlib.h>
 #include <pcap.h>
 
 /* Simple json: just a header file
@@ -31,10 +30,9 @@
 #include "packet.hh"
 #include "helper.hh"
 #include "compress.hh"
+#include "flow_index.hh"
 #include "util.hh"
 
-#define MAX_DIFF_SIZE (100)
-
 using namespace std;
 
 u64 MAX_PACKETS = ~0;
@@ -42,46 +40,211 @@ u64 MAX_PACKETS = ~0;
 extern map<u16, string> ETHERTYPE_TO_STRING;
 extern map<u16, string> IPPROTO_TO_STRING;
 
-/* Decompressor functions */
+void
+first_packet_ref(Packet &p, const u8 *ref, int ref_len, int caplen)
+{
+    u8 buf[256];
 
-Decompressor::Decompressor(int fd_ts, int fd_firstpkt, int fd_diff) 
+    memcpy(buf, ref, min(ref_len, caplen));
+    if (caplen > ref_len)
+        memset(buf + ref_len, 0, caplen - ref_len);
+    p.load(buf, caplen, 0, caplen);
+    p.unpack();
+}
+
+/* Rebuilds the first packet of the record at rec, which has avail bytes
+ * left in its block; returns the length of the record, -1 if it is
+ * corrupt */
+int
+FirstPacketBlock::decode(const u8 *rec, size_t avail)
 {
+    size_t start = data.size(), pos;
+    u64 back;
+    int n;
+
+    if (avail < 1)
+        return -1;
+    if ((rec[0] != FIRSTPKT_DELTA || version < 3)
+            && (rec[0] != FIRSTPKT_FIELDS || version < 4)) {
+        if (avail < 1 + (size_t) rec[0])
+            return -1;
+        data.insert(data.end(), rec, rec + 1 + rec[0]);
+        off.push_back(start);
+        return 1 + rec[0];
+    }
+
+    if ((n = uvarint_decode(rec + 1, avail - 1, &back)) <= 0 || back > off.size())
+        return -1;
+    pos = 1 + n;
+    if (pos >= avail)
+        return -1;
+    int caplen = rec[pos++];
+
+    if (rec[0] == FIRSTPKT_FIELDS) {
+        u32 prev[NUM_FIELDS], values[NUM_FIELDS];
+        u64 written = 0;
+
+        if (!back || !caplen || pos >= avail)
+            return -1;
+        int num_fields = rec[pos++];
+        REP(i, num_fields) {
+            if (pos >= avail)
+                return -1;
+            const FieldRecord *field = (const FieldRecord *) (rec + pos);
+            int len = field->value_len + 1;
+            if (field->field_nr >= NUM_FIELDS || pos + 1 + len > avail)
+                return -1;
+            values[field->field_nr] = varint_decode(len, (u8 *) field->field_value);
+            written |= 1ULL << field->field_nr;
+            pos += 1 + len;
+        }
+        const u8 *ref = data.data() + off[off.size() - back];
+        first_packet_ref(pkt, ref + 1, ref[0], caplen);
+        pkt.get_headers_opt(prev);
+        pkt.apply_diff(prev, values, written, true);
+        data.push_back(caplen);
+        data.insert(data.end(), pkt.buff, pkt.buff + caplen);
+        off.push_back(start);
+        return pos;
+    }
 
-    fp_ts = dieopenr(fd_ts);
-    fp_ts_comp = compressed_read_stream(fp_ts);
+    const u8 *bitmap = rec + pos;
+    pos += (caplen + 7) / 8;
+    if (pos > avail)
+        return -1;
 
-    fp_firstpkt = dieopenr(fd_firstpkt);
-    fp_firstpkt_comp = compressed_read_stream(fp_firstpkt);
+    data.resize(start + 1 + caplen);
+    const u8 *ref = back ? data.data() + off[off.size() - back] : NULL;
+    int ref_len = ref ? ref[0] : 0;
+    u8 *out = data.data() + start;
+    out[0] = caplen;
+    REP(i, caplen) {
+        if (bitmap[i / 8] & (1 << (i % 8))) {
+            if (pos >= avail)
+                goto corrupt;
+            out[1 + i] = rec[pos++];
+        } else if (i < ref_len) {
+            out[1 + i] = ref[1 + i];
+        } else {
+            goto corrupt;
+        }
+    }
+    off.push_back(start);
+    return pos;
 
-    fp_diff = dieopenr(fd_diff);
-    fp_diff_comp = compressed_read_stream(fp_diff);
-    printf("Opened compressed_read_streams\n");
+corrupt:
+    data.resize(start);
+    return -1;
+}
 
-    seq = 0;
+/* TsDecoder functions */
+
+void
+TsDecoder::start(u64 first_ticks, u64 first_delta, u32 first_ifid)
+{
+    ticks = first_ticks;
+    delta = first_delta;
+    ifid = first_ifid;
+    escape = TS_NUM_ESC;
+}
+
+bool
+TsDecoder::feed(u64 value)
+{
+    u64 esc = escape;
+
+    escape = TS_NUM_ESC;
+    if (esc == TS_ESC_IFID) {
+        ifid = value;
+        return false;
+    }
+    if (esc == TS_ESC_DELTA) {
+        delta = zigzag_decode(value);
+    } else if (value < TS_NUM_ESC) {
+        escape = value;
+        return false;
+    } else {
+        delta += zigzag_decode(value - TS_NUM_ESC);
+    }
+    ticks += delta;
+    return true;
+}
+
+/* Decompressor functions */
+
+static void
+free_packet(Packet *p)
+{
+    delete[] p->buff;
+    delete p;
+}
+
+/* Takes the stream files the compressor writes without an archive */
+Decompressor::Decompressor(int fd_ts, int fd_firstpkt, int fd_diff, bool zstd)
+{
+    int fds[NUM_STREAMS] = { fd_ts, fd_firstpkt, fd_diff };
+
+    REP(i, NUM_STREAMS) {
+        if (!files[i].open(fds[i]))
+            exit(-1);
+        ::close(fds[i]);
+        in[i].open(files[i], zstd ? ARCHIVE_ZSTD : ARCHIVE_GZIP, -1, 0);
+    }
+    setup();
+}
+
+/* Maps the archive; each stream skips over the blocks of the others. Of
+ * the index, only the flows of the first packets and the packet counts
+ * of the flows are kept. */
+Decompressor::Decompressor(FILE *archive)
+{
+    ArchiveHeader hdr;
+
+    if (!archive_read_header(archive, hdr) || !files[0].open(fileno(archive)))
+        exit(-1);
+    REP(i, NUM_STREAMS) in[i].open(files[0], hdr.codec, i, sizeof(hdr));
+    first_block.version = hdr.version;
+
+    if (hdr.version >= 2) {
+        ArchiveIndex idx;
+        rewind(archive);
+        if (!idx.open(archive))
+            exit(-1);
+        REP(f, (int)idx.flows.size()) {
+            const IndexFlow &flow = idx.flows[f];
+            REP(j, (int)flow.num_first_ids) {
+                u32 id = idx.first_ids[flow.first_ids + j];
+                if (id >= first_flow.size())
+                    first_flow.resize(id + 1, ~0u);
+                first_flow[id] = f;
+            }
+            flow_left.push_back(flow.packets);
+        }
+        flow_last.assign(flow_left.size(), ~0u);
+    }
     setup();
 }
 
 void 
 Decompressor::close() 
 {
-    if (fp_ts) fclose(fp_ts);
-    if (fp_firstpkt) fclose(fp_firstpkt);
-    if (fp_diff) fclose(fp_diff);
-    fp_ts = NULL;
-    fp_firstpkt = NULL;
-    fp_diff = NULL;
-
+    EACH(it, recent_packets) free_packet(it->second.pkt);
+    recent_packets.clear();
+    if (retired)
+        free_packet(retired);
+    retired = NULL;
+    first_pending.clear();
+    first_block.clear();
+    REP(i, NUM_STREAMS) files[i].close();
 }
 
 void 
 Decompressor::setup() 
 {
+    seq = 0;
+    first_next = 0;
+    retired = NULL;
     read_first_timestamp();
-    printf("read_first_timestamp\n");
-    read_all_ts();
-    printf("read_all_ts\n");
-    read_all_first_packets();
-    printf("read_all_first_packets\n");
 }
 
 Packet *
@@ -90,223 +253,260 @@ Decompressor::read_pkt(struct pcap_pkthdr *hdr)
     return read_one_diff(hdr);
 }
 
-void 
-Decompressor::read_first_timestamp() 
+/* Like read_pkt, with the nanosecond timestamp and interface of the
+ * packet; rec.data points into the returned packet */
+Packet *
+Decompressor::read_pkt(CaptureRecord &rec)
 {
-    int bytes_read;
-    bytes_read = gzread (fp_ts_comp, &ts_first, sizeof ts_first);
-    ts_prev = ts_first;
-    assert (bytes_read == sizeof ts_first);
-    ts.push_back(ts_first);
-    printf("first_ts: ");
-    print_timestamp(ts_first);
+    Packet *p = read_one_diff(NULL);
+
+    if (!p)
+        return p;
+    rec.ts_ns = p->ts.tv_sec * NSEC_PER_SEC + p->ts.tv_nsec;
+    rec.ifid = p->ifid;
+    rec.caplen = p->hdr_size();
+    rec.len = p->infer_len();
+    rec.data = p->buff;
+    return p;
 }
 
-void
-Decompressor::read_ts_deltas() 
+/* Writes all remaining packets to out, returns the number written */
+u64
+Decompressor::write_capture(CaptureWriter &out)
 {
-    // Code derives from:
-    //http://www.lemoda.net/c/gzfile-read/index.html
-    if (!fp_ts_comp) {
-        ERR("gzopen of ts memstream failed: %s.\n", 
-                strerror(errno));
-        exit(EXIT_FAILURE);
-    }
+    CaptureRecord rec;
+    u64 n = 0;
 
-    int counter = 0;
-    while (true) {
-        int err;
-        int bytes_read;
-        u32 delta;
-        bytes_read = gzread(fp_ts_comp, &delta, sizeof delta);
-        counter++;
-        if (bytes_read < (int) (sizeof delta)) {
-            if (gzeof(fp_ts_comp)) {
-                break;
-            } 
-            else {
-                const char * error_string;
-                error_string = gzerror(fp_ts_comp, &err);
-                if (err) {
-                    ERR("Error: %s.\n", error_string);
-                    exit (EXIT_FAILURE);
-                }
-            }
-        }
-        assert(bytes_read == sizeof delta);
-        ts_prev.tv_usec += delta;
-        while (ts_prev.tv_usec >= USEC_PER_SEC) {
-            ts_prev.tv_usec -= USEC_PER_SEC;
-            ts_prev.tv_sec += 1;
-        }
-        ts.push_back(ts_prev);
+    while (read_pkt(rec)) {
+        out.write(rec);
+        n++;
     }
-    printf("\n");
+    return n;
 }
 
-inline u8 
-Decompressor::read_caplen() 
+void 
+Decompressor::read_first_timestamp() 
 {
-    u8 caplen;
-    int bytes_read;
-    bytes_read = gzread(fp_firstpkt_comp, &caplen, sizeof caplen);
+    StreamCursor &c = in[STREAM_TS];
 
-    if (!gzeof(fp_firstpkt_comp)) {
-        assert(bytes_read == sizeof caplen);
-        return caplen;
-    } else {
-        return -1;
+    if (!c.more() || (size_t) (c.end - c.pos) < sizeof ts_first) {
+        ERR("Error: truncated timestamp stream.\n");
+        exit(EXIT_FAILURE);
     }
+    memcpy(&ts_first, c.pos, sizeof ts_first);
+    c.pos += sizeof ts_first;
+    ts_dec.start(ts_first.ticks, 0, ts_first.ifid);
+    u64 t = ticks_to_ns(ts_first.ticks, ts_first.tsresol);
+    fprintf(stderr, "first_ts: %llu.%09llu, resolution 10^-%u\n",
+            t / NSEC_PER_SEC, t % NSEC_PER_SEC, ts_first.tsresol);
 }
 
-void 
-Decompressor::read_one_packet() 
+/* The timestamp of packet seq, decoded along with the packets */
+void
+Decompressor::read_timestamp(u64 &ts_ns, u32 &ifid) 
 {
-    static int nr = 0;
-    int caplen = read_caplen();
-    if (caplen == 255)
-        return;
-
-    u8* buf = new u8[MAX_PKT_SIZE];
-    int bytes_read;
-    bytes_read = gzread(fp_firstpkt_comp, buf, caplen);
-    assert(bytes_read == caplen);
-    int SKIP_ETHERNET = 0;
-    Packet *pkt = new Packet(buf, caplen, SKIP_ETHERNET, nr++, caplen);
-    first_packets.push_back(pkt);
-    delete [] buf;
+    u64 value;
+
+    while (seq > 0) {
+        if (!read_ts_uvarint(value))
+            goto truncated;
+        if (ts_dec.feed(value))
+            break;
+    }
+    ts_ns = ticks_to_ns(ts_dec.ticks, ts_first.tsresol);
+    ifid = ts_dec.ifid;
+    return;
+
+truncated:
+    ERR("Error: truncated timestamp stream.\n");
+    exit(EXIT_FAILURE);
 }
 
-void 
-Decompressor::read_all_first_packets() 
+bool
+Decompressor::read_ts_uvarint(u64 &value) 
 {
-    while (!gzeof(fp_firstpkt_comp)) {
-        read_one_packet();
+    StreamCursor &c = in[STREAM_TS];
+    int len;
+
+    if (!c.more()) {
+        if (c.error)
+            exit(EXIT_FAILURE);
+        return false;
+    }
+    len = uvarint_decode(c.pos, c.end - c.pos, &value);
+    if (len <= 0) {
+        ERR("Error: bad varint in timestamp stream.\n");
+        exit (EXIT_FAILURE);
     }
-    printf("%u first packets\n", (u32)first_packets.size());
+    c.pos += len;
+    return true;
 }
 
-u64 
-Decompressor::read_nbytes(int len) 
+/* First packet id, rebuilt from its record when a diff refers to it.
+ * The compressor refers to first packets in the order it writes them, so
+ * first_pending stays empty unless an archive says otherwise. */
+Packet *
+Decompressor::first_packet(u32 id, uint packet_index) 
 {
-    u64 ret = 0;
-    if (len == 0)
-        return 0;
-    int bytes_read;
-    bytes_read = gzread(fp_diff_comp, &ret, len);
-
-    if (bytes_read != len) {
-        printf("Failed after reading %d (bits=%d) field records\n",
-                seq, len * 8);
+    StreamCursor &c = in[STREAM_FIRSTPKT];
+    int SKIP_ETHERNET = 0;
+
+    auto pending = first_pending.find(id);
+    if (pending != first_pending.end()) {
+        const vector<u8> &rec = pending->second;
+        Packet *pkt = new Packet(rec.data(), rec.size(), SKIP_ETHERNET, packet_index, rec.size());
+        first_pending.erase(pending);
+        return pkt;
     }
-    assert(bytes_read == len);
-    return ret;
+
+    while (first_next <= id) {
+        if (!c.more()) {
+            if (c.error)
+                exit(EXIT_FAILURE);
+            break;
+        }
+        /* Records are never empty, so a block starts where raw does */
+        if (c.pos == c.raw.data())
+            first_block.clear();
+        int len = first_block.decode(c.pos, c.end - c.pos);
+        if (len < 0) {
+            ERR("Error: corrupt first packet stream.\n");
+            exit(EXIT_FAILURE);
+        }
+        c.pos += len;
+        const u8 *rec = first_block.get(first_block.off.size() - 1);
+        if (first_next++ == id)
+            return new Packet(rec + 1, rec[0], SKIP_ETHERNET, packet_index, rec[0]);
+        first_pending[first_next - 1].assign(rec + 1, rec + 1 + rec[0]);
+    }
+    ERR("Packet %u refers to unknown first packet %u\n", packet_index, id);
+    exit(EXIT_FAILURE);
 }
 
+/* The diff record and its field records are used where they were
+ * decoded; only their lengths and field numbers are checked here */
 Packet *
 Decompressor::read_one_diff(struct pcap_pkthdr* hdr) 
 {
-    Packet *p = NULL;
-    char buf[MAX_DIFF_SIZE];
-    DiffRecord *diff = (DiffRecord *)(&buf[0]);
-    FieldRecord *field = diff->records;
-    int bytes_read;
-    bytes_read = gzread(fp_diff_comp, buf, sizeof(struct DiffRecord));
-    int offset = 0;
-
-    if (gzeof(fp_diff_comp))
-        return p;
+    StreamCursor &c = in[STREAM_DIFF];
+    const DiffRecord *diff;
+    Packet *p;
 
-    assert(bytes_read == sizeof(struct DiffRecord));
+    if (retired) {
+        free_packet(retired);
+        retired = NULL;
+    }
+    if (!c.more()) {
+        if (c.error)
+            exit(EXIT_FAILURE);
+        return NULL;
+    }
+    if ((size_t) (c.end - c.pos) < sizeof(DiffRecord))
+        goto truncated;
+    diff = (const DiffRecord *) c.pos;
+    c.pos += sizeof(DiffRecord);
 
     /* First packet of flow */
-    if (diff->num_changes == FIRST_PACKET_ENCODE)
-        goto done;
-
-    for(int i = 0; i < diff->num_changes; i++) {
-        FieldRecord *field = (FieldRecord *)((u8 *)diff->records + offset);
-        u8 *byte = (u8 *)field;
-        *byte = read_nbytes(1);
-        int len;
-        u32 value;
-
-        /* We use varint encoding with length packed
-         * in field->value_len
-         * len 1 -> 00 - binary
-         * len 2 -> 01
-         * len 3 -> 10
-         * len 4 -> 11
-         */
-        len = (field->value_len + 1);
-        Header key = static_cast<Header>(field->field_nr);
-        value = read_nbytes(len);
-        offset += 1 + len;
-        assert (0 <= field->value_len and field->value_len <= 3);
-        memcpy(field->field_value, &value, len);
+    if (diff->num_changes != FIRST_PACKET_ENCODE) {
+        for (int i = 0; i < diff->num_changes; i++) {
+            /* We use varint encoding with length packed
+             * in field->value_len
+             * len 1 -> 00 - binary
+             * len 2 -> 01
+             * len 3 -> 10
+             * len 4 -> 11
+             */
+            const FieldRecord *field = (const FieldRecord *) c.pos;
+            if (c.pos >= c.end || c.end - c.pos < 2 + field->value_len
+                    || field->field_nr >= NUM_FIELDS)
+                goto truncated;
+            c.pos += 2 + field->value_len;
+        }
     }
 
-done:
-
     p = reconstruct_pcap(diff, seq, hdr);
     seq++;
     return p;
+
+truncated:
+    ERR("Failed after reading %d diff records\n", seq);
+    exit(EXIT_FAILURE);
 }
 
 Packet *
-Decompressor::reconstruct_pcap(DiffRecord* diff, uint packet_index, struct pcap_pkthdr* hdr) 
+Decompressor::reconstruct_pcap(const DiffRecord* diff, uint packet_index, struct pcap_pkthdr* hdr) 
 {
     Packet *p;
-    timeval t;
-    uint16_t packet_len; // original len - make this up?
-
-    assert(diff->packet_ref < ts.size());
-
-    t = ts[packet_index];
+    LastPacket last;
+    u64 t;
+    u32 ifid;
 
     if (diff->num_changes == FIRST_PACKET_ENCODE) {
         // If there are no diffs, the packet_ref refers to a first_pkt.
-        p = first_packets[diff->packet_ref];
+        p = first_packet(diff->packet_ref, packet_index);
+        last.flow = diff->packet_ref < first_flow.size() ? (int) first_flow[diff->packet_ref] : -1;
+
+        // A restarted flow goes on from its new first packet
+        if (last.flow >= 0 && flow_last[last.flow] != ~0u) {
+            auto prev = recent_packets.find(flow_last[last.flow]);
+            if (prev != recent_packets.end()) {
+                free_packet(prev->second.pkt);
+                recent_packets.erase(prev);
+            }
+        }
     }
     else {
         // iterate through each change, modifying packet.
         int offset = 0;
-
-        // If there are diffs, they are relative to a previously seen
-        // (and stored) packet in the recent_packets table.
-        printf("first_packets: %d\n", diff->packet_ref);
-        Packet *pkt_ref = first_packets[diff->packet_ref];
-        p = new Packet(pkt_ref->buff, pkt_ref->skip_ethernet, 
-                pkt_ref->caplen, packet_index);
+        u32 prev[NUM_FIELDS], values[NUM_FIELDS];
+        u64 written = 0;
+
+        // If there are diffs, they are relative to the previous packet
+        // of the flow, stored in the recent_packets table. It is never
+        // referenced again, so it becomes this packet.
+        auto ref = recent_packets.find(diff->packet_ref);
+        if (ref == recent_packets.end()) {
+            ERR("Packet %u refers to unknown packet %u\n", packet_index, diff->packet_ref);
+            exit(EXIT_FAILURE);
+        }
+        last = ref->second;
+        recent_packets.erase(ref);
+        p = last.pkt;
+        p->get_headers_opt(prev);
 
         for (int i = 0; i < diff->num_changes; i++) {
-            FieldRecord *field = (FieldRecord*)(((u8 *)diff->records) + offset);
+            const FieldRecord *field = (const FieldRecord *)(((const u8 *)diff->records) + offset);
             int field_nr = field->field_nr;
-            Header key = static_cast<Header>(field_nr);
-            u32 value = 0;
             int len;
 
             len = field->value_len + 1;
-            printf("varint_decode\n");
-            value = varint_decode(len, field->field_value);
+            values[field_nr] = varint_decode(len, (u8 *) field->field_value);
+            written |= 1ULL << field_nr;
             offset += 1 + len;
-
-            printf("apply_diff\n");
-            p->apply_diff(key, value);
         }
-    }
 
-    printf("recent_packets.insert\n");
-    recent_packets.insert(make_pair(seq, p));
+        p->apply_diff(prev, values, written);
+        p->seq = packet_index;
+    }
 
-    // Remove previous packet in this flow, which should never be
-    // referenced again if the compressor is correctly implemented
-    if (diff->num_changes != FIRST_PACKET_ENCODE) {
-        printf("recent_packets.erase\n");
-        recent_packets.erase(diff->packet_ref);
+    // The state of a flow goes once its last packet has been returned
+    if (last.flow >= 0 && flow_left[last.flow] > 0 && --flow_left[last.flow] == 0) {
+        flow_last[last.flow] = ~0u;
+        retired = p;
+    } else {
+        recent_packets.insert(make_pair(packet_index, LastPacket{ p, last.flow }));
+        if (last.flow >= 0)
+            flow_last[last.flow] = packet_index;
     }
 
+    read_timestamp(t, ifid);
+    p->ts.tv_sec = t / NSEC_PER_SEC;
+    p->ts.tv_nsec = t % NSEC_PER_SEC;
+    p->ifid = ifid;
+
     if(hdr) {
-        hdr->ts = t;
+        hdr->ts.tv_sec = p->ts.tv_sec;
+        hdr->ts.tv_usec = p->ts.tv_nsec / 1000;
         hdr->caplen = p->hdr_size();
         hdr->len = p->infer_len();
     }
@@ -0,0 +1,272 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "extract.h"
+#include "flow_index.hh"
+#include "compress.hh"
+
+static void extract_usage() {
+    fprintf(stderr, "usage: ns_compress extract archive              list the flows\n"
+            "       ns_compress extract [-d] -o output archive proto src[:port] dst[:port]\n"
+            "output is pcapng, - for stdout; -d: only the given direction\n");
+    exit(1);
+}
+
+static const char *proto_name(u32 proto) {
+    switch (proto) {
+        case IPPROTO_TCP: return "tcp";
+        case IPPROTO_UDP: return "udp";
+        case IPPROTO_ICMP: return "icmp";
+        default: return NULL;
+    }
+}
+
+static bool parse_proto(const char *s, u32 &proto) {
+    for (u32 p = 0; p < 256; p++) {
+        const char *name = proto_name(p);
+        if (name && strcmp(s, name) == 0) {
+            proto = p;
+            return true;
+        }
+    }
+    char *end;
+    proto = strtoul(s, &end, 10);
+    return *s && !*end;
+}
+
+/* addr[:port], in host byte order as in FlowKey */
+static bool parse_endpoint(const char *s, u32 &addr, u16 &port) {
+    char buf[64];
+    const char *colon = strchr(s, ':');
+    size_t len = colon ? (size_t)(colon - s) : strlen(s);
+    struct in_addr in;
+
+    if (len >= sizeof(buf))
+        return false;
+    memcpy(buf, s, len);
+    buf[len] = 0;
+    if (inet_pton(AF_INET, buf, &in) != 1)
+        return false;
+    addr = ntohl(in.s_addr);
+    port = colon ? atoi(colon + 1) : 0;
+    return true;
+}
+
+static void print_flow(const IndexFlow &f) {
+    ofp_match m;
+    char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+    struct in_addr in;
+    const char *name;
+
+    memcpy(&m, f.key, sizeof(m));
+    in.s_addr = htonl(m.nw_src);
+    inet_ntop(AF_INET, &in, src, sizeof(src));
+    in.s_addr = htonl(m.nw_dst);
+    inet_ntop(AF_INET, &in, dst, sizeof(dst));
+    name = proto_name(m.nw_proto);
+    if (name)
+        printf("%s", name);
+    else
+        printf("%u", m.nw_proto);
+    printf(" %s:%u %s:%u %u packets %llu.%09llu-%llu.%09llu %u blocks\n",
+            src, m.tp_src, dst, m.tp_dst, f.packets,
+            f.first_ns / NSEC_PER_SEC, f.first_ns % NSEC_PER_SEC,
+            f.last_ns / NSEC_PER_SEC, f.last_ns % NSEC_PER_SEC, f.num_chunks);
+}
+
+/* ns_compress extract ...: lists the flows of an archive, or writes the
+ * packets of one connection to a capture, reading only the blocks of the
+ * archive that hold them */
+int extract_main(int argc, char *argv[]) {
+    const char *output = NULL;
+    bool one_way = false;
+    int o;
+
+    while ((o = getopt(argc, argv, "o:dh")) != -1) {
+        switch (o) {
+            case 'o': output = optarg; break;
+            case 'd': one_way = true; break;
+            default: extract_usage();
+        }
+    }
+    if (optind >= argc)
+        extract_usage();
+
+    FILE *fp = fopen(argv[optind], "rb");
+    if (!fp) {
+        ERR("Cannot open %s\n", argv[optind]);
+        return 1;
+    }
+    ArchiveIndex idx;
+    if (!idx.open(fp))
+        return 1;
+
+    if (optind + 1 == argc) {
+        EACH(it, idx.flows) print_flow(*it);
+        fclose(fp);
+        return 0;
+    }
+
+    u32 proto, src, dst;
+    u16 sport, dport;
+    if (optind + 4 != argc || !output
+            || !parse_proto(argv[optind + 1], proto)
+            || !parse_endpoint(argv[optind + 2], src, sport)
+            || !parse_endpoint(argv[optind + 3], dst, dport))
+        extract_usage();
+
+    ofp_match m;
+    memset(&m, 0, sizeof(m));
+    m.nw_proto = proto;
+    m.nw_src = src;
+    m.nw_dst = dst;
+    m.tp_src = sport;
+    m.tp_dst = dport;
+
+    vector<int> flows;
+    int f = idx.find(m);
+    if (f >= 0)
+        flows.push_back(f);
+    if (!one_way) {
+        m.nw_src = dst;
+        m.nw_dst = src;
+        m.tp_src = dport;
+        m.tp_dst = sport;
+        f = idx.find(m);
+        if (f >= 0)
+            flows.push_back(f);
+    }
+    if (flows.empty()) {
+        ERR("No such flow in %s\n", argv[optind]);
+        fclose(fp);
+        return 1;
+    }
+
+    CaptureWriter out;
+    FlowExtractor ex(fp, idx);
+    u64 written;
+    if (!out.open(output, FORMAT_PCAPNG, idx.ih.tsresol))
+        return 1;
+    bool ok = ex.extract(flows, out, written);
+    out.close();
+    fclose(fp);
+    if (!ok) {
+        ERR("Corrupt archive %s\n", argv[optind]);
+        return 1;
+    }
+    fprintf(stderr, "%llu packets\n", written);
+    return 0;
+}
+
+static void decompress_usage() {
+    fprintf(stderr, "usage: ns_compress decompress [-f filter] [-o output] archive...\n"
+            "output is pcapng, stdout by default; filter is in tcpdump syntax\n");
+    exit(1);
+}
+
+/* Decodes the packets filter may match from an archive with an index:
+ * flows whose first packets show that none of their packets can match
+ * are skipped with their diff blocks, and the other packets are matched
+ * as they are decoded, before their timestamps are looked up */
+static bool decompress_indexed(FILE *fp, const char *name, const PacketFilter *filter,
+                               CaptureWriter &out, u64 &written) {
+    ArchiveIndex idx;
+    vector<int> flows;
+
+    if (!idx.open(fp))
+        return false;
+    FlowExtractor ex(fp, idx);
+    if (filter) {
+        if (!ex.select(*filter, flows))
+            return false;
+    } else {
+        REP(i, (int)idx.flows.size()) flows.push_back(i);
+    }
+    if (!ex.extract(flows, out, written, filter))
+        return false;
+    fprintf(stderr, "%s: %llu packets, %zu of %zu flows, %llu of %zu blocks read\n",
+            name, written, flows.size(), idx.flows.size(), ex.blocks_read, idx.blocks.size());
+    return true;
+}
+
+/* Version 1 archives have no index; all of their packets are decoded */
+static bool decompress_all(FILE *fp, const char *name, const PacketFilter *filter,
+                           CaptureWriter &out, u64 &written) {
+    Decompressor dc(fp);
+    CaptureRecord rec;
+
+    written = 0;
+    while (dc.read_pkt(rec)) {
+        if (filter && !filter->match(rec.data, rec.caplen, rec.len))
+            continue;
+        out.write(rec);
+        written++;
+    }
+    fprintf(stderr, "%s: %llu packets\n", name, written);
+    return true;
+}
+
+/* ns_compress decompress ...: writes the packets of archives, or those
+ * matching a BPF filter, to one capture */
+int decompress_main(int argc, char *argv[]) {
+    const char *output = "-", *expr = NULL;
+    PacketFilter filter;
+    CaptureWriter out;
+    int o;
+
+    while ((o = getopt(argc, argv, "f:o:h")) != -1) {
+        switch (o) {
+            case 'f': expr = optarg; break;
+            case 'o': output = optarg; break;
+            default: decompress_usage();
+        }
+    }
+    if (optind >= argc)
+        decompress_usage();
+    if (expr && !filter.compile(expr))
+        return 1;
+    /* Nanoseconds hold the timestamps of archives of any resolution */
+    if (!out.open(output, FORMAT_PCAPNG, TSRESOL_NSEC))
+        return 1;
+
+    for (int i = optind; i < argc; i++) {
+        FILE *fp = fopen(argv[i], "rb");
+        ArchiveHeader hdr;
+        u64 written;
+        bool ok;
+
+        if (!fp) {
+            ERR("Cannot open %s\n", argv[i]);
+            out.close();
+            return 1;
+        }
+        if (!archive_read_header(fp, hdr)) {
+            fclose(fp);
+            out.close();
+            return 1;
+        }
+        rewind(fp);
+        if (hdr.version >= 2)
+            ok = decompress_indexed(fp, argv[i], expr ? &filter : NULL, out, written);
+        else
+            ok = decompress_all(fp, argv[i], expr ? &filter : NULL, out, written);
+        fclose(fp);
+        if (!ok) {
+            ERR("Corrupt archive %s\n", argv[i]);
+            out.close();
+            return 1;
+        }
+    }
+    out.close();
+    return 0;
+}
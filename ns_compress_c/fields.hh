@@ -0,0 +1,284 @@
+/*
+ * Copyright 2014, Stanford University. This file is licensed under Apache 2.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: nikhilh@cs.stanford.com (Nikhil Handigol)
+ *         jvimal@stanford.edu (Vimal Jeyakumar)
+ *         brandonh@cs.stanford.edu (Brandon Heller)
+ */
+
+#ifndef FIELDS_HH
+#define FIELDS_HH
+
+#include "types.hh"
+
+/* Header field numbers. These are written to the archive (FieldRecord),
+ * so new fields must only ever be appended. */
+enum Header {
+    TS_SEC,
+    PCAP_SEQ,
+    IP_PROTO,
+    IP_SRC,
+    IP_DST,
+
+    TCP_SRC,
+    TCP_DST,
+    UDP_SRC,
+    UDP_DST,
+
+    IP_HL,
+
+    IP_TOS_F,
+    IP_LEN,
+    IP_ID,
+    IP_OFF,
+    IP_TTL_F,
+    IP_CSUM,
+    TCP_SEQ,
+    TCP_ACK,
+    TCP_OFF,
+    TCP_FLAGS,
+    TCP_WIN,
+    TCP_CSUM,
+    TCP_URP,
+
+    UDP_CSUM,
+    UDP_LEN,
+
+    /* Outer headers of tagged and tunneled packets */
+    VLAN_TCI,
+    VLAN_INNER_TCI,
+    MPLS_LSE,
+    OUTER_IP_SRC,
+    OUTER_IP_DST,
+    OUTER_IP_TOS,
+    OUTER_IP_LEN,
+    OUTER_IP_ID,
+    OUTER_IP_TTL,
+    OUTER_IP_CSUM,
+    OUTER_UDP_SRC,
+    OUTER_UDP_LEN,
+    OUTER_UDP_CSUM,
+    TUNNEL_ID,
+    GTPU_LEN,
+
+    /* This should always be at the end */
+    NUM_FIELDS,
+};
+
+/* Headers a field can live in. Packet::unpack records the offset of each
+ * one in Packet::field_base, NO_OFFSET if the packet doesn't have it. */
+enum FieldBase {
+    BASE_IP,            /* innermost IPv4 header */
+    BASE_TCP,
+    BASE_UDP,
+    BASE_VLAN,          /* TCI of the outermost 802.1Q/802.1ad tag */
+    BASE_VLAN_INNER,
+    BASE_MPLS,          /* top label stack entry */
+    BASE_OUTER_IP,
+    BASE_OUTER_UDP,
+    BASE_TUNNEL_ID,     /* VXLAN VNI, GTP-U TEID or GRE key */
+    BASE_GTPU,
+    BASE_NONE,          /* pcap metadata, never present in the bytes */
+
+    NUM_BASES,
+};
+
+enum FieldEncoding {
+    ENC_FIXED,          /* constant for a flow, carried by the first packet */
+    ENC_REPLACE,        /* the new value */
+    ENC_DELTA,          /* difference to the previous packet of the flow */
+    ENC_PREDICT,        /* delta minus a predicted step, omitted when 0 */
+};
+
+enum ByteOrder {
+    ORDER_BE,
+    ORDER_LE,
+};
+
+/*
+ * A field is a run of bits inside the 32-bit word found at
+ * field_base[base] + offset. Extraction, diffing and reconstruction
+ * are generated from these descriptors.
+ *
+ * ENC_PREDICT steps are either the constant step, or, if ref is not
+ * NUM_FIELDS, the delta of the field ref of the same packet (e.g. the
+ * outer lengths of a tunnel move in lockstep with the inner IP_LEN).
+ */
+struct FieldDesc {
+    Header id;
+    const char *name;
+    u8 base;
+    u8 offset;
+    u8 shift;           /* right shift of the loaded word */
+    u32 mask;           /* field mask after the shift */
+    u8 order;
+    u8 encoding;
+    Header ref;
+    u32 step;
+};
+
+/* Field of width bits starting at bit msb (0 = most significant) of the
+ * byte at offset */
+static constexpr FieldDesc
+field(Header id, const char *name, u8 base, u8 offset, u8 msb, u8 width,
+        u8 encoding, Header ref = NUM_FIELDS, u32 step = 0)
+{
+    return FieldDesc { id, name, base, offset, (u8)(32 - msb - width),
+        (u32)(width == 32 ? ~0u : (1u << width) - 1), ORDER_BE,
+        encoding, ref, step };
+}
+
+static constexpr FieldDesc FIELDS[NUM_FIELDS] = {
+    field(TS_SEC, "TS_SEC", BASE_NONE, 0, 0, 32, ENC_FIXED),
+    field(PCAP_SEQ, "PCAP_SEQ", BASE_NONE, 0, 0, 32, ENC_FIXED),
+    field(IP_PROTO, "IP_PROTO", BASE_IP, 9, 0, 8, ENC_FIXED),
+    field(IP_SRC, "IP_SRC", BASE_IP, 12, 0, 32, ENC_FIXED),
+    field(IP_DST, "IP_DST", BASE_IP, 16, 0, 32, ENC_FIXED),
+
+    field(TCP_SRC, "TCP_SRC", BASE_TCP, 0, 0, 16, ENC_FIXED),
+    field(TCP_DST, "TCP_DST", BASE_TCP, 2, 0, 16, ENC_FIXED),
+    field(UDP_SRC, "UDP_SRC", BASE_UDP, 0, 0, 16, ENC_FIXED),
+    field(UDP_DST, "UDP_DST", BASE_UDP, 2, 0, 16, ENC_FIXED),
+
+    field(IP_HL, "IP_HL", BASE_IP, 0, 4, 4, ENC_FIXED),
+
+    field(IP_TOS_F, "IP_TOS", BASE_IP, 1, 0, 8, ENC_REPLACE),
+    field(IP_LEN, "IP_LEN", BASE_IP, 2, 0, 16, ENC_REPLACE),
+    field(IP_ID, "IP_ID", BASE_IP, 4, 0, 16, ENC_PREDICT, NUM_FIELDS, 1),
+    field(IP_OFF, "IP_OFF", BASE_IP, 6, 0, 16, ENC_REPLACE),
+    field(IP_TTL_F, "IP_TTL", BASE_IP, 8, 0, 8, ENC_REPLACE),
+    field(IP_CSUM, "IP_CSUM", BASE_IP, 10, 0, 16, ENC_REPLACE),
+    field(TCP_SEQ, "TCP_SEQ", BASE_TCP, 4, 0, 32, ENC_DELTA),
+    field(TCP_ACK, "TCP_ACK", BASE_TCP, 8, 0, 32, ENC_DELTA),
+    field(TCP_OFF, "TCP_OFF", BASE_TCP, 12, 0, 4, ENC_REPLACE),
+    field(TCP_FLAGS, "TCP_FLAGS", BASE_TCP, 13, 0, 8, ENC_REPLACE),
+    field(TCP_WIN, "TCP_WIN", BASE_TCP, 14, 0, 16, ENC_REPLACE),
+    field(TCP_CSUM, "TCP_CSUM", BASE_TCP, 16, 0, 16, ENC_REPLACE),
+    field(TCP_URP, "TCP_URP", BASE_TCP, 18, 0, 16, ENC_REPLACE),
+
+    field(UDP_CSUM, "UDP_CSUM", BASE_UDP, 6, 0, 16, ENC_REPLACE),
+    field(UDP_LEN, "UDP_LEN", BASE_UDP, 4, 0, 16, ENC_PREDICT, IP_LEN),
+
+    field(VLAN_TCI, "VLAN_TCI", BASE_VLAN, 0, 0, 16, ENC_REPLACE),
+    field(VLAN_INNER_TCI, "VLAN_INNER_TCI", BASE_VLAN_INNER, 0, 0, 16, ENC_REPLACE),
+    field(MPLS_LSE, "MPLS_LSE", BASE_MPLS, 0, 0, 32, ENC_REPLACE),
+    field(OUTER_IP_SRC, "OUTER_IP_SRC", BASE_OUTER_IP, 12, 0, 32, ENC_REPLACE),
+    field(OUTER_IP_DST, "OUTER_IP_DST", BASE_OUTER_IP, 16, 0, 32, ENC_REPLACE),
+    field(OUTER_IP_TOS, "OUTER_IP_TOS", BASE_OUTER_IP, 1, 0, 8, ENC_REPLACE),
+    field(OUTER_IP_LEN, "OUTER_IP_LEN", BASE_OUTER_IP, 2, 0, 16, ENC_PREDICT, IP_LEN),
+    field(OUTER_IP_ID, "OUTER_IP_ID", BASE_OUTER_IP, 4, 0, 16, ENC_DELTA),
+    field(OUTER_IP_TTL, "OUTER_IP_TTL", BASE_OUTER_IP, 8, 0, 8, ENC_REPLACE),
+    field(OUTER_IP_CSUM, "OUTER_IP_CSUM", BASE_OUTER_IP, 10, 0, 16, ENC_REPLACE),
+    field(OUTER_UDP_SRC, "OUTER_UDP_SRC", BASE_OUTER_UDP, 0, 0, 16, ENC_REPLACE),
+    field(OUTER_UDP_LEN, "OUTER_UDP_LEN", BASE_OUTER_UDP, 4, 0, 16, ENC_PREDICT, IP_LEN),
+    field(OUTER_UDP_CSUM, "OUTER_UDP_CSUM", BASE_OUTER_UDP, 6, 0, 16, ENC_REPLACE),
+    /* VXLAN points one byte before the 24-bit VNI, at a reserved byte */
+    field(TUNNEL_ID, "TUNNEL_ID", BASE_TUNNEL_ID, 0, 0, 32, ENC_REPLACE),
+    field(GTPU_LEN, "GTPU_LEN", BASE_GTPU, 2, 0, 16, ENC_PREDICT, IP_LEN),
+};
+
+static constexpr bool
+fields_in_order()
+{
+    for (int i = 0; i < NUM_FIELDS; i++) {
+        if (FIELDS[i].id != i)
+            return false;
+        if (FIELDS[i].ref != NUM_FIELDS && FIELDS[i].ref >= i)
+            return false;
+    }
+    return true;
+}
+
+static_assert(fields_in_order(),
+        "FIELDS must be indexed by Header and refs must precede their users");
+static_assert(NUM_FIELDS <= 64, "FieldRecord::field_nr is 6 bits");
+
+static inline u32
+load_word(const u8 *p, u8 order)
+{
+    u32 w = (u32)p[0] << 24 | (u32)p[1] << 16 | (u32)p[2] << 8 | p[3];
+    return order == ORDER_BE ? w : __builtin_bswap32(w);
+}
+
+static inline void
+store_word(u8 *p, u32 w, u8 order)
+{
+    if (order == ORDER_LE)
+        w = __builtin_bswap32(w);
+    p[0] = w >> 24;
+    p[1] = w >> 16;
+    p[2] = w >> 8;
+    p[3] = w;
+}
+
+/* Diff encoding of field h of curr against prev (both indexed by Header,
+ * ~0 for absent fields). Returns false if nothing needs to be written. */
+static inline bool
+field_diff(Header h, const u32 *prev, const u32 *curr, u32 &value)
+{
+    const FieldDesc &f = FIELDS[h];
+    u32 step = f.step;
+
+    if (curr[h] == ~0u)
+        return false;
+
+    switch (f.encoding) {
+        case ENC_REPLACE:
+            value = curr[h];
+            return curr[h] != prev[h];
+        case ENC_DELTA:
+            value = (curr[h] - prev[h]) & f.mask;
+            return value != 0;
+        case ENC_PREDICT:
+            if (f.ref != NUM_FIELDS)
+                step = curr[f.ref] - prev[f.ref];
+            value = (curr[h] - prev[h] - step) & f.mask;
+            return value != 0;
+        default:
+            return false;
+    }
+}
+
+/* Inverse of field_diff; curr must hold the already decoded fields < h */
+static inline u32
+field_undiff(Header h, const u32 *prev, const u32 *curr, bool written, u32 value)
+{
+    const FieldDesc &f = FIELDS[h];
+    u32 step = f.step;
+
+    switch (f.encoding) {
+        case ENC_REPLACE:
+            return written ? value : prev[h];
+        case ENC_DELTA:
+            return (prev[h] + (written ? value : 0)) & f.mask;
+        case ENC_PREDICT:
+            if (f.ref != NUM_FIELDS)
+                step = curr[f.ref] - prev[f.ref];
+            return (prev[h] + step + (written ? value : 0)) & f.mask;
+        default:
+            return prev[h];
+    }
+}
+
+/* field_diff between the first packets of two flows, where the ENC_FIXED
+ * fields of the flow differ too; those are written whole */
+static inline bool
+field_diff_fixed(Header h, const u32 *prev, const u32 *curr, u32 &value)
+{
+    if (FIELDS[h].encoding != ENC_FIXED)
+        return field_diff(h, prev, curr, value);
+    value = curr[h];
+    return curr[h] != ~0u && curr[h] != prev[h];
+}
+
+/* Inverse of field_diff_fixed */
+static inline u32
+field_undiff_fixed(Header h, const u32 *prev, const u32 *curr, bool written, u32 value)
+{
+    if (FIELDS[h].encoding != ENC_FIXED)
+        return field_undiff(h, prev, curr, written, value);
+    return written ? value : prev[h];
+}
+
+#endif //FIELDS_HH
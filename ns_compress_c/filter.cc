@@ -0,0 +1,265 @@
+/*
+ * Copyright 2014, Stanford University. This file is licensed under Apache 2.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: nikhilh@cs.stanford.com (Nikhil Handigol)
+ *         jvimal@stanford.edu (Vimal Jeyakumar)
+ *         brandonh@cs.stanford.edu (Brandon Heller)
+ */
+
+#include <algorithm>
+#include <vector>
+#include "filter.hh"
+#include "fields.hh"
+#include "util.hh"
+
+using namespace std;
+
+#define TCP_MIN_HDR_LEN 20
+
+PacketFilter::~PacketFilter()
+{
+    if (compiled)
+        pcap_freecode(&prog);
+}
+
+bool
+PacketFilter::compile(const char *expr)
+{
+    /* Archives hold Ethernet frames with at most 64K of headers */
+    pcap_t *p = pcap_open_dead(DLT_EN10MB, 65535);
+
+    if (!p) {
+        ERR("Cannot compile filter\n");
+        return false;
+    }
+    if (pcap_compile(p, &prog, expr, 1, PCAP_NETMASK_UNKNOWN) < 0) {
+        ERR("Bad filter '%s': %s\n", expr, pcap_geterr(p));
+        pcap_close(p);
+        return false;
+    }
+    pcap_close(p);
+    compiled = true;
+    return true;
+}
+
+bool
+PacketFilter::match(const u8 *pkt, u32 caplen, u32 len) const
+{
+    struct pcap_pkthdr hdr;
+
+    hdr.ts.tv_sec = 0;
+    hdr.ts.tv_usec = 0;
+    hdr.caplen = caplen;
+    hdr.len = len;
+    return pcap_offline_filter(&prog, &hdr, pkt) != 0;
+}
+
+/* The filter run on what all packets of a flow have in common: every
+ * packet is decoded from the headers of the first one, with only the
+ * fields that diffs can change rewritten. A byte of the first packet
+ * outside those fields is thus a byte of every packet; loads of any
+ * other byte, and of the length, give an unknown value, and a branch on
+ * one is followed both ways. */
+
+struct FilterState {
+    u32 pc;
+    u32 a;
+    u32 x;
+    u32 mem[BPF_MEMWORDS];
+    u32 known;          /* bit 0: a, bit 1: x, bit 2 + i: mem[i] */
+};
+
+#define KNOWN_A 1u
+#define KNOWN_X 2u
+#define KNOWN_MEM(i) (4u << (i))
+
+static bool
+load_known(const vector<bool> &known, const u8 *pkt, u32 k, u32 size, u32 &value)
+{
+    if (k >= known.size() || size > known.size() - k)
+        return false;
+    value = 0;
+    REP(i, (int)size) {
+        if (!known[k + i])
+            return false;
+        value = value << 8 | pkt[k + i];
+    }
+    return true;
+}
+
+bool
+PacketFilter::flow_may_match(Packet &first) const
+{
+    u32 len = first.hdr_size();
+    vector<bool> known;
+    vector<FilterState> todo;
+    int steps = 0;
+
+    /* Options follow the fixed TCP header, and TCP_OFF can change */
+    if (first.field_base[BASE_TCP] != NO_OFFSET)
+        len = min(len, (u32)first.field_base[BASE_TCP] + TCP_MIN_HDR_LEN);
+    known.assign(len, true);
+    REP(i, NUM_FIELDS) {
+        const FieldDesc &f = FIELDS[i];
+        if (f.encoding == ENC_FIXED || f.base == BASE_NONE
+                || first.field_base[f.base] == NO_OFFSET)
+            continue;
+        u32 bits = f.mask << f.shift;
+        u32 off = first.field_base[f.base] + f.offset;
+        REP(j, 4) {
+            u32 byte = f.order == ORDER_BE ? 3 - j : j;
+            if ((bits >> (8 * byte)) & 0xff && off + j < len)
+                known[off + j] = false;
+        }
+    }
+
+    FilterState start;
+    memset(&start, 0, sizeof(start));
+    todo.push_back(start);
+    while (!todo.empty()) {
+        FilterState s = todo.back();
+        todo.pop_back();
+
+        for (;;) {
+            if (s.pc >= prog.bf_len || ++steps > FILTER_MAX_STEPS)
+                return true;
+            const struct bpf_insn &in = prog.bf_insns[s.pc++];
+            u32 k = in.k, size, v = 0;
+            bool ok;
+
+            switch (BPF_CLASS(in.code)) {
+                case BPF_LD:
+                case BPF_LDX:
+                    size = BPF_SIZE(in.code) == BPF_W ? 4 : BPF_SIZE(in.code) == BPF_H ? 2 : 1;
+                    switch (BPF_MODE(in.code)) {
+                        case BPF_IMM:
+                            v = k;
+                            ok = true;
+                            break;
+                        case BPF_ABS:
+                            ok = load_known(known, first.buff, k, size, v);
+                            break;
+                        case BPF_IND:
+                            ok = (s.known & KNOWN_X)
+                                && load_known(known, first.buff, s.x + k, size, v);
+                            break;
+                        case BPF_MEM:
+                            if (k >= BPF_MEMWORDS)
+                                return true;
+                            v = s.mem[k];
+                            ok = s.known & KNOWN_MEM(k);
+                            break;
+                        case BPF_MSH:
+                            ok = load_known(known, first.buff, k, 1, v);
+                            v = (v & 0xf) << 2;
+                            break;
+                        default:    /* BPF_LEN */
+                            ok = false;
+                            break;
+                    }
+                    if (BPF_CLASS(in.code) == BPF_LD) {
+                        s.a = v;
+                        s.known = ok ? s.known | KNOWN_A : s.known & ~KNOWN_A;
+                    } else {
+                        s.x = v;
+                        s.known = ok ? s.known | KNOWN_X : s.known & ~KNOWN_X;
+                    }
+                    break;
+
+                case BPF_ST:
+                case BPF_STX:
+                    if (k >= BPF_MEMWORDS)
+                        return true;
+                    if (BPF_CLASS(in.code) == BPF_ST) {
+                        s.mem[k] = s.a;
+                        ok = s.known & KNOWN_A;
+                    } else {
+                        s.mem[k] = s.x;
+                        ok = s.known & KNOWN_X;
+                    }
+                    s.known = ok ? s.known | KNOWN_MEM(k) : s.known & ~KNOWN_MEM(k);
+                    break;
+
+                case BPF_ALU:
+                    if (BPF_SRC(in.code) == BPF_X) {
+                        if (!(s.known & KNOWN_X))
+                            s.known &= ~KNOWN_A;
+                        k = s.x;
+                    }
+                    if (!(s.known & KNOWN_A))
+                        break;
+                    switch (BPF_OP(in.code)) {
+                        case BPF_ADD: s.a += k; break;
+                        case BPF_SUB: s.a -= k; break;
+                        case BPF_MUL: s.a *= k; break;
+                        case BPF_OR: s.a |= k; break;
+                        case BPF_AND: s.a &= k; break;
+                        case BPF_XOR: s.a ^= k; break;
+                        case BPF_LSH: s.a = k < 32 ? s.a << k : 0; break;
+                        case BPF_RSH: s.a = k < 32 ? s.a >> k : 0; break;
+                        case BPF_NEG: s.a = -s.a; break;
+                        case BPF_DIV:
+                        case BPF_MOD:
+                            /* The filter rejects the packet */
+                            if (k == 0)
+                                goto next;
+                            s.a = BPF_OP(in.code) == BPF_DIV ? s.a / k : s.a % k;
+                            break;
+                        default:
+                            return true;
+                    }
+                    break;
+
+                case BPF_JMP:
+                    if (BPF_OP(in.code) == BPF_JA) {
+                        s.pc += k;
+                        break;
+                    }
+                    ok = s.known & KNOWN_A;
+                    if (BPF_SRC(in.code) == BPF_X) {
+                        ok = ok && (s.known & KNOWN_X);
+                        k = s.x;
+                    }
+                    if (!ok) {
+                        FilterState t = s;
+                        t.pc += in.jt;
+                        todo.push_back(t);
+                        s.pc += in.jf;
+                        break;
+                    }
+                    switch (BPF_OP(in.code)) {
+                        case BPF_JEQ: ok = s.a == k; break;
+                        case BPF_JGT: ok = s.a > k; break;
+                        case BPF_JGE: ok = s.a >= k; break;
+                        case BPF_JSET: ok = (s.a & k) != 0; break;
+                        default: return true;
+                    }
+                    s.pc += ok ? in.jt : in.jf;
+                    break;
+
+                case BPF_RET:
+                    if (BPF_RVAL(in.code) == BPF_A) {
+                        if (!(s.known & KNOWN_A) || s.a != 0)
+                            return true;
+                    } else if (k != 0) {
+                        return true;
+                    }
+                    goto next;
+
+                default:    /* BPF_MISC */
+                    if (BPF_MISCOP(in.code) == BPF_TAX) {
+                        s.x = s.a;
+                        s.known = s.known & KNOWN_A ? s.known | KNOWN_X : s.known & ~KNOWN_X;
+                    } else {
+                        s.a = s.x;
+                        s.known = s.known & KNOWN_X ? s.known | KNOWN_A : s.known & ~KNOWN_A;
+                    }
+                    break;
+            }
+        }
+next:
+        ;
+    }
+    return false;
+}
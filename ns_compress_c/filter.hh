@@ -0,0 +1,36 @@
+/*
+ * Copyright 2014, Stanford University. This file is licensed under Apache 2.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: nikhilh@cs.stanford.com (Nikhil Handigol)
+ *         jvimal@stanford.edu (Vimal Jeyakumar)
+ *         brandonh@cs.stanford.edu (Brandon Heller)
+ */
+
+#ifndef FILTER_HH
+#define FILTER_HH
+
+#include <pcap.h>
+#include "types.hh"
+#include "packet.hh"
+
+/* Instructions a flow check may execute over all of its branches before
+ * it gives up and assumes that the flow matches */
+#define FILTER_MAX_STEPS 4096
+
+/* A BPF filter, in tcpdump syntax, for decoded packets */
+struct PacketFilter {
+    struct bpf_program prog;
+    bool compiled;
+
+    PacketFilter()
+    {
+        compiled = false;
+    }
+    ~PacketFilter();
+    bool compile(const char *expr);
+    bool match(const u8 *pkt, u32 caplen, u32 len) const;
+    bool flow_may_match(Packet &first) const;
+};
+
+#endif //FILTER_HH
@@ -8,34 +8,68 @@
  */
 
 #include <map>
+#include <cstring>
+#include <arpa/inet.h>
 #include "helper.hh"
 #include "flow.hh"
+#include "pcap_file.h"
 
 using namespace std;
 
-Header diff_headers[] = {
-	IP_TOS_F,
-	IP_LEN,
-	IP_ID,
-	IP_OFF,
-	IP_TTL_F,
-	IP_PROTO,
-	TCP_OFF,
-	TCP_FLAGS,
-	TCP_WIN,
-	TCP_URP,
-	UDP_LEN,
-};
+/* LogHistogram functions */
+LogHistogram::LogHistogram() 
+{
+    bzero(count, sizeof count);
+    total = 0;
+    sum = 0;
+    max = 0;
+}
 
-Header delta_headers[] = {
-	TS_SEC,
-	TCP_SEQ,
-	TCP_ACK,
-};
+void 
+LogHistogram::update(const LogHistogram &other) 
+{
+    REP(i, HIST_BUCKETS) count[i] += other.count[i];
+    total += other.total;
+    sum += other.sum;
+    max = std::max(max, other.max);
+}
+
+/* Upper bound of the bucket holding the p-th percentile, 0 <= p <= 1 */
+u64 
+LogHistogram::percentile(double p) const 
+{
+    u64 rank = p * total, seen = 0;
+
+    REP(i, HIST_BUCKETS) {
+        seen += count[i];
+        if (seen > rank || (seen == total && count[i]))
+            return i == 0 ? 0 : std::min(max, i == 64 ? ~0ULL : (1ULL << i) - 1);
+    }
+    return max;
+}
+
+void 
+LogHistogram::stats(JSON &j) const 
+{
+    JSON buckets;
+
+    REP(i, HIST_BUCKETS) {
+        if (count[i])
+            buckets[ntos(i == 0 ? 0 : 1ULL << (i - 1))] = V((u64)count[i]);
+    }
+    j["count"] = V(total);
+    j["avg"] = V(total ? sum * 1.0 / total : 0.0);
+    j["max"] = V(max);
+    j["p50"] = V(percentile(0.5));
+    j["p99"] = V(percentile(0.99));
+    j["buckets"] = V(buckets);
+}
 
 /* FlowStats functions */
 FlowStats::FlowStats() 
 {
+    bzero(FieldsChanged, sizeof FieldsChanged);
+    bzero(NumCompressedFields, sizeof NumCompressedFields);
     total_compressed_bits = 0;
     total_compressed_bytes = 0;
     total_bytes = 0;
@@ -52,11 +86,42 @@ FlowStats::update(FlowStats *other)
     num_packets += other->num_packets;
     max_duration_sec = max(max_duration_sec, other->max_duration_sec);
 
-    add_maps(FieldsChanged, other->FieldsChanged);
-    add_maps(NumCompressedFields, other->NumCompressedFields);
-    add_maps(TCPSeqDeltas, other->TCPSeqDeltas);
-    add_maps(TCPAckDeltas, other->TCPAckDeltas);
-    add_maps(PacketsPerFlow, other->PacketsPerFlow);
+    REP(i, NUM_FIELDS) FieldsChanged[i] += other->FieldsChanged[i];
+    REP(i, NUM_FIELDS + 1) NumCompressedFields[i] += other->NumCompressedFields[i];
+    TCPSeqDeltas.update(other->TCPSeqDeltas);
+    TCPAckDeltas.update(other->TCPAckDeltas);
+    PacketsPerFlow.update(other->PacketsPerFlow);
+}
+
+void 
+FlowStats::stats(JSON &j) 
+{
+    JSON fields, nfields, hist;
+
+    REP(i, NUM_FIELDS) {
+        if (FieldsChanged[i])
+            fields[FIELDS[i].name] = V((u64)FieldsChanged[i]);
+    }
+    REP(i, NUM_FIELDS + 1) {
+        if (NumCompressedFields[i])
+            nfields[ntos(i)] = V((u64)NumCompressedFields[i]);
+    }
+    j["FieldsChanged"] = V(fields);
+    j["NumCompressedFields"] = V(nfields);
+
+    TCPSeqDeltas.stats(hist);
+    j["TCPSeqDeltas"] = V(hist);
+    hist = JSON();
+    TCPAckDeltas.stats(hist);
+    j["TCPAckDeltas"] = V(hist);
+    hist = JSON();
+    PacketsPerFlow.stats(hist);
+    j["PacketsPerFlow"] = V(hist);
+
+    j["total_compressed_bytes"] = V(total_compressed_bytes);
+    j["total_bytes"] = V(total_bytes);
+    j["num_packets"] = V(num_packets);
+    j["max_duration_sec"] = V(max_duration_sec);
 }
 
 /* Flow functions */
@@ -68,6 +133,10 @@ Flow::Flow()
     other_packets_size = 0;
     packets = 0;
     bytes = 0;
+    rec_packets = 0;
+    rec_first_ns = 0;
+    ip_bytes = 0;
+    tcp_flags = 0;
     stats = NULL;
     memset(haprev, -1, sizeof(haprev));
     memset(hacurr, -1, sizeof(hacurr));
@@ -79,6 +148,10 @@ Flow::add_packet(Packet &pkt, FlowStats *s)
     int ret = 0;
     packets += 1;
     bytes += pkt.size;
+    if (s) {
+        s->num_packets++;
+        s->total_bytes += pkt.size;
+    }
 
     if (packets == 1) {
         stats = s;
@@ -96,6 +169,12 @@ Flow::add_packet(Packet &pkt, FlowStats *s)
     }
 
     pkt.get_headers_opt(hacurr);
+    if (rec_packets++ == 0)
+        rec_first_ns = pkt.ts.tv_sec * NSEC_PER_SEC + pkt.ts.tv_nsec;
+    if (hacurr[IP_LEN] != ~0u)
+        ip_bytes += hacurr[IP_LEN];
+    if (hacurr[TCP_FLAGS] != ~0u)
+        tcp_flags |= hacurr[TCP_FLAGS];
     return ret;
 }
 
@@ -119,24 +198,24 @@ FlowKey::FlowKey(Packet &pkt)
 void 
 FlowKey::hash() 
 {
-    u64 *data = (u64 *)&key[0];
+    u64 data[2];
+    memcpy(data, key, sizeof(data));
     hsh = data[0] ^ data[1];
 }
 
 bool 
 FlowKey::operator<(const FlowKey &other) const 
 {
-    u64 *data0 = (u64 *)&key[0];
-    u64 *data1 = (u64 *)&other.key[0];
+    u64 data0[2], data1[2];
+    memcpy(data0, key, sizeof(data0));
+    memcpy(data1, other.key, sizeof(data1));
     return data0[0] < data1[0] or (data0[0] == data1[0] and data0[1] < data1[1]);
 }
 
 bool 
 FlowKey::operator==(const FlowKey &other) const 
 {
-    u64 *data0 = (u64 *)&key[0];
-    u64 *data1 = (u64 *)&other.key[0];
-    return data0[0] == data1[0] and data0[1] == data1[1];
+    return memcmp(key, other.key, sizeof(key)) == 0;
 }
 
 void 
@@ -150,3 +229,235 @@ FlowKey::print() const
     printf("\n");
 }
 
+/* FlowHashTable functions */
+
+FlowHashTable::FlowHashTable()
+{
+    slots.assign(FLOW_TABLE_MIN_SLOTS, Slot());
+    shift = 64 - __builtin_ctzll(FLOW_TABLE_MIN_SLOTS);
+}
+
+FlowHashTable::~FlowHashTable()
+{
+    EACH(it, entries) delete *it;
+}
+
+FlowHashTable::Entry *
+FlowHashTable::find(const FlowKey &key) const
+{
+    u64 mask = slots.size() - 1;
+
+    for (u64 i = slot_of(key.hsh); ; i = (i + 1) & mask) {
+        const Slot &s = slots[i];
+        if (!s.entry)
+            return NULL;
+        if (s.holds(key))
+            return s.entry;
+    }
+}
+
+/* The flow of key, created if it is new */
+Flow &
+FlowHashTable::operator[](const FlowKey &key)
+{
+    u64 mask = slots.size() - 1;
+    u64 i;
+
+    for (i = slot_of(key.hsh); slots[i].entry; i = (i + 1) & mask) {
+        const Slot &s = slots[i];
+        if (s.holds(key))
+            return s.entry->second;
+    }
+
+    /* At most half full, so that probe sequences stay short */
+    if (unlikely(2 * (entries.size() + 1) > slots.size())) {
+        grow();
+        mask = slots.size() - 1;
+        for (i = slot_of(key.hsh); slots[i].entry; i = (i + 1) & mask)
+            ;
+    }
+    Entry *e = new Entry(key, Flow());
+    entries.push_back(e);
+    slots[i].set(e);
+    return e->second;
+}
+
+void
+FlowHashTable::grow()
+{
+    u64 mask;
+
+    slots.assign(slots.size() * 2, Slot());
+    shift--;
+    mask = slots.size() - 1;
+    EACH(it, entries) {
+        u64 i = slot_of((*it)->first.hsh);
+        while (slots[i].entry)
+            i = (i + 1) & mask;
+        slots[i].set(*it);
+    }
+}
+
+/* FlowExporter functions */
+
+bool
+FlowExporter::open(const char *file_name)
+{
+    size_t len = strlen(file_name);
+
+    csv = len >= 4 && strcmp(file_name + len - 4, ".csv") == 0;
+    fp = fopen(file_name, "wb");
+    if (!fp) {
+        ERR("Cannot open %s for writing\n", file_name);
+        return false;
+    }
+    if (csv) {
+        fprintf(fp, "proto,src,sport,dst,dport,first,last,packets,bytes,tcp_flags\n");
+    } else {
+        FlowRecordHeader hdr;
+        memcpy(hdr.magic, FLOW_RECORD_MAGIC, sizeof(hdr.magic));
+        hdr.version = FLOW_RECORD_VERSION;
+        hdr.record_len = sizeof(FlowRecord);
+        fwrite(&hdr, sizeof(hdr), 1, fp);
+    }
+    return true;
+}
+
+static FlowRecord
+flow_record(const FlowKey &key, const Flow &flow)
+{
+    const ofp_match *m = (const ofp_match *) key.key;
+    FlowRecord r;
+
+    r.first_ns = flow.rec_first_ns;
+    r.last_ns = flow.curr.ts.tv_sec * NSEC_PER_SEC + flow.curr.ts.tv_nsec;
+    r.bytes = flow.ip_bytes;
+    r.packets = flow.rec_packets;
+    r.nw_src = m->nw_src;
+    r.nw_dst = m->nw_dst;
+    r.tp_src = m->tp_src;
+    r.tp_dst = m->tp_dst;
+    r.nw_proto = m->nw_proto;
+    r.tcp_flags = flow.tcp_flags;
+    return r;
+}
+
+/* Whether the record of packets from first_ns to last_ns is due at now_ns */
+static bool
+record_due(u64 first_ns, u64 last_ns, u64 now_ns)
+{
+    return last_ns + FLOW_IDLE_SEC * NSEC_PER_SEC <= now_ns
+        || first_ns + FLOW_ACTIVE_SEC * NSEC_PER_SEC <= now_ns;
+}
+
+/* After each packet of flow, first if the flow starts with it: continues
+ * a record carried from the last archive, and about once a second of
+ * packet time writes the records that are due */
+void
+FlowExporter::add(FlowHashTable &flows, Flow &flow, bool first)
+{
+    u64 now = flow.curr.ts.tv_sec * NSEC_PER_SEC + flow.curr.ts.tv_nsec;
+
+    if (first && !carried.empty()) {
+        map<FlowKey, FlowRecord>::iterator it = carried.find(FlowKey(flow.first));
+        if (it != carried.end()) {
+            const FlowRecord &r = it->second;
+            if (record_due(r.first_ns, r.last_ns, now)) {
+                write(r);
+            } else {
+                flow.rec_packets += r.packets;
+                flow.rec_first_ns = r.first_ns;
+                flow.ip_bytes += r.bytes;
+                flow.tcp_flags |= r.tcp_flags;
+            }
+            carried.erase(it);
+        }
+    }
+    if (now >= next_check_ns) {
+        expire(flows, now);
+        next_check_ns = now + NSEC_PER_SEC;
+    }
+}
+
+/* Writes the records due at now_ns */
+void
+FlowExporter::expire(FlowHashTable &flows, u64 now_ns)
+{
+    EACH(it, flows) {
+        Flow &flow = (*it)->second;
+        u64 last = flow.curr.ts.tv_sec * NSEC_PER_SEC + flow.curr.ts.tv_nsec;
+        if (flow.rec_packets && record_due(flow.rec_first_ns, last, now_ns))
+            write((*it)->first, flow);
+    }
+    for (map<FlowKey, FlowRecord>::iterator it = carried.begin(); it != carried.end(); ) {
+        if (record_due(it->second.first_ns, it->second.last_ns, now_ns)) {
+            write(it->second);
+            carried.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/* Writes, or with carry keeps, the open records of an archive's flows */
+void
+FlowExporter::close_flows(FlowHashTable &flows)
+{
+    EACH(it, flows) {
+        Flow &flow = (*it)->second;
+        if (!flow.rec_packets)
+            continue;
+        if (carry)
+            carried[(*it)->first] = flow_record((*it)->first, flow);
+        else
+            write((*it)->first, flow);
+    }
+}
+
+/* Writes the open record of flow, and starts its next one */
+void
+FlowExporter::write(const FlowKey &key, Flow &flow)
+{
+    write(flow_record(key, flow));
+    flow.rec_packets = 0;
+    flow.ip_bytes = 0;
+    flow.tcp_flags = 0;
+}
+
+void
+FlowExporter::write(const FlowRecord &r)
+{
+    records++;
+
+    if (!csv) {
+        fwrite(&r, sizeof(r), 1, fp);
+        return;
+    }
+
+    /* Flags as nfdump prints them */
+    static const char names[] = "CEUAPRSF";
+    char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN], flags[9];
+    struct in_addr in;
+    in.s_addr = htonl(r.nw_src);
+    inet_ntop(AF_INET, &in, src, sizeof(src));
+    in.s_addr = htonl(r.nw_dst);
+    inet_ntop(AF_INET, &in, dst, sizeof(dst));
+    REP(i, 8) flags[i] = r.tcp_flags & (0x80 >> i) ? names[i] : '.';
+    flags[8] = 0;
+    fprintf(fp, "%u,%s,%u,%s,%u,%llu.%09llu,%llu.%09llu,%u,%llu,%s\n",
+            r.nw_proto, src, r.tp_src, dst, r.tp_dst,
+            r.first_ns / NSEC_PER_SEC, r.first_ns % NSEC_PER_SEC,
+            r.last_ns / NSEC_PER_SEC, r.last_ns % NSEC_PER_SEC,
+            r.packets, r.bytes, flags);
+}
+
+void
+FlowExporter::close()
+{
+    if (fp) {
+        EACH(it, carried) write(it->second);
+        fclose(fp);
+    }
+    carried.clear();
+    fp = NULL;
+}
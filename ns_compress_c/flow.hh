@@ -11,23 +11,54 @@
 #define FLOW_HH
 
 #include <map>
+#include <vector>
 #include "types.hh"
 #include "helper.hh"
 #include "packet.hh"
 #include "picojson.h"
 
 #define FLOW_EXP_SEC 10
+/* A flow record is written once its flow has been idle for FLOW_IDLE_SEC,
+ * and a long flow gets one every FLOW_ACTIVE_SEC */
+#define FLOW_IDLE_SEC 15
+#define FLOW_ACTIVE_SEC 300
 #define MAX_STATS 8
 
 using namespace std;
 
-/* These std::maps might be costly to update per-packet */
+/* Counts of values by bit length: bucket 0 holds 0 and bucket i holds
+ * [2^(i-1), 2^i), so adding a value is a few instructions and merging
+ * two histograms is O(buckets). */
+#define HIST_BUCKETS 65
+
+struct LogHistogram {
+	u64 count[HIST_BUCKETS];
+	u64 total;
+	u64 sum;
+	u64 max;
+
+	LogHistogram();
+	void add(u64 value)
+	{
+		count[value ? 64 - __builtin_clzll(value) : 0]++;
+		total++;
+		sum += value;
+		if (value > max)
+			max = value;
+	}
+	void update(const LogHistogram &other);
+	u64 percentile(double p) const;
+	void stats(JSON &j) const;
+};
+
+/* Flat arrays and fixed-size histograms, cheap enough to update for
+ * every packet; per-thread instances are combined with update() */
 struct FlowStats {
-	map<Header, u64> FieldsChanged;
-	map<u16, u64> NumCompressedFields;
-	map<u32, u64> TCPSeqDeltas;
-	map<u32, u64> TCPAckDeltas;
-	map<u32, u64> PacketsPerFlow;
+	u64 FieldsChanged[NUM_FIELDS];
+	u64 NumCompressedFields[NUM_FIELDS + 1];
+	LogHistogram TCPSeqDeltas;
+	LogHistogram TCPAckDeltas;
+	LogHistogram PacketsPerFlow;
 
 	u64 total_compressed_bits;
 	u64 total_compressed_bytes;
@@ -37,13 +68,18 @@ struct FlowStats {
 
         FlowStats();
         void update(FlowStats *other);
-
+        void stats(JSON &j);
 };
 
 struct Flow {
 	u32 first_packet_size;
 	u32 packets;
 	u64 bytes;
+	/* The flow record to come, of the packets since the last one */
+	u32 rec_packets;
+	u64 rec_first_ns;
+	u64 ip_bytes;		/* sum of IP_LEN */
+	u8 tcp_flags;		/* union over the packets */
 	u64 other_packets_size;
 	u64 compressed_size_bits;
 
@@ -54,6 +90,9 @@ struct Flow {
 
 	FlowStats *stats;
 
+	/* For the archive index */
+	vector<u32> first_ids;	/* first packets written for the flow */
+	vector<u32> chunks;	/* diff blocks it has packets in */
 
         Flow();
 	int add_packet(Packet &pkt, FlowStats *s = NULL);
@@ -99,4 +138,126 @@ struct HashFlowKey {
     }
 };
 
+/* Open addressing with linear probing over (hash, entry) slots, so that
+ * the slot of a key can be prefetched from its hash alone, a window
+ * ahead of the lookup. Slots hold a copy of the key, so that a hit is
+ * decided from the slot alone. Entries are allocated one at a time and
+ * never move, so Flow references stay valid as the table grows;
+ * iteration is in insertion order. */
+#define FLOW_TABLE_MIN_SLOTS 1024
+
+struct FlowHashTable {
+	typedef pair<const FlowKey, Flow> Entry;
+	struct Slot {
+		u64 hsh;
+		u64 key[2];	/* FlowKey::key */
+		Entry *entry;	/* NULL: free */
+
+		bool holds(const FlowKey &k) const
+		{
+			return hsh == k.hsh && memcmp(key, k.key, sizeof(key)) == 0;
+		}
+		void set(Entry *e)
+		{
+			hsh = e->first.hsh;
+			memcpy(key, e->first.key, sizeof(key));
+			entry = e;
+		}
+	};
+	static_assert(sizeof(FlowKey::key) == sizeof(Slot::key),
+			"a slot holds a whole flow key");
+
+	vector<Slot> slots;
+	u32 shift;		/* slots are indexed by the top bits */
+	vector<Entry *> entries;
+
+	FlowHashTable();
+	~FlowHashTable();
+	FlowHashTable(const FlowHashTable &) = delete;
+	FlowHashTable &operator=(const FlowHashTable &) = delete;
+
+	/* Fibonacci hashing, as FlowKey::hash leaves the low bits weak */
+	u64 slot_of(u64 hsh) const
+	{
+		return (hsh * 0x9e3779b97f4a7c15ULL) >> shift;
+	}
+	void prefetch(const FlowKey &key) const
+	{
+		__builtin_prefetch(&slots[slot_of(key.hsh)]);
+	}
+	Entry *find(const FlowKey &key) const;
+	Flow &operator[](const FlowKey &key);
+	size_t size() const
+	{
+		return entries.size();
+	}
+	vector<Entry *>::const_iterator begin() const
+	{
+		return entries.begin();
+	}
+	vector<Entry *>::const_iterator end() const
+	{
+		return entries.end();
+	}
+	void grow();
+};
+
+/* Flow records: a FlowRecordHeader, then FlowRecords as flows expire, all
+ * little-endian; addresses and ports are in host order, as in FlowKey */
+#define FLOW_RECORD_MAGIC "NSFR"
+#define FLOW_RECORD_VERSION 1
+
+struct FlowRecordHeader {
+	char magic[4];
+	u8 version;
+	u8 record_len;
+} __attribute__((packed));
+
+struct FlowRecord {
+	u64 first_ns;
+	u64 last_ns;
+	u64 bytes;		/* IP bytes */
+	u32 packets;
+	u32 nw_src;
+	u32 nw_dst;
+	u16 tp_src;
+	u16 tp_dst;
+	u8 nw_proto;
+	u8 tcp_flags;
+} __attribute__((packed));
+
+/* Writes flow records, binary or, for file names ending in .csv, one CSV
+ * line each. A flow's record is written as soon as it is due, checked
+ * about once a second of packet time, and the rest when the archive is
+ * closed. With carry set, those are kept instead, and continued by the
+ * flow of the same key in the next archive. */
+struct FlowExporter {
+	FILE *fp;
+	bool csv;
+	bool carry;
+	u64 records;
+	u64 next_check_ns;	/* of the next look for due records */
+	map<FlowKey, FlowRecord> carried;
+
+	FlowExporter()
+	{
+		fp = NULL;
+		csv = false;
+		carry = false;
+		records = 0;
+		next_check_ns = 0;
+	}
+	~FlowExporter()
+	{
+		close();
+	}
+	bool open(const char *file_name);
+	void add(FlowHashTable &flows, Flow &flow, bool first);
+	void expire(FlowHashTable &flows, u64 now_ns);
+	void close_flows(FlowHashTable &flows);
+	void close();
+	void write(const FlowKey &key, Flow &flow);
+	void write(const FlowRecord &r);
+};
+
 #endif
@@ -0,0 +1,373 @@
+/*
+ * Copyright 2014, Stanford University. This file is licensed under Apache 2.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: nikhilh@cs.stanford.com (Nikhil Handigol)
+ *         jvimal@stanford.edu (Vimal Jeyakumar)
+ *         brandonh@cs.stanford.edu (Brandon Heller)
+ */
+
+#include <algorithm>
+#include "flow_index.hh"
+#include "compress.hh"
+#include "util.hh"
+
+using namespace std;
+
+/* Copies n items of T at off in buf to out; false if buf is too short */
+template<class T>
+static bool
+read_items(const vector<u8> &buf, size_t &off, u64 n, vector<T> &out)
+{
+    if (off + n * sizeof(T) > buf.size())
+        return false;
+    out.resize(n);
+    memcpy(out.data(), buf.data() + off, n * sizeof(T));
+    off += n * sizeof(T);
+    return true;
+}
+
+/* ArchiveIndex functions */
+
+bool
+ArchiveIndex::open(FILE *fp)
+{
+    vector<u8> buf;
+    size_t off = sizeof(ih);
+
+    if (!archive_read_header(fp, hdr))
+        return false;
+    if (hdr.version < 2) {
+        ERR("The archive has no index\n");
+        return false;
+    }
+    if (!archive_read_index(fp, hdr.codec, buf))
+        return false;
+    if (buf.size() < sizeof(ih)) {
+        ERR("Corrupt archive index\n");
+        return false;
+    }
+    memcpy(&ih, buf.data(), sizeof(ih));
+    if (!read_items(buf, off, ih.num_blocks, blocks)
+            || !read_items(buf, off, ih.num_flows, flows)
+            || !read_items(buf, off, ih.num_first_ids, first_ids)
+            || !read_items(buf, off, ih.num_chunks, chunks)) {
+        ERR("Corrupt archive index\n");
+        return false;
+    }
+
+    REP(i, (int)blocks.size()) {
+        if (blocks[i].stream >= NUM_STREAMS) {
+            ERR("Corrupt archive index\n");
+            return false;
+        }
+        stream_blocks[blocks[i].stream].push_back(i);
+    }
+    EACH(it, flows) {
+        if ((u64)it->first_ids + it->num_first_ids > first_ids.size()
+                || (u64)it->chunks + it->num_chunks > chunks.size()) {
+            ERR("Corrupt archive index\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+/* The flow with the key of match, -1 if there is none */
+int
+ArchiveIndex::find(const ofp_match &match) const
+{
+    REP(i, (int)flows.size()) {
+        if (memcmp(flows[i].key, &match, FLOW_KEY_LEN) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* The block of stream holding record, NULL if there is none */
+const IndexBlock *
+ArchiveIndex::block_of(int stream, u64 record) const
+{
+    const vector<u32> &sb = stream_blocks[stream];
+    int lo = 0, hi = (int)sb.size() - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        const IndexBlock &blk = blocks[sb[mid]];
+        if (record < blk.first_record)
+            hi = mid - 1;
+        else if (record >= blk.first_record + blk.records)
+            lo = mid + 1;
+        else
+            return &blk;
+    }
+    return NULL;
+}
+
+/* FlowExtractor functions */
+
+FlowExtractor::FlowExtractor(FILE *f, const ArchiveIndex &index) : idx(index)
+{
+    map.open(fileno(f));
+    REP(i, NUM_STREAMS) cached[i] = NULL;
+    block_read.assign(idx.blocks.size(), false);
+    blocks_read = 0;
+}
+
+/* Decodes blk straight from the mapped archive, unless it is the cached
+ * block of its stream */
+bool
+FlowExtractor::load(const IndexBlock *blk)
+{
+    BlockHeader bh;
+    int s = blk->stream;
+
+    if (cached[s] == blk)
+        return true;
+    cached[s] = NULL;
+    memset(&bh, 0, sizeof(bh));
+    bh.stream = STREAM_END;
+    if (blk->offset <= map.size && map.size - blk->offset >= sizeof(bh))
+        memcpy(&bh, map.data + blk->offset, sizeof(bh));
+    if (bh.stream != s
+            || map.size - blk->offset - sizeof(bh) < bh.comp_len
+            || !reader.decompress(idx.hdr.codec, map.data + blk->offset + sizeof(bh),
+                    bh.comp_len, bh.raw_len, raw[s])) {
+        ERR("Cannot read archive block at %llu\n", blk->offset);
+        return false;
+    }
+    if (!block_read[blk - idx.blocks.data()]) {
+        block_read[blk - idx.blocks.data()] = true;
+        blocks_read++;
+    }
+
+    if (s == STREAM_TS) {
+        /* Decoded as by Decompressor::read_timestamp, from the state the
+         * index has for the block */
+        TsDecoder dec;
+        const u8 *p = raw[s].data(), *end = p + raw[s].size();
+        u64 value;
+        int len;
+
+        dec.start(blk->ts_prev, blk->ts_delta, blk->ts_ifid);
+        ts.clear();
+        ts_ifid.clear();
+        if (blk->first_record == 0) {
+            TimestampHeader th;
+            if (raw[s].size() < sizeof(th))
+                return false;
+            memcpy(&th, p, sizeof(th));
+            p += sizeof(th);
+            dec.start(th.ticks, 0, th.ifid);
+            ts.push_back(ticks_to_ns(dec.ticks, idx.ih.tsresol));
+            ts_ifid.push_back(dec.ifid);
+        }
+        while (p < end) {
+            if ((len = uvarint_decode(p, end - p, &value)) <= 0)
+                return false;
+            p += len;
+            if (dec.feed(value)) {
+                ts.push_back(ticks_to_ns(dec.ticks, idx.ih.tsresol));
+                ts_ifid.push_back(dec.ifid);
+            }
+        }
+        if (dec.pending() || ts.size() != blk->records)
+            return false;
+    } else if (s == STREAM_FIRSTPKT) {
+        first_pkts.version = idx.hdr.version;
+        first_pkts.clear();
+        for (size_t off = 0; off < raw[s].size(); ) {
+            int len = first_pkts.decode(raw[s].data() + off, raw[s].size() - off);
+            if (len < 0)
+                return false;
+            off += len;
+        }
+        if (first_pkts.off.size() != blk->records)
+            return false;
+    }
+
+    cached[s] = blk;
+    return true;
+}
+
+bool
+FlowExtractor::timestamp(u64 packet, u64 &ts_ns, u32 &ifid)
+{
+    const IndexBlock *blk = idx.block_of(STREAM_TS, packet);
+
+    if (!blk || !load(blk))
+        return false;
+    ts_ns = ts[packet - blk->first_record];
+    ifid = ts_ifid[packet - blk->first_record];
+    return true;
+}
+
+Packet *
+FlowExtractor::first_packet(u32 id, u32 packet)
+{
+    const IndexBlock *blk = idx.block_of(STREAM_FIRSTPKT, id);
+
+    if (!blk || !load(blk))
+        return NULL;
+    const u8 *rec = first_pkts.get(id - blk->first_record);
+    return new Packet(rec + 1, rec[0], 0, packet, rec[0]);
+}
+
+static void
+free_packet(Packet *p)
+{
+    delete[] p->buff;
+    delete p;
+}
+
+/* The flows that have packets filter may match, judged by their first
+ * packets alone */
+bool
+FlowExtractor::select(const PacketFilter &filter, vector<int> &flows)
+{
+    flows.clear();
+    REP(i, (int)idx.flows.size()) {
+        const IndexFlow &f = idx.flows[i];
+        bool may_match = false;
+        for (u32 j = 0; j < f.num_first_ids && !may_match; j++) {
+            Packet *p = first_packet(idx.first_ids[f.first_ids + j], 0);
+            if (!p)
+                return false;
+            may_match = filter.flow_may_match(*p);
+            free_packet(p);
+        }
+        if (may_match)
+            flows.push_back(i);
+    }
+    return true;
+}
+
+/* Writes the packets of flows that pass filter, if any, to out in their
+ * original order. The diff
+ * of a packet refers to the previous packet of its flow, so the flows'
+ * packets are found by following those references through their diff
+ * blocks. As in Decompressor, the packet of a flow is freed after the
+ * flow's last packet, so memory follows the number of concurrent flows. */
+bool
+FlowExtractor::extract(const vector<int> &flows, CaptureWriter &out, u64 &written,
+        const PacketFilter *filter)
+{
+    vector<u32> diff_blocks;
+    vector<u32> first_flow;                 /* first packet id -> flow, ~0 if none */
+    vector<u32> flow_left(idx.flows.size(), 0);     /* packets still to come */
+    vector<u32> flow_last(idx.flows.size(), ~0u);   /* its packet in last */
+    unordered_map<u32, LastPacket> last;    /* packet number -> its flow */
+    Packet *retired = NULL;
+    bool ok = false;
+
+    written = 0;
+    EACH(it, flows) {
+        const IndexFlow &f = idx.flows[*it];
+        REP(i, (int)f.num_first_ids) {
+            u32 id = idx.first_ids[f.first_ids + i];
+            if (id >= first_flow.size())
+                first_flow.resize(id + 1, ~0u);
+            first_flow[id] = *it;
+        }
+        REP(i, (int)f.num_chunks) diff_blocks.push_back(idx.chunks[f.chunks + i]);
+        flow_left[*it] = f.packets;
+    }
+    sort(diff_blocks.begin(), diff_blocks.end());
+    diff_blocks.erase(unique(diff_blocks.begin(), diff_blocks.end()), diff_blocks.end());
+
+    EACH(b, diff_blocks) {
+        if (*b >= idx.stream_blocks[STREAM_DIFF].size())
+            goto done;
+        const IndexBlock *blk = &idx.blocks[idx.stream_blocks[STREAM_DIFF][*b]];
+        if (!load(blk))
+            goto done;
+
+        const vector<u8> &buf = raw[STREAM_DIFF];
+        size_t off = 0;
+        for (u64 seq = blk->first_record; off < buf.size(); seq++) {
+            DiffRecord diff;
+            u32 values[NUM_FIELDS], prev[NUM_FIELDS];
+            u64 fields = 0;
+            Packet *p;
+            int flow;
+
+            if (off + sizeof(diff) > buf.size())
+                goto done;
+            memcpy(&diff, buf.data() + off, sizeof(diff));
+            off += sizeof(diff);
+
+            if (diff.num_changes != FIRST_PACKET_ENCODE) {
+                REP(i, diff.num_changes) {
+                    if (off >= buf.size())
+                        goto done;
+                    const FieldRecord *field = (const FieldRecord *) (buf.data() + off);
+                    int len = field->value_len + 1;
+                    if (field->field_nr >= NUM_FIELDS || off + 1 + len > buf.size())
+                        goto done;
+                    values[field->field_nr] = varint_decode(len, (u8 *) field->field_value);
+                    fields |= 1ULL << field->field_nr;
+                    off += 1 + len;
+                }
+                auto ref = last.find(diff.packet_ref);
+                if (ref == last.end())
+                    continue;
+                Packet *pkt_ref = ref->second.pkt;
+                flow = ref->second.flow;
+                last.erase(ref);
+                p = new Packet(pkt_ref->buff, pkt_ref->size, pkt_ref->skip_ethernet,
+                        seq, pkt_ref->caplen);
+                pkt_ref->get_headers_opt(prev);
+                p->apply_diff(prev, values, fields);
+                free_packet(pkt_ref);
+            } else {
+                if (diff.packet_ref >= first_flow.size() || first_flow[diff.packet_ref] == ~0u)
+                    continue;
+                flow = first_flow[diff.packet_ref];
+                /* A restarted flow goes on from its new first packet */
+                if (flow_last[flow] != ~0u) {
+                    auto prev = last.find(flow_last[flow]);
+                    if (prev != last.end()) {
+                        free_packet(prev->second.pkt);
+                        last.erase(prev);
+                    }
+                    flow_last[flow] = ~0u;
+                }
+                if (!(p = first_packet(diff.packet_ref, seq)))
+                    goto done;
+            }
+
+            /* The state of a flow goes once its last packet is written */
+            if (flow_left[flow] > 0 && --flow_left[flow] == 0) {
+                flow_last[flow] = ~0u;
+                retired = p;
+            } else {
+                last[seq] = LastPacket{ p, flow };
+                flow_last[flow] = seq;
+            }
+
+            /* Only packets that pass get a timestamp and are written */
+            CaptureRecord rec;
+            rec.caplen = p->hdr_size();
+            rec.len = p->infer_len();
+            rec.data = p->buff;
+            if (!filter || filter->match(rec.data, rec.caplen, rec.len)) {
+                if (!timestamp(seq, rec.ts_ns, rec.ifid))
+                    goto done;
+                out.write(rec);
+                written++;
+            }
+            if (retired) {
+                free_packet(retired);
+                retired = NULL;
+            }
+        }
+    }
+
+    ok = true;
+
+done:
+    if (retired)
+        free_packet(retired);
+    EACH(it, last) free_packet(it->second.pkt);
+    return ok;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2014, Stanford University. This file is licensed under Apache 2.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: nikhilh@cs.stanford.com (Nikhil Handigol)
+ *         jvimal@stanford.edu (Vimal Jeyakumar)
+ *         brandonh@cs.stanford.edu (Brandon Heller)
+ */
+
+#ifndef FLOW_INDEX_HH
+#define FLOW_INDEX_HH
+
+#include <cstdio>
+#include <vector>
+#include <unordered_map>
+#include "types.hh"
+#include "archive.hh"
+#include "flow.hh"
+#include "packet.hh"
+#include "pcap_file.h"
+#include "filter.hh"
+#include "compress.hh"
+
+using namespace std;
+
+/* The index at the end of a version 2 archive */
+struct ArchiveIndex {
+    ArchiveHeader hdr;
+    IndexHeader ih;
+    vector<IndexBlock> blocks;
+    vector<IndexFlow> flows;
+    vector<u32> first_ids;
+    vector<u32> chunks;
+    vector<u32> stream_blocks[NUM_STREAMS];    /* blocks of each stream */
+
+    bool open(FILE *fp);
+    int find(const ofp_match &match) const;
+    const IndexBlock *block_of(int stream, u64 record) const;
+};
+
+/* Decodes the packets of some flows of an archive, reading only the diff
+ * blocks the index lists for them and the ts and firstpkt blocks of
+ * those packets */
+struct FlowExtractor {
+    MappedFile map;
+    BlockReader reader;
+    const ArchiveIndex &idx;
+
+    /* The last block read of each stream, decoded */
+    const IndexBlock *cached[NUM_STREAMS];
+    vector<u8> raw[NUM_STREAMS];
+    vector<u64> ts;             /* ns, of the packets of the ts block */
+    vector<u32> ts_ifid;
+    FirstPacketBlock first_pkts;    /* of the firstpkt block */
+    vector<bool> block_read;
+    u64 blocks_read;            /* distinct blocks read */
+
+    FlowExtractor(FILE *f, const ArchiveIndex &index);
+    bool load(const IndexBlock *blk);
+    bool timestamp(u64 packet, u64 &ts_ns, u32 &ifid);
+    Packet *first_packet(u32 id, u32 packet);
+    bool select(const PacketFilter &filter, vector<int> &flows);
+    bool extract(const vector<int> &flows, CaptureWriter &out, u64 &written,
+            const PacketFilter *filter = NULL);
+};
+
+#endif //FLOW_INDEX_HH
@@ -7,6 +7,11 @@
  *         brandonh@cs.stanford.edu (Brandon Heller)
  */
 
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "helper.hh"
 #include "types.hh"
 
@@ -121,29 +126,60 @@ void hexify_packet(const u8 *buf, char *hex, size_t buflen)
     *hex = '\0';
 }
 
+/* Value of a hex digit in either case; no validation */
+static inline u8 hex_nibble(char c)
+{
+    u8 v = c | 0x20;
+    return v > '9' ? v - 'a' + 10 : v - '0';
+}
+
+#ifdef __SSE2__
+/* Decodes 32 hex digits into 16 bytes */
+static inline void hex_decode_32(const char *hex, u8 *bytes)
+{
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i nine = _mm_set1_epi8('9');
+    const __m128i digit = _mm_set1_epi8('0');
+    const __m128i letter = _mm_set1_epi8('a' - 10 - '0');
+    const __m128i low_byte = _mm_set1_epi16(0x00ff);
+    __m128i w[2];
+
+    REP(i, 2) {
+        __m128i v = _mm_or_si128(_mm_loadu_si128((const __m128i *)(hex + 16 * i)), lower);
+        __m128i is_letter = _mm_cmpgt_epi8(v, nine);
+        v = _mm_sub_epi8(v, digit);
+        v = _mm_sub_epi8(v, _mm_and_si128(is_letter, letter));
+        /* Each 16-bit lane holds the high nibble in its low byte */
+        w[i] = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, low_byte), 4),
+                _mm_srli_epi16(v, 8));
+    }
+    _mm_storeu_si128((__m128i *)bytes, _mm_packus_epi16(w[0], w[1]));
+}
+#endif
+
+/* Decodes len hex digits (len even) into len/2 bytes */
+size_t hex_decode(const char *hex, size_t len, u8 *bytes)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 32 <= len; i += 32)
+        hex_decode_32(hex + i, bytes + i / 2);
+#endif
+    for (; i + 2 <= len; i += 2)
+        bytes[i / 2] = hex_nibble(hex[i]) << 4 | hex_nibble(hex[i + 1]);
+    return len / 2;
+}
+
+/* Decodes a NUL or newline terminated hex string; bytes need not be
+ * cleared */
 void byteify_packet(const char *hex, u8 *bytes, size_t *buflen) 
 {
-    int count = 0;
     *buflen = 0;
     if (hex == NULL)
         return;
 
-    while (*hex) {
-        count++;
-        if (*hex <= '9') {
-            *bytes = (*bytes * 16) + (*hex - '0');
-        }
-        else {
-            *bytes = (*bytes * 16) + (*hex - 'a' + 10);
-        }
-
-        if (count == 2) {
-            count = 0;
-            bytes++;
-            (*buflen)++;
-        }
-        hex++;
-    }
+    *buflen = hex_decode(hex, strcspn(hex, "\r\n"), bytes);
 }
 
 double diff_time_ms(const timeval &t1, const timeval &t2)
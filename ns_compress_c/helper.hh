@@ -59,6 +59,19 @@
 
 using namespace std;
 
+/* Time stamp counter, or nanoseconds where there is none */
+static inline u64
+read_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
 static inline void print_debug(const char *location, const char *msg, ...)
 {
     va_list args;
@@ -97,6 +110,7 @@ u64 memory_usage_kb();
 void print_timestamp(struct timeval ts);
 void hexify_packet(const u8 *buf, char *hex, size_t buflen);
 void byteify_packet(const char *hex, u8 *bytes, size_t *buflen);
+size_t hex_decode(const char *hex, size_t len, u8 *bytes);
 double diff_time_ms(const timeval &t1, const timeval &t2);
 
 template<class T>
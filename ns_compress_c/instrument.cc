@@ -0,0 +1,81 @@
+/*
+ * Copyright 2014, Stanford University. This file is licensed under Apache 2.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: nikhilh@cs.stanford.com (Nikhil Handigol)
+ *         jvimal@stanford.edu (Vimal Jeyakumar)
+ *         brandonh@cs.stanford.edu (Brandon Heller)
+ */
+
+#include <cstring>
+#include <ctime>
+#include "instrument.hh"
+
+thread_local Instrument instr;
+thread_local StageTimer *StageTimer::current = NULL;
+
+static const char *STAGE_NAMES[NUM_STAGES] = {
+    "read", "parse", "flow_lookup", "timestamp", "diff", "emit", "flush",
+};
+
+static const char *COUNTER_NAMES[NUM_COUNTERS] = {
+    "packets", "bytes", "flows", "first_packets", "flow_restarts", "fields",
+    "first_deltas",
+    "first_fields",
+};
+
+static u64 
+monotonic_ns() 
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void 
+Instrument::reset() 
+{
+    bzero(cycles, sizeof cycles);
+    bzero(calls, sizeof calls);
+    bzero(counters, sizeof counters);
+    start_cycles = read_cycles();
+    start_ns = monotonic_ns();
+}
+
+void 
+Instrument::merge(const Instrument &other) 
+{
+    REP(i, NUM_STAGES) {
+        cycles[i] += other.cycles[i];
+        calls[i] += other.calls[i];
+    }
+    REP(i, NUM_COUNTERS) counters[i] += other.counters[i];
+}
+
+/* Cycles are converted with the counter rate measured since reset() */
+void 
+Instrument::stats(JSON &j) 
+{
+    u64 elapsed_ns = monotonic_ns() - start_ns;
+    double cycles_per_ns = elapsed_ns ?
+            (read_cycles() - start_cycles) * 1.0 / elapsed_ns : 1;
+    u64 packets = counters[CTR_PACKETS];
+    JSON jstages, jcounters;
+
+    REP(i, NUM_STAGES) {
+        JSON ele;
+        if (!calls[i])
+            continue;
+        ele["calls"] = V((u64)calls[i]);
+        ele["cycles"] = V((u64)cycles[i]);
+        ele["ns"] = V((u64)(cycles[i] / cycles_per_ns));
+        if (packets)
+            ele["cycles_per_packet"] = V(cycles[i] * 1.0 / packets);
+        jstages[STAGE_NAMES[i]] = V(ele);
+    }
+    REP(i, NUM_COUNTERS) jcounters[COUNTER_NAMES[i]] = V((u64)counters[i]);
+
+    j["stages"] = V(jstages);
+    j["counters"] = V(jcounters);
+    j["cycles_per_ns"] = V(cycles_per_ns);
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2014, Stanford University. This file is licensed under Apache 2.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: nikhilh@cs.stanford.com (Nikhil Handigol)
+ *         jvimal@stanford.edu (Vimal Jeyakumar)
+ *         brandonh@cs.stanford.edu (Brandon Heller)
+ */
+
+#ifndef INSTRUMENT_HH
+#define INSTRUMENT_HH
+
+#include "types.hh"
+#include "helper.hh"
+
+/* Pipeline stages timed by STAGE_TIMER. Stages nest (emit runs inside
+ * diff); each stage reports its own time without that of nested stages. */
+enum Stage {
+    STAGE_READ,         /* reading and decoding input records */
+    STAGE_PARSE,        /* Packet construction and unpack */
+    STAGE_FLOW_LOOKUP,  /* FlowKey, flow table and Flow::add_packet */
+    STAGE_TIMESTAMP,
+    STAGE_DIFF,         /* header extraction and field diffs */
+    STAGE_EMIT,         /* handing bytes to the stream compressors */
+    STAGE_FLUSH,        /* final compression */
+
+    NUM_STAGES,
+};
+
+enum Counter {
+    CTR_PACKETS,
+    CTR_BYTES,          /* captured bytes given to the compressor */
+    CTR_FLOWS,
+    CTR_FIRST_PACKETS,
+    CTR_FLOW_RESTARTS,  /* first packets written for too many changes
+                         * or a new header layout */
+    CTR_FIELDS,         /* field records written */
+    CTR_FIRST_DELTAS,   /* first packets written against earlier ones */
+    CTR_FIRST_FIELDS,   /* of which as fields changed in another flow's */
+
+    NUM_COUNTERS,
+};
+
+struct Instrument {
+    u64 cycles[NUM_STAGES];
+    u64 calls[NUM_STAGES];
+    u64 counters[NUM_COUNTERS];
+    u64 start_cycles, start_ns;
+
+    Instrument()
+    {
+        reset();
+    }
+    void reset();
+    void merge(const Instrument &other);
+    void stats(JSON &j);
+};
+
+/* Per thread, so that the pipeline stages never share a cache line */
+extern thread_local Instrument instr;
+
+struct StageTimer {
+    static thread_local StageTimer *current;
+    StageTimer *parent;
+    u8 stage;
+    u64 start;
+    u64 nested;
+
+    StageTimer(Stage s)
+    {
+        parent = current;
+        current = this;
+        stage = s;
+        nested = 0;
+        start = read_cycles();
+    }
+    ~StageTimer()
+    {
+        u64 elapsed = read_cycles() - start;
+        instr.cycles[stage] += elapsed - nested;
+        instr.calls[stage]++;
+        if (parent)
+            parent->nested += elapsed;
+        current = parent;
+    }
+};
+
+#define STAGE_CAT_(a, b) a##b
+#define STAGE_CAT(a, b) STAGE_CAT_(a, b)
+
+#ifndef NS_NO_INSTRUMENT
+# define STAGE_TIMER(stage) StageTimer STAGE_CAT(_stage_timer_, __LINE__)(stage)
+# define COUNT(ctr, n) (instr.counters[ctr] += (n))
+#else
+# define STAGE_TIMER(stage)
+# define COUNT(ctr, n)
+#endif
+
+#endif //INSTRUMENT_HH
@@ -0,0 +1,459 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <poll.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include "live_capture.h"
+#include "cpz_codec.h"
+#include "cpz_ns.h"
+
+#define POLL_MS 100
+#define PCAP_BUFFER_SIZE (64 << 20)
+#define TPACKET_BLOCK_SIZE (1 << 22)
+#define TPACKET_BLOCK_NR 64
+#define TPACKET_FRAME_SIZE (1 << 11)
+
+static volatile sig_atomic_t stop_capture;
+
+static void on_signal(int) {
+    stop_capture = 1;
+}
+
+/* PcapSource functions */
+
+PcapSource::~PcapSource() {
+    if (handle)
+        pcap_close(handle);
+}
+
+bool PcapSource::open(const char *iface, u32 snaplen, bool promisc) {
+    char err[PCAP_ERRBUF_SIZE];
+
+    handle = pcap_create(iface, err);
+    if (!handle) {
+        ERR("Cannot capture on %s: %s\n", iface, err);
+        return false;
+    }
+    pcap_set_snaplen(handle, snaplen);
+    pcap_set_promisc(handle, promisc);
+    pcap_set_timeout(handle, POLL_MS);
+    pcap_set_buffer_size(handle, PCAP_BUFFER_SIZE);
+    nsec = pcap_set_tstamp_precision(handle, PCAP_TSTAMP_PRECISION_NANO) == 0;
+
+    if (pcap_activate(handle) < 0) {
+        ERR("Cannot capture on %s: %s\n", iface, pcap_geterr(handle));
+        return false;
+    }
+    if (pcap_datalink(handle) != DLT_EN10MB) {
+        ERR("%s is not an Ethernet interface\n", iface);
+        return false;
+    }
+    return true;
+}
+
+/* The record points into the libpcap buffer */
+int PcapSource::next(CaptureRecord &rec) {
+    struct pcap_pkthdr *hdr;
+    const u8 *data;
+
+    int ret = pcap_next_ex(handle, &hdr, &data);
+    if (ret <= 0)
+        return ret == 0 ? 0 : -1;
+
+    rec.ts_ns = hdr->ts.tv_sec * NSEC_PER_SEC + hdr->ts.tv_usec * (nsec ? 1 : 1000);
+    rec.ifid = 0;
+    rec.caplen = hdr->caplen;
+    rec.len = hdr->len;
+    rec.data = data;
+    return 1;
+}
+
+u64 PcapSource::drops() {
+    struct pcap_stat ps;
+
+    if (pcap_stats(handle, &ps) < 0)
+        return 0;
+    return ps.ps_drop + ps.ps_ifdrop;
+}
+
+/* TpacketSource functions */
+
+TpacketSource::~TpacketSource() {
+    if (ring)
+        munmap(ring, (size_t) block_size * block_nr);
+    if (fd >= 0)
+        close(fd);
+}
+
+bool TpacketSource::open(const char *iface, u32 snap, bool promisc) {
+    struct tpacket_req3 req;
+    struct sockaddr_ll ll;
+    int version = TPACKET_V3;
+    int ifindex = if_nametoindex(iface);
+
+    if (!ifindex) {
+        ERR("No interface %s\n", iface);
+        return false;
+    }
+    fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (fd < 0) {
+        ERR("Cannot open a packet socket: %s\n", strerror(errno));
+        return false;
+    }
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        ERR("TPACKET_V3 is not supported: %s\n", strerror(errno));
+        return false;
+    }
+
+    /* Blocks are handed over when full or after POLL_MS */
+    block_size = TPACKET_BLOCK_SIZE;
+    block_nr = TPACKET_BLOCK_NR;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = block_size;
+    req.tp_block_nr = block_nr;
+    req.tp_frame_size = TPACKET_FRAME_SIZE;
+    req.tp_frame_nr = block_size / TPACKET_FRAME_SIZE * block_nr;
+    req.tp_retire_blk_tov = POLL_MS;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        ERR("Cannot set up the capture ring: %s\n", strerror(errno));
+        return false;
+    }
+    ring = (u8 *) mmap(NULL, (size_t) block_size * block_nr, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        ring = NULL;
+        ERR("Cannot map the capture ring: %s\n", strerror(errno));
+        return false;
+    }
+
+    memset(&ll, 0, sizeof(ll));
+    ll.sll_family = AF_PACKET;
+    ll.sll_protocol = htons(ETH_P_ALL);
+    ll.sll_ifindex = ifindex;
+    if (bind(fd, (struct sockaddr *) &ll, sizeof(ll)) < 0) {
+        ERR("Cannot bind to %s: %s\n", iface, strerror(errno));
+        return false;
+    }
+    if (promisc) {
+        struct packet_mreq mr;
+        memset(&mr, 0, sizeof(mr));
+        mr.mr_ifindex = ifindex;
+        mr.mr_type = PACKET_MR_PROMISC;
+        setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr));
+    }
+
+    snaplen = snap;
+    block = 0;
+    left = 0;
+    return true;
+}
+
+/* The record points into the ring; its block goes back to the kernel on
+ * the call after its last packet */
+int TpacketSource::next(CaptureRecord &rec) {
+    auto *bd = (struct tpacket_block_desc *) (ring + (size_t) block * block_size);
+
+    if (left == 0) {
+        if (pkt) {
+            __sync_synchronize();
+            bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+            block = (block + 1) % block_nr;
+            bd = (struct tpacket_block_desc *) (ring + (size_t) block * block_size);
+            pkt = NULL;
+        }
+        if (!(bd->hdr.bh1.block_status & TP_STATUS_USER)) {
+            struct pollfd pfd = { fd, POLLIN | POLLERR, 0 };
+            if (poll(&pfd, 1, POLL_MS) < 0 && errno != EINTR)
+                return -1;
+            if (!(bd->hdr.bh1.block_status & TP_STATUS_USER))
+                return 0;
+        }
+        __sync_synchronize();
+        left = bd->hdr.bh1.num_pkts;
+        pkt = (u8 *) bd + bd->hdr.bh1.offset_to_first_pkt;
+        if (left == 0)
+            return 0;
+    }
+
+    auto *hdr = (struct tpacket3_hdr *) pkt;
+    rec.ts_ns = hdr->tp_sec * NSEC_PER_SEC + hdr->tp_nsec;
+    rec.ifid = 0;
+    rec.caplen = min(hdr->tp_snaplen, snaplen);
+    rec.len = hdr->tp_len;
+    rec.data = pkt + hdr->tp_mac;
+    pkt += hdr->tp_next_offset;
+    left--;
+    return 1;
+}
+
+u64 TpacketSource::drops() {
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+
+    if (getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0)
+        return 0;
+    return st.tp_drops;
+}
+
+/* ReplaySource functions */
+
+bool ReplaySource::open(const char *file_name, double replay_speed) {
+    speed = replay_speed;
+    first_ts = ~0ULL;
+    pending = false;
+    return reader.open(file_name);
+}
+
+/* Packets come out at their capture times relative to the first one,
+ * scaled by 1/speed; long gaps are slept through in POLL_MS steps */
+int ReplaySource::next(CaptureRecord &rec) {
+    if (!pending && !reader.next(pending_rec))
+        return -1;
+    pending = true;
+
+    if (speed > 0) {
+        u64 now = now_ns();
+        if (first_ts == ~0ULL) {
+            first_ts = pending_rec.ts_ns;
+            start = now;
+        }
+        u64 offset = pending_rec.ts_ns > first_ts ? pending_rec.ts_ns - first_ts : 0;
+        u64 due = start + (u64) (offset / speed);
+        if (due > now) {
+            u64 wait = min(due - now, (u64) POLL_MS * 1000000);
+            struct timespec ts = { (time_t) (wait / NSEC_PER_SEC), (long) (wait % NSEC_PER_SEC) };
+            nanosleep(&ts, NULL);
+            if (due > now + wait)
+                return 0;
+        }
+    }
+
+    rec = pending_rec;
+    pending = false;
+    return 1;
+}
+
+/* A sequence of archives <prefix>.<n>.nsa, each decodable on its own: a
+ * new archive starts with a new Compressor and an empty flow table */
+struct RotatingArchive {
+    const CaptureOptions &opt;
+    Compressor *c;
+    FILE *fp;
+    FlowExporter *exporter;     /* shared by the archives */
+    u32 index;
+    u64 opened_ns;
+    u32 packets;
+    u64 bytes;
+    double ratio[NUM_STREAMS];  /* compressed to raw bytes, of the last archive */
+    double flow_bytes;          /* of index and block headers per flow, likewise */
+
+    RotatingArchive(const CaptureOptions &o, FlowExporter *e) : opt(o) {
+        c = NULL;
+        fp = NULL;
+        exporter = e;
+        index = 0;
+        /* Until an archive is done, as if nothing compressed */
+        REP(i, NUM_STREAMS) ratio[i] = 1;
+        flow_bytes = sizeof(IndexFlow) + 2 * sizeof(u32);
+    }
+    ~RotatingArchive() {
+        close();
+    }
+    u64 comp_size() {
+        return c->ts_out.comp_size + c->firstpkt_out.comp_size + c->diff_out.comp_size;
+    }
+    /* Compressed sizes are only known per block, once its worker is done
+     * with it: the raw bytes of a stream not compressed yet count at the
+     * ratio of its blocks compressed so far, and the index to come at the
+     * size per flow of the last archive */
+    u64 est_size() {
+        double size = c->flows.size() * flow_bytes;
+        REP(i, NUM_STREAMS) {
+            const BlockWriter *w = c->writers[i];
+            u64 comp = w->comp_size, comp_raw = w->comp_raw;
+            double r = comp_raw ? (double) comp / comp_raw : ratio[i];
+            size += comp + (w->flushed_raw + w->raw_len - comp_raw) * r;
+        }
+        return size;
+    }
+    bool due() {
+        return c && ((opt.rotate_bytes && est_size() >= opt.rotate_bytes)
+                || (opt.rotate_sec && now_ns() - opened_ns >= opt.rotate_sec * NSEC_PER_SEC));
+    }
+    bool open(u8 tsresol);
+    void close();
+};
+
+bool RotatingArchive::open(u8 tsresol) {
+    char name[4096];
+
+    snprintf(name, sizeof(name), "%s.%u.nsa", opt.prefix, index++);
+    fp = fopen(name, "wb");
+    if (!fp) {
+        ERR("Cannot open %s for writing\n", name);
+        return false;
+    }
+    c = new Compressor(opt.zstd, fp);
+    c->exporter = exporter;
+    /* Keep the codecs off the capture thread */
+    c->start_workers();
+    c->set_ts_resolution(tsresol);
+    opened_ns = now_ns();
+    packets = 0;
+    bytes = 0;
+    return true;
+}
+
+void RotatingArchive::close() {
+    if (!c)
+        return;
+    c->close();
+    u64 size = ftell(fp);
+    REP(i, NUM_STREAMS) {
+        const BlockWriter *w = c->writers[i];
+        if (w->flushed_raw)
+            ratio[i] = (double) w->comp_size / w->flushed_raw;
+    }
+    if (c->flows.size())
+        flow_bytes = (double) (size - comp_size()) / c->flows.size();
+    fprintf(stderr, "%s.%u.nsa: %u packets, %llu bytes, %llu compressed\n",
+            opt.prefix, index - 1, packets, bytes, size);
+    delete c;
+    fclose(fp);
+    c = NULL;
+    fp = NULL;
+}
+
+template<class Source>
+static bool run_capture(Source &src, const CaptureOptions &opt) {
+    CaptureRecord rec{};
+    Packet p;
+    u64 total = 0;
+    int ret = 0;
+
+    stop_capture = 0;
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    FlowExporter exporter;
+    if (opt.flow_records && !exporter.open(opt.flow_records))
+        return false;
+    exporter.carry = true;
+    RotatingArchive out(opt, opt.flow_records ? &exporter : NULL);
+    while (!stop_capture && (!opt.max_packets || total < opt.max_packets)) {
+        ret = src.next(rec);
+        if (ret < 0)
+            break;
+        if (out.due())
+            out.close();
+        if (ret == 0)
+            continue;
+
+        if (!out.c && !out.open(src.finest_tsresol()))
+            return false;
+        rec.caplen = min(rec.caplen, opt.snaplen);
+        load_record(p, rec, out.packets++);
+        out.c->write_pkt(p);
+        out.bytes += rec.caplen;
+        total++;
+    }
+    out.close();
+
+    fprintf(stderr, "%llu packets captured, %llu dropped\n", total, src.drops());
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    return true;
+}
+
+bool live_capture(const CaptureOptions &opt) {
+    switch (opt.source_type) {
+        case SOURCE_PCAP: {
+            PcapSource src;
+            return src.open(opt.source, opt.snaplen, opt.promisc) && run_capture(src, opt);
+        }
+        case SOURCE_TPACKET: {
+            TpacketSource src;
+            return src.open(opt.source, opt.snaplen, opt.promisc) && run_capture(src, opt);
+        }
+        default: {
+            ReplaySource src;
+            return src.open(opt.source, opt.speed) && run_capture(src, opt);
+        }
+    }
+}
+
+static void capture_usage() {
+    fprintf(stderr, "usage: ns_compress capture (-i interface [-m pcap|tpacket] [-p] | -r capture [-x speed])\n"
+            "           -w prefix [-c netsight_gzip|netsight_zstd] [-C MB] [-G seconds]\n"
+            "           [-s snaplen] [-n packets] [-R flow_records]\n");
+    exit(1);
+}
+
+/* ns_compress capture ...: compresses packets from an interface, or from
+ * a capture file replayed at its original rate, into <prefix>.<n>.nsa
+ * archives, starting a new one every -C MB or -G seconds */
+int capture_main(int argc, char *argv[]) {
+    CaptureOptions opt;
+    int o;
+
+    opt.source_type = SOURCE_PCAP;
+    opt.source = NULL;
+    opt.snaplen = CAPTURE_SNAPLEN;
+    opt.promisc = true;
+    opt.speed = 1;
+    opt.zstd = false;
+    opt.prefix = NULL;
+    opt.rotate_bytes = 0;
+    opt.rotate_sec = 0;
+    opt.max_packets = 0;
+    opt.flow_records = NULL;
+
+    while ((o = getopt(argc, argv, "i:r:m:px:w:c:C:G:s:n:R:h")) != -1) {
+        switch (o) {
+            case 'i': opt.source = optarg; break;
+            case 'r':
+                opt.source = optarg;
+                opt.source_type = SOURCE_REPLAY;
+                break;
+            case 'm':
+                if (strcmp(optarg, "tpacket") == 0)
+                    opt.source_type = SOURCE_TPACKET;
+                else if (strcmp(optarg, "pcap") != 0)
+                    capture_usage();
+                break;
+            case 'p': opt.promisc = false; break;
+            case 'x': opt.speed = atof(optarg); break;
+            case 'w': opt.prefix = optarg; break;
+            case 'c': {
+                const Codec *codec = codec_find(optarg);
+                if (!codec || !codec->netsight)
+                    capture_usage();
+                opt.zstd = codec->run == cpz_ns_zstd_run;
+                break;
+            }
+            case 'C': opt.rotate_bytes = strtoull(optarg, NULL, 10) << 20; break;
+            case 'G': opt.rotate_sec = strtoull(optarg, NULL, 10); break;
+            case 's': opt.snaplen = strtoul(optarg, NULL, 10); break;
+            case 'n': opt.max_packets = strtoull(optarg, NULL, 10); break;
+            case 'R': opt.flow_records = optarg; break;
+            default: capture_usage();
+        }
+    }
+    if (!opt.source || !opt.prefix || !opt.snaplen)
+        capture_usage();
+
+    return live_capture(opt) ? 0 : 1;
+}
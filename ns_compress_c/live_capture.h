@@ -0,0 +1,110 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+#ifndef NS_COMPRESS_LIVE_CAPTURE_H
+#define NS_COMPRESS_LIVE_CAPTURE_H
+
+#include <pcap.h>
+#include "types.hh"
+#include "pcap_file.h"
+
+using namespace std;
+
+enum CaptureSourceType {
+    SOURCE_PCAP,        /* libpcap on an interface */
+    SOURCE_TPACKET,     /* AF_PACKET socket with a TPACKET_V3 ring */
+    SOURCE_REPLAY,      /* a capture file, replayed at its own pace */
+};
+
+/* The live sources have the CaptureReader interface, except that next()
+ * returns 0 when no packet arrived within a poll interval, so that the
+ * caller can rotate archives on an idle link, and -1 at the end. The
+ * record points into the capture buffer until the next call. */
+
+struct PcapSource {
+    pcap_t *handle;
+    bool nsec;
+
+    PcapSource()
+    {
+        handle = NULL;
+    }
+    ~PcapSource();
+    bool open(const char *iface, u32 snaplen, bool promisc);
+    int next(CaptureRecord &rec);
+    u8 finest_tsresol()
+    {
+        return nsec ? TSRESOL_NSEC : TSRESOL_USEC;
+    }
+    u64 drops();
+};
+
+struct TpacketSource {
+    int fd;
+    u8 *ring;
+    u32 block_size;
+    u32 block_nr;
+    u32 snaplen;
+
+    u32 block;          /* block being read */
+    u32 left;           /* packets left in it, 0 if it isn't ours yet */
+    u8 *pkt;
+
+    TpacketSource()
+    {
+        fd = -1;
+        ring = NULL;
+        pkt = NULL;
+    }
+    ~TpacketSource();
+    bool open(const char *iface, u32 snaplen, bool promisc);
+    int next(CaptureRecord &rec);
+    u8 finest_tsresol()
+    {
+        return TSRESOL_NSEC;
+    }
+    u64 drops();
+};
+
+struct ReplaySource {
+    CaptureReader reader;
+    double speed;       /* 0: as fast as possible */
+    u64 first_ts;
+    u64 start;
+    CaptureRecord pending_rec;  /* read, but not due yet */
+    bool pending;
+
+    bool open(const char *file_name, double speed);
+    int next(CaptureRecord &rec);
+    u8 finest_tsresol()
+    {
+        return reader.finest_tsresol();
+    }
+    u64 drops()
+    {
+        return 0;
+    }
+};
+
+struct CaptureOptions {
+    int source_type;
+    const char *source;     /* interface, or capture file to replay */
+    u32 snaplen;
+    bool promisc;
+    double speed;
+    bool zstd;
+    const char *prefix;     /* archives are <prefix>.<n>.nsa */
+    u64 rotate_bytes;       /* 0: no size limit */
+    u64 rotate_sec;         /* 0: no time limit */
+    u64 max_packets;        /* 0: until interrupted */
+    const char *flow_records;   /* NULL: none */
+};
+
+bool live_capture(const CaptureOptions &opt);
+int capture_main(int argc, char *argv[]);
+
+#endif //NS_COMPRESS_LIVE_CAPTURE_H
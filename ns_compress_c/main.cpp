@@ -7,42 +7,142 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <cstring>
 #include "cpz_gzip.h"
 #include "cpz_zstd.h"
 #include "cpz_ns.h"
+#include "live_capture.h"
+#include "extract.h"
+#include "query.h"
+#include "batch.h"
+#include "merge.h"
 
 
 using namespace std;
 
-ulong PACKET_BUFF_SIZE;
-ulong MAX_PKT_SIZE;
+thread_local ulong PACKET_BUFF_SIZE;
+thread_local ulong MAX_PKT_SIZE;
 
-void read_file(const char *file_name, vector<string> &packets) {
-    ifstream in(file_name);
-    if (!in.is_open()) {
-        cout << "Error opening file";
-        exit(1);
-    }
-
-    string tmp;
-    while (getline(in, tmp)) {
-        packets.push_back(tmp);
-    }
+static void usage() {
+    cout << "usage: ns_compress [--json] [-P] [-X] [-L lookahead] [-R flow_records] file" << endl
+         << "       ns_compress [--json] [-P] [-X] [-L lookahead] [-R flow_records] [-c codec] [-o output] file|-" << endl
+         << "       ns_compress capture ..." << endl
+         << "       ns_compress extract ..." << endl
+         << "       ns_compress decompress ..." << endl
+         << "       ns_compress query ..." << endl
+         << "       ns_compress merge [-P] [-X] [-c codec] -o output capture..." << endl
+         << "       ns_compress bench [-j threads] [-o output_dir] dir" << endl
+         << "codecs:";
+    REP(i, NUM_CODECS) cout << " " << CODECS[i].name;
+    cout << endl;
+    exit(1);
 }
 
 int main(int argc, char *argv[]) {
-    vector<string> packets;
+    bool json = false;
+    const char *input = NULL, *output = NULL, *codec_name = NULL;
 
-    if (argc != 2) {
+    if (argc > 1 && strcmp(argv[1], "capture") == 0)
+        return capture_main(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "extract") == 0)
+        return extract_main(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "decompress") == 0)
+        return decompress_main(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "query") == 0)
+        return query_main(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        return batch_main(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "merge") == 0)
+        return merge_main(argc - 1, argv + 1);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0)
+            json = true;
+        else if (strcmp(argv[i], "-P") == 0)
+            cpz_ns_pipeline = true;
+        else if (strcmp(argv[i], "-X") == 0)
+            cpz_ns_cross_flow = true;
+        else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc) {
+            char *end;
+            long l = strtol(argv[++i], &end, 10);
+            if (*end || end == argv[i] || l < 0)
+                usage();
+            /* Packets past the batch are never looked up ahead */
+            cpz_ns_lookahead = min(l, (long) WRITE_BATCH);
+        }
+        else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc)
+            cpz_ns_flow_records = argv[++i];
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            codec_name = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else if (!input)
+            input = argv[i];
+        else
+            usage();
+    }
+    if (!input) {
         cout << "There should be one and only one file name in the given args.";
         exit(1);
-    } else {
-        string file_name(argv[1]);
-        read_file((file_name + ".ns").c_str(), packets);
     }
 
-    cpz_ns_gzip(packets);
-    cpz_ns_zstd(packets);
-    cpz_gzip(argv[1]);
-    cpz_zstd(argv[1]);
-}
\ No newline at end of file
+    /* Streaming: one codec from a file or stdin into an output file or
+     * stdout, with fixed-size buffers */
+    if (codec_name || output || strcmp(input, "-") == 0) {
+        const Codec *codec = codec_find(codec_name ? codec_name : "netsight_gzip");
+        if (!codec)
+            usage();
+
+        FILE *out = NULL;
+        if (output)
+            out = strcmp(output, "-") == 0 ? stdout : fopen(output, "wb");
+        if (output && !out) {
+            ERR("Cannot open %s for writing\n", output);
+            return 1;
+        }
+
+        /* The report must not mix with an archive on stdout */
+        ostream &report = out == stdout ? cerr : cout;
+        bool ok;
+        if (json) {
+            JSON j;
+            ok = cpz_run(*codec, input, j, out);
+            if (ok)
+                report << V(j).serialize() << endl;
+        } else {
+            ok = cpz_run_and_report(*codec, input, out, report);
+        }
+        if (out && out != stdout)
+            fclose(out);
+        return ok ? 0 : 1;
+    }
+
+    /* Hex dumps written by compress.py take precedence; otherwise the
+     * pcap or pcapng capture itself is read */
+    string file_name(input);
+    string ns_name = file_name;
+    if (ifstream(file_name + ".ns").good())
+        ns_name += ".ns";
+
+    /* --json: one document with the stage timers and counters of every
+     * codec instead of the text report */
+    picojson::array runs;
+    REP(i, NUM_CODECS) {
+        const Codec &codec = CODECS[i];
+        const char *name = codec.netsight ? ns_name.c_str() : file_name.c_str();
+        if (!json) {
+            cpz_run_and_report(codec, name);
+            continue;
+        }
+        JSON j;
+        if (cpz_run(codec, name, j))
+            runs.push_back(V(j));
+    }
+
+    if (json) {
+        JSON report;
+        report["file"] = V(file_name);
+        report["runs"] = V(runs);
+        cout << V(report).serialize() << endl;
+    }
+}
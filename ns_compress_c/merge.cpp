@@ -0,0 +1,77 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#include "merge.h"
+#include "cpz_ns.h"
+
+using namespace std;
+
+static void merge_usage() {
+    fprintf(stderr, "usage: ns_compress merge [-P] [-X] [-c codec] -o output capture...\n"
+            "compresses the pcap and pcapng captures, merged by timestamp, into one\n"
+            "archive (- for stdout); each capture interface keeps an interface id\n"
+            "codecs: netsight_gzip (default) netsight_zstd\n");
+    exit(1);
+}
+
+/* ns_compress merge -o site.nsa eth0.pcap eth1.pcap: one archive of
+ * several captures, without merging them into a capture first */
+int merge_main(int argc, char *argv[]) {
+    const char *codec_name = "netsight_gzip", *output = NULL;
+    vector<const char *> inputs;
+    CaptureMerger src;
+    CodecStats st{};
+    int o;
+
+    while ((o = getopt(argc, argv, "PXc:o:h")) != -1) {
+        switch (o) {
+            case 'P': cpz_ns_pipeline = true; break;
+            case 'X': cpz_ns_cross_flow = true; break;
+            case 'c': codec_name = optarg; break;
+            case 'o': output = optarg; break;
+            default: merge_usage();
+        }
+    }
+    const Codec *codec = codec_find(codec_name);
+    if (!output || optind >= argc || !codec || !codec->netsight)
+        merge_usage();
+    bool zstd = strcmp(codec->name, "netsight_zstd") == 0;
+    for (int i = optind; i < argc; i++)
+        inputs.push_back(argv[i]);
+
+    FILE *out = strcmp(output, "-") == 0 ? stdout : fopen(output, "wb");
+    if (!out) {
+        ERR("Cannot open %s for writing\n", output);
+        return 1;
+    }
+    if (!src.open(inputs)) {
+        if (out != stdout)
+            fclose(out);
+        return 1;
+    }
+
+    instr.reset();
+    u64 start = now_ns();
+    bool ok = cpz_ns_merge_run(src, zstd, out, st);
+    u64 time_ns = now_ns() - start;
+    if (out != stdout)
+        fclose(out);
+    if (!ok)
+        return 1;
+
+    fprintf(stderr, "%llu packets of %zu captures, %u interfaces\n",
+            st.packets, inputs.size(), src.num_ifaces);
+    fprintf(stderr, "%s compression rate: %.6g%%\n", codec->name,
+            ((double) st.uncomp_size - st.comp_size) / st.uncomp_size * 100);
+    fprintf(stderr, "%s time consumption: %llu μs\n", codec->name, time_ns / 1000);
+    return 0;
+}
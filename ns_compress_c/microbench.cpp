@@ -0,0 +1,407 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+/*
+ * ns_microbench: ns/packet and cycles/packet of the per-packet stages of
+ * the NetSight compressor, measured over a packet mix held in memory.
+ *
+ *   ns_microbench [-p profile | -f capture] [-n packets] [-s seed]
+ *                 [-F concurrent_flows] [-t min_seconds] [-b name_filter]
+ *
+ * Each benchmark runs passes over the whole mix until min_seconds have
+ * elapsed and reports its fastest pass. The L= variants prefetch flow
+ * table slots that many packets ahead; their benefit shows once the table
+ * is larger than the caches, e.g. with -F 200000.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unistd.h>
+#include "compress.hh"
+#include "cpz_codec.h"
+#include "trace_gen.h"
+#include "util.hh"
+
+using namespace std;
+
+thread_local ulong PACKET_BUFF_SIZE;
+thread_local ulong MAX_PKT_SIZE;
+
+struct PassTime {
+    u64 ns;
+    u64 cycles;
+};
+
+struct PacketMix {
+    vector<Packet *> pkts;          /* unpacked */
+    vector<Packet *> raw;           /* same bytes, not unpacked */
+    vector<FlowKey> keys;
+    vector<Packet> batch;           /* copies of pkts, for write_pkts */
+    FlowHashTable table;
+
+    /* one entry per packet with an earlier packet in its flow */
+    vector<u32 *> diff_prev;
+    vector<u32 *> diff_values;
+    vector<u64> diff_written;
+    vector<Packet *> diff_target;
+
+    vector<u32> varint_values;
+    vector<u8> varint_bytes;
+    vector<u8> varint_lens;
+};
+
+/* Keeps results alive without the compiler seeing through them */
+static volatile u64 sink;
+
+#define PASS_BEGIN \
+    u64 _c0 = read_cycles(), _t0 = now_ns()
+#define PASS_END \
+    return PassTime{ now_ns() - _t0, read_cycles() - _c0 }
+
+static PassTime bench_unpack(PacketMix &m)
+{
+    u64 acc = 0;
+    PASS_BEGIN;
+    EACH(it, m.raw) {
+        (*it)->unpack();
+        acc += (*it)->hdr_len;
+    }
+    sink = acc;
+    PASS_END;
+}
+
+static PassTime bench_get_headers_opt(PacketMix &m)
+{
+    u32 hv[NUM_FIELDS];
+    u64 acc = 0;
+    PASS_BEGIN;
+    EACH(it, m.pkts) {
+        (*it)->get_headers_opt(hv);
+        acc += hv[IP_ID];
+    }
+    sink = acc;
+    PASS_END;
+}
+
+static PassTime bench_flowkey(PacketMix &m)
+{
+    u64 acc = 0;
+    PASS_BEGIN;
+    EACH(it, m.pkts) {
+        FlowKey key(**it);
+        acc += key.hsh;
+    }
+    sink = acc;
+    PASS_END;
+}
+
+static PassTime bench_flowkey_hash(PacketMix &m)
+{
+    HashFlowKey h;
+    u64 acc = 0;
+    PASS_BEGIN;
+    EACH(it, m.keys) {
+        it->hash();
+        acc += h(*it);
+    }
+    sink = acc;
+    PASS_END;
+}
+
+static PassTime bench_flow_lookup(PacketMix &m)
+{
+    u64 acc = 0;
+    PASS_BEGIN;
+    EACH(it, m.keys) {
+        acc += m.table.find(*it)->second.packets;
+    }
+    sink = acc;
+    PASS_END;
+}
+
+template<int L>
+static PassTime bench_flow_lookahead(PacketMix &m)
+{
+    const FlowKey *keys = m.keys.data();
+    int n = m.keys.size();
+    u64 acc = 0;
+    PASS_BEGIN;
+    REP(i, n) {
+        if (i + L < n)
+            m.table.prefetch(keys[i + L]);
+        acc += m.table.find(keys[i])->second.packets;
+    }
+    sink = acc;
+    PASS_END;
+}
+
+/* The whole compressor, from a fresh flow table */
+template<int L>
+static PassTime bench_write_pkts(PacketMix &m)
+{
+    Compressor c;
+    c.lookahead = L;
+    PASS_BEGIN;
+    c.write_pkts(m.batch.data(), m.keys.data(), m.batch.size());
+    c.flush();
+    PASS_END;
+}
+
+/* write_diff_packet depends on the flow state left by the packets before
+ * it, so the compressor runs for real and only the call is timed; the
+ * cost of reading the clock is measured and subtracted */
+static PassTime bench_write_diff_packet(PacketMix &m)
+{
+    static u64 overhead_ns = ~0ULL, overhead_cycles = ~0ULL;
+    Compressor c;
+    PassTime t = { 0, 0 };
+
+    if (overhead_ns == ~0ULL) {
+        REP(i, 1000) {
+            u64 c0 = read_cycles(), t0 = now_ns();
+            u64 t1 = now_ns(), c1 = read_cycles();
+            overhead_ns = min(overhead_ns, t1 - t0);
+            overhead_cycles = min(overhead_cycles, c1 - c0);
+        }
+    }
+
+    EACH(it, m.pkts) {
+        Packet &pkt = **it;
+        FlowKey key(pkt);
+        Flow &flow = c.flows[key];
+        int first = flow.add_packet(pkt, &c.flow_stats);
+        int first_packet_id = first ? c.write_first_header(pkt) : -1;
+
+        u64 c0 = read_cycles(), t0 = now_ns();
+        c.write_diff_packet(flow, pkt, first_packet_id);
+        u64 t1 = now_ns(), c1 = read_cycles();
+        t.ns += t1 - t0 > overhead_ns ? t1 - t0 - overhead_ns : 0;
+        t.cycles += c1 - c0 > overhead_cycles ? c1 - c0 - overhead_cycles : 0;
+    }
+    return t;
+}
+
+static PassTime bench_varint_encode(PacketMix &m)
+{
+    u8 *out = m.varint_bytes.data();
+    u64 acc = 0;
+    PASS_BEGIN;
+    EACH(it, m.varint_values) {
+        int len = varint_encode(*it, out);
+        out += len;
+        acc += len;
+    }
+    sink = acc;
+    PASS_END;
+}
+
+static PassTime bench_varint_decode(PacketMix &m)
+{
+    u8 *in = m.varint_bytes.data();
+    u64 acc = 0;
+    PASS_BEGIN;
+    EACH(it, m.varint_lens) {
+        acc += varint_decode(*it, in);
+        in += *it;
+    }
+    sink = acc;
+    PASS_END;
+}
+
+static PassTime bench_apply_diff(PacketMix &m)
+{
+    u64 acc = 0;
+    PASS_BEGIN;
+    REP(i, (int)m.diff_target.size()) {
+        m.diff_target[i]->apply_diff(m.diff_prev[i], m.diff_values[i], m.diff_written[i]);
+        acc += m.diff_target[i]->hdr_len;
+    }
+    sink = acc;
+    PASS_END;
+}
+
+static PassTime bench_pack_buf(PacketMix &m)
+{
+    u8 out[4096];
+    u64 acc = 0;
+    PASS_BEGIN;
+    EACH(it, m.pkts) {
+        acc += (*it)->pack_buf(out);
+        acc += out[0];
+    }
+    sink = acc;
+    PASS_END;
+}
+
+struct MicroBench {
+    const char *name;
+    PassTime (*run)(PacketMix &m);
+    size_t (*count)(PacketMix &m);  /* items per pass */
+};
+
+static size_t count_packets(PacketMix &m) { return m.pkts.size(); }
+static size_t count_diffs(PacketMix &m) { return m.diff_target.size(); }
+static size_t count_varints(PacketMix &m) { return m.varint_values.size(); }
+
+static const MicroBench BENCHES[] = {
+    { "Packet::unpack", bench_unpack, count_packets },
+    { "Packet::get_headers_opt", bench_get_headers_opt, count_packets },
+    { "FlowKey::FlowKey", bench_flowkey, count_packets },
+    { "FlowKey::hash", bench_flowkey_hash, count_packets },
+    { "FlowHashTable::find", bench_flow_lookup, count_packets },
+    { "FlowHashTable::find L=4", bench_flow_lookahead<4>, count_packets },
+    { "FlowHashTable::find L=8", bench_flow_lookahead<8>, count_packets },
+    { "FlowHashTable::find L=16", bench_flow_lookahead<16>, count_packets },
+    { "write_diff_packet", bench_write_diff_packet, count_packets },
+    { "varint_encode", bench_varint_encode, count_varints },
+    { "varint_decode", bench_varint_decode, count_varints },
+    { "Packet::apply_diff", bench_apply_diff, count_diffs },
+    { "Packet::pack_buf", bench_pack_buf, count_packets },
+    { "Compressor::write_pkts L=0", bench_write_pkts<0>, count_packets },
+    { "Compressor::write_pkts L=8", bench_write_pkts<8>, count_packets },
+    { "Compressor::write_pkts L=16", bench_write_pkts<16>, count_packets },
+};
+
+template<class Source>
+static void load_mix(Source &src, u64 limit, PacketMix &m)
+{
+    CaptureRecord rec;
+    unordered_map<FlowKey, int, HashFlowKey> last;
+    u32 max_caplen = 0;
+    vector<vector<u8> > data;
+
+    while (data.size() < limit && src.next(rec)) {
+        data.push_back(vector<u8>(rec.data, rec.data + rec.caplen));
+        max_caplen = max(max_caplen, rec.caplen);
+    }
+    PACKET_BUFF_SIZE = max_caplen + 4;
+    MAX_PKT_SIZE = PACKET_BUFF_SIZE + 4096;
+
+    REP(i, (int)data.size()) {
+        const vector<u8> &d = data[i];
+        Packet *p = new Packet(d.data(), d.size(), 0, i, d.size());
+        m.pkts.push_back(p);
+        m.batch.push_back(*p);
+        m.raw.push_back(new Packet(d.data(), d.size(), 0, i, d.size(), false));
+
+        FlowKey key(*p);
+        m.keys.push_back(key);
+        m.table[key].add_packet(*p);
+
+        auto prev = last.find(key);
+        if (prev != last.end()) {
+            Packet *ref = m.pkts[prev->second];
+            u32 *hv_prev = new u32[NUM_FIELDS];
+            u32 *values = new u32[NUM_FIELDS];
+            u32 hv_curr[NUM_FIELDS];
+            u64 written = 0;
+
+            ref->get_headers_opt(hv_prev);
+            p->get_headers_opt(hv_curr);
+            REP(f, NUM_FIELDS) {
+                if (field_diff(static_cast<Header>(f), hv_prev, hv_curr, values[f])) {
+                    written |= 1ULL << f;
+                    m.varint_values.push_back(values[f]);
+                }
+            }
+            m.diff_prev.push_back(hv_prev);
+            m.diff_values.push_back(values);
+            m.diff_written.push_back(written);
+            m.diff_target.push_back(new Packet(ref->buff, ref->size, 0, i, ref->caplen));
+        }
+        last[key] = i;
+    }
+
+    m.varint_bytes.resize(m.varint_values.size() * sizeof(u32));
+    EACH(it, m.varint_values) {
+        u8 tmp[sizeof(u32)];
+        m.varint_lens.push_back(varint_encode(*it, tmp));
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-p profile | -f capture] [-n packets] [-s seed] "
+            "[-F concurrent_flows] [-t min_seconds] [-b name_filter]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    u64 num_packets = 100000, seed = 1;
+    u32 concurrent_flows = 0;
+    int profile = TRACE_WEB, opt;
+    double min_time = 0.5;
+    const char *file_name = NULL, *filter = NULL;
+    PacketMix mix;
+
+    while ((opt = getopt(argc, argv, "p:f:n:s:F:t:b:h")) != -1) {
+        switch (opt) {
+            case 'p':
+                profile = trace_profile_find(optarg);
+                if (profile < 0)
+                    usage(argv[0]);
+                break;
+            case 'f': file_name = optarg; break;
+            case 'n': num_packets = strtoull(optarg, NULL, 10); break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            case 'F': concurrent_flows = strtoul(optarg, NULL, 10); break;
+            case 't': min_time = atof(optarg); break;
+            case 'b': filter = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (file_name) {
+        CaptureReader reader;
+        if (!reader.open(file_name))
+            return 1;
+        load_mix(reader, num_packets, mix);
+    } else {
+        TraceGen gen(profile, seed, num_packets, 128, concurrent_flows);
+        load_mix(gen, num_packets, mix);
+    }
+
+    printf("mix: %s, %zu packets, %zu flows, %zu diffs, %zu varints\n",
+            file_name ? file_name : trace_profile_name(profile),
+            mix.pkts.size(), mix.table.size(), mix.diff_target.size(),
+            mix.varint_values.size());
+    printf("%-28s %12s %14s %8s\n", "benchmark", "ns/item", "cycles/item", "passes");
+
+    REP(b, (int)nelem(BENCHES)) {
+        const MicroBench &bench = BENCHES[b];
+        size_t items = bench.count(mix);
+        PassTime best = { ~0ULL, ~0ULL };
+        u64 elapsed = 0;
+        int passes = 0;
+
+        if (filter && !strstr(bench.name, filter))
+            continue;
+        if (!items) {
+            printf("%-28s %12s\n", bench.name, "no items");
+            continue;
+        }
+
+        bench.run(mix);     /* warm up */
+        while (elapsed < min_time * 1e9 || passes < 3) {
+            u64 start = now_ns();
+            PassTime t = bench.run(mix);
+            elapsed += now_ns() - start;
+            passes++;
+            if (t.ns < best.ns)
+                best = t;
+        }
+
+        printf("%-28s %12.2f %14.2f %8d\n", bench.name,
+                best.ns * 1.0 / items, best.cycles * 1.0 / items, passes);
+    }
+    return 0;
+}
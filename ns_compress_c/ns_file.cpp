@@ -0,0 +1,89 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ns_file.h"
+
+NsReader::NsReader()
+{
+    data = NULL;
+    size = 0;
+    pos = 0;
+    buf_size = 4096;
+    buf = new u8[buf_size];
+}
+
+bool NsReader::open(const char *file_name)
+{
+    struct stat st;
+    int fd = ::open(file_name, O_RDONLY);
+
+    if (fd < 0) {
+        ERR("Cannot open %s\n", file_name);
+        return false;
+    }
+    if (fstat(fd, &st) < 0) {
+        ::close(fd);
+        return false;
+    }
+
+    size = st.st_size;
+    pos = 0;
+    data = NULL;
+    if (size > 0) {
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            ERR("Cannot map %s\n", file_name);
+            ::close(fd);
+            return false;
+        }
+        data = (const char *)map;
+        madvise(map, size, MADV_SEQUENTIAL);
+    }
+    ::close(fd);
+    return true;
+}
+
+void NsReader::close()
+{
+    if (data)
+        munmap((void *)data, size);
+    data = NULL;
+    delete[] buf;
+    buf = NULL;
+}
+
+bool NsReader::next(CaptureRecord &rec)
+{
+    while (pos < size) {
+        const char *line = data + pos;
+        const char *eol = (const char *)memchr(line, '\n', size - pos);
+        size_t len = eol ? eol - line : size - pos;
+
+        pos += len + 1;
+        if (len && line[len - 1] == '\r')
+            len--;
+        if (!len)
+            continue;
+
+        if (len / 2 > buf_size) {
+            delete[] buf;
+            buf_size = len / 2;
+            buf = new u8[buf_size];
+        }
+        rec.ts_ns = 0;
+        rec.ifid = 0;
+        rec.caplen = rec.len = hex_decode(line, len, buf);
+        rec.data = buf;
+        return true;
+    }
+    return false;
+}
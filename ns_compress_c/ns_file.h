@@ -0,0 +1,38 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+#ifndef NS_COMPRESS_NS_FILE_H
+#define NS_COMPRESS_NS_FILE_H
+
+#include "types.hh"
+#include "pcap_file.h"
+
+/* Streams the packets of a .ns file (one hex string per line, no
+ * timestamps) from a read-only mapping, decoding each line into a
+ * buffer reused across packets */
+struct NsReader {
+    const char *data;
+    size_t size;
+    size_t pos;
+    u8 *buf;
+    u32 buf_size;
+
+    NsReader();
+    ~NsReader()
+    {
+        close();
+    }
+    bool open(const char *file_name);
+    void close();
+    bool next(CaptureRecord &rec);
+    u8 finest_tsresol()
+    {
+        return TSRESOL_USEC;
+    }
+};
+
+#endif //NS_COMPRESS_NS_FILE_H
@@ -14,9 +14,9 @@
 /* Local variables */
 map<u16, string> ETHERTYPE_TO_STRING;
 map<u16, string> IPPROTO_TO_STRING;
-map<Header, u16> HEADER_SIZE_BITS;
-map<Header, string> HEADER_NAMES;
-u8 HEADER_WRITE_BITS[NUM_FIELDS];
+
+/* Headers of absent layers read as zeros */
+static const u8 ABSENT_HEADER[sizeof(u32)] = { 0 };
 
 
 /* Ethernet functions */
@@ -28,19 +28,27 @@ Ethernet::Ethernet()
     vlan = 0;
     pcp = 0;
     tpid = 0;
+    ntags = 0;
 }
 
 Ethernet::Ethernet(const u8 *pkt) 
 {
     update(pkt);
     vlan = pcp = 0;
+    tpid = 0;
+    ntags = 0;
     u32 offset = sizeof(ether_header);
 
-    if (proto == ETHERTYPE_VLAN) {
-        tpid = proto;
-        vlan = ntohs(*(const u16 *) (pkt + offset));
-        pcp = (vlan & 0xf000) >> 12;
-        vlan = (vlan & 0x0fff);
+    /* 802.1Q, or 802.1ad/QinQ with the service tag first */
+    while ((proto == ETHERTYPE_VLAN || proto == ETHERTYPE_QINQ
+                || proto == ETHERTYPE_QINQ_OLD) && ntags < MAX_VLAN_TAGS) {
+        u16 t = ntohs(*(const u16 *) (pkt + offset));
+        if (ntags == 0) {
+            tpid = proto;
+            pcp = (t & 0xf000) >> 12;
+            vlan = (t & 0x0fff);
+        }
+        tci[ntags++] = t;
         offset += 2;
         proto = ntohs(*(const u16 *) (pkt + offset));
         offset += 2;
@@ -172,38 +180,6 @@ IP::pack_buf(u8* buf)
     return sizeof(ip);
 }
 
-HeaderValues 
-IP::get_headers() 
-{
-    HeaderValues ret;
-    ret[IP_HL] = hl;
-    ret[IP_TOS_F] = tos;
-    ret[IP_LEN] = len;
-    ret[IP_ID] = id;
-    ret[IP_OFF] = off;
-    ret[IP_TTL_F] = ttl;
-    ret[IP_PROTO] = proto;
-    ret[IP_CSUM] = csum;
-    ret[IP_SRC] = src;
-    ret[IP_DST] = dst;
-    return ret;
-}
-
-void 
-IP::get_headers_opt(HVArray ret) 
-{
-    ret[IP_HL] = hl;
-    ret[IP_TOS_F] = tos;
-    ret[IP_LEN] = len;
-    ret[IP_ID] = id;
-    ret[IP_OFF] = off;
-    ret[IP_TTL_F] = ttl;
-    ret[IP_PROTO] = proto;
-    ret[IP_CSUM] = csum;
-    ret[IP_SRC] = src;
-    ret[IP_DST] = dst;
-}
-
 /* ICMP functions */
 ICMP::ICMP(const u8* pkt) 
 {
@@ -267,36 +243,6 @@ TCP::pack_buf(u8* buf)
     return sizeof(tcphdr);
 }
 
-HeaderValues 
-TCP::get_headers() 
-{
-    HeaderValues ret;
-    ret[TCP_SRC] = src;
-    ret[TCP_DST] = dst;
-    ret[TCP_SEQ] = seq;
-    ret[TCP_ACK] = ack;
-    ret[TCP_OFF] = off;
-    ret[TCP_FLAGS] = flags;
-    ret[TCP_WIN] = win;
-    ret[TCP_CSUM] = csum;
-    ret[TCP_URP] = urp;
-    return ret;
-}
-
-void 
-TCP::get_headers_opt(HVArray ret) 
-{
-    ret[TCP_SRC] = src;
-    ret[TCP_DST] = dst;
-    ret[TCP_SEQ] = seq;
-    ret[TCP_ACK] = ack;
-    ret[TCP_OFF] = off;
-    ret[TCP_FLAGS] = flags;
-    ret[TCP_WIN] = win;
-    ret[TCP_CSUM] = csum;
-    ret[TCP_URP] = urp;
-}
-
 /* UDP functions */
 
 UDP::UDP(const u8 *pkt) 
@@ -334,42 +280,112 @@ UDP::pack_buf(u8* buf)
     return sizeof(udphdr);
 }
 
-HeaderValues 
-UDP::get_headers() 
-{
-    HeaderValues ret;
-    ret[UDP_SRC] = src;
-    ret[UDP_DST] = dst;
-    ret[UDP_CSUM] = csum;
-    ret[UDP_LEN] = len;
-    return ret;
-}
-
-void 
-UDP::get_headers_opt(HVArray ret) 
-{
-    ret[UDP_SRC] = src;
-    ret[UDP_DST] = dst;
-    ret[UDP_CSUM] = csum;
-    ret[UDP_LEN] = len;
+/* Layer transitions: the parser looks up the key returned by the current
+ * layer (ethertype, IP protocol, UDP port, ...) in the table of that layer.
+ * New encapsulations only need a parse_layer case and a row here. */
+struct LayerRule {
+    u32 key;
+    Layer next;
+};
+
+static const LayerRule ETH_NEXT[] = {
+    { ETHERTYPE_IP, LAYER_IP },
+    { ETHERTYPE_ARP, LAYER_ARP },
+    { ETHERTYPE_MPLS, LAYER_MPLS },
+    { ETHERTYPE_MPLS_MCAST, LAYER_MPLS },
+};
+
+static const LayerRule MPLS_NEXT[] = {
+    { 4, LAYER_IP },    /* IPv4 below the bottom of stack */
+    { 0, LAYER_ETH },   /* Ethernet pseudowire with control word */
+};
+
+static const LayerRule IP_NEXT[] = {
+    { IPPROTO_TCP, LAYER_TCP },
+    { IPPROTO_UDP, LAYER_UDP },
+    { IPPROTO_ICMP, LAYER_ICMP },
+    { IPPROTO_GRE, LAYER_GRE },
+    { IPPROTO_IPIP, LAYER_IP },
+};
+
+static const LayerRule GRE_NEXT[] = {
+    { ETHERTYPE_IP, LAYER_IP },
+    { ETHERTYPE_TEB, LAYER_ETH },
+    { ETHERTYPE_MPLS, LAYER_MPLS },
+};
+
+static const LayerRule UDP_NEXT[] = {
+    { VXLAN_PORT, LAYER_VXLAN },
+    { GTPU_PORT, LAYER_GTPU },
+};
+
+static const LayerRule VXLAN_NEXT[] = {
+    { 0, LAYER_ETH },
+};
+
+static const LayerRule GTPU_NEXT[] = {
+    { 4, LAYER_IP },
+};
+
+static const struct {
+    const LayerRule *rules;
+    u32 num_rules;
+} LAYER_NEXT[LAYER_NONE] = {
+    { ETH_NEXT, nelem(ETH_NEXT) },       /* LAYER_ETH */
+    { MPLS_NEXT, nelem(MPLS_NEXT) },     /* LAYER_MPLS */
+    { IP_NEXT, nelem(IP_NEXT) },         /* LAYER_IP */
+    { NULL, 0 },                         /* LAYER_ARP */
+    { GRE_NEXT, nelem(GRE_NEXT) },       /* LAYER_GRE */
+    { VXLAN_NEXT, nelem(VXLAN_NEXT) },   /* LAYER_VXLAN */
+    { GTPU_NEXT, nelem(GTPU_NEXT) },     /* LAYER_GTPU */
+    { NULL, 0 },                         /* LAYER_TCP */
+    { UDP_NEXT, nelem(UDP_NEXT) },       /* LAYER_UDP */
+    { NULL, 0 },                         /* LAYER_ICMP */
+};
+
+static inline Layer 
+next_layer(Layer layer, u32 key) 
+{
+    REP(i, LAYER_NEXT[layer].num_rules) {
+        if (LAYER_NEXT[layer].rules[i].key == key)
+            return LAYER_NEXT[layer].rules[i].next;
+    }
+    return LAYER_NONE;
 }
 
 /* Packet functions */
 
 Packet::Packet(const u8 *pkt, u32 sz, int skip_ethernet, u32 packet_number, int caplen, bool do_unpack)
 {
+    this->skip_ethernet = skip_ethernet;
+    load(pkt, sz, packet_number, caplen);
+
+    if(do_unpack)
+        unpack();
+}
+
+/* Makes this packet a copy of pkt without unpacking it, so that one
+ * Packet can carry every packet of a capture; buff grows as needed.
+ * Copies of the previous contents (Flow keeps some) share buff, so only
+ * their parsed fields remain valid. */
+void 
+Packet::load(const u8 *pkt, u32 sz, u32 packet_number, int caplen)
+{
+    if (unlikely((u32)caplen + PACKET_SLACK > buff_size)) {
+        delete [] buff;
+        buff_size = max((u32)caplen + PACKET_SLACK, buff_size * 2);
+        buff = new u8[buff_size];
+    }
     memcpy(buff, pkt, caplen);
+    memset(buff + caplen, 0, PACKET_SLACK);
 
     this->size = sz;
     this->caplen = caplen;
     this->payload = buff;
     this->seq = packet_number;
-    this->skip_ethernet = skip_ethernet;
     this->ts.tv_sec = 0;
-    this->ts.tv_usec = 0;
-
-    if(do_unpack)
-        unpack();
+    this->ts.tv_nsec = 0;
+    this->ifid = 0;
 }
 
 string
@@ -380,239 +396,236 @@ Packet::str_hex()
     return string(pkt_hex);
 }
 
-/* NOTE:
- * Most diffs are full replacement, but a few actually represent
- * deltas: [TCP_SEQ, TCP_ACK, IP_ID] */
+/* Rebuilds the headers of this packet, a copy of the reference packet
+ * whose headers are prev, from the field values of a DiffRecord. Bit i
+ * of written is set if field i was present in the record. With fixed,
+ * the reference is of another flow and the values are those of
+ * field_diff_fixed. */
 void 
-Packet::apply_diff(Header h, u64 v) 
+Packet::apply_diff(const u32 *prev, const u32 *values, u64 written, bool fixed) 
 {
-    switch (h) {
-        //TS_SEC
-        //PCAP_SEQ
-        case IP_HL:
-            ip.hl = v;
-            break;
-        case IP_TOS_F:
-            ip.tos = v;
-            break;
-        case IP_LEN:
-            ip.len = v;
-            break;
-        case IP_ID: // DELTA
-            ip.id += v;
-            break;
-        case IP_OFF:
-            ip.off = v;
-            break;
-        case IP_TTL_F:
-            ip.ttl = v;
-            break;
-        case IP_PROTO:
-            ip.proto = v;
-            break;
-        case IP_CSUM:
-            ip.csum = v;
-            break;
-        case IP_SRC:
-            ip.src = v;
-            break;
-        case IP_DST:
-            ip.dst = v;
-            break;
+    u32 curr[NUM_FIELDS];
 
-        case TCP_SRC:
-            tcp.src = v;
-            break;
-        case TCP_DST:
-            tcp.dst = v;
-            break;
-        case TCP_SEQ: // DELTA
-            tcp.seq += v;
-            break;
-        case TCP_ACK: // DELTA
-            tcp.ack += v;
-            break;
-        case TCP_OFF:
-            tcp.off = v;
-            break;
-        case TCP_FLAGS:
-            tcp.flags = v;
-            break;
-        case TCP_WIN:
-            tcp.win = v;
-            break;
-        case TCP_CSUM:
-            tcp.csum = v;
-            break;
-        case TCP_URP:
-            tcp.urp = v;
-            break;
-
-        case UDP_SRC:
-            udp.src = v;
-            break;
-        case UDP_DST:
-            udp.dst = v;
-            break;
-        case UDP_CSUM:
-            udp.csum = v;
-            break;
-        case UDP_LEN:
-            udp.len = v;
-            break;
+    REP(i, NUM_FIELDS) {
+        Header h = static_cast<Header>(i);
+        bool w = (written >> i) & 1;
+        curr[i] = fixed ? field_undiff_fixed(h, prev, curr, w, values[i])
+            : field_undiff(h, prev, curr, w, values[i]);
     }
 
+    set_headers(curr);
+    unpack();
 }
 
 HeaderValues 
 Packet::get_headers() 
 {
-    u64 tstamp = ts.tv_sec;
+    u32 hv[NUM_FIELDS];
     HeaderValues ret;
-    //ret[TS_SEC] = tstamp;
-    //ret[PCAP_SEQ] = seq;
-
-    switch (eth.proto) {
-        case ETHERTYPE_IP:
-            HeaderValues retip = ip.get_headers();
-            HeaderValues retp;
 
-            switch (ip.proto) {
-                case IPPROTO_TCP:
-                    retp = tcp.get_headers();
-                    break;
-
-                case IPPROTO_UDP:
-                    retp = udp.get_headers();
-                    break;
-            }
-
-            update_headers(retip, retp);
-            update_headers(ret, retip);
-            break;
+    get_headers_opt(hv);
+    REP(i, NUM_FIELDS) {
+        if (hv[i] != ~0u)
+            ret[static_cast<Header>(i)] = hv[i];
     }
-
     return ret;
 }
 
-void
-Packet::unpack()
+/* Extracts every field of FIELDS, ~0 for fields of absent headers. The
+ * loop has no data-dependent branches. */
+void 
+Packet::get_headers_opt(HVArray ret) 
 {
-    if (likely(!skip_ethernet)) {
-        eth = Ethernet(buff); // now (buff) was: pkt
-    } 
-    else {
-        eth.proto = ETHERTYPE_IP;
-        eth.payload = payload;
-    }
-
-    switch (eth.proto) {
-        case ETHERTYPE_IP:
-            parse_ip(eth.payload);
-            break;
-
-        case ETHERTYPE_ARP:
-            parse_arp(eth.payload);
-            break;
+    REP(i, NUM_FIELDS) {
+        const FieldDesc &f = FIELDS[i];
+        u16 off = field_base[f.base];
+        bool present = off != NO_OFFSET;
+        const u8 *p = present ? buff + off + f.offset : ABSENT_HEADER;
+        u32 v = (load_word(p, f.order) >> f.shift) & f.mask;
+        ret[i] = present ? v : ~0u;
     }
 }
 
-// Writes from an STL vector into the provided buffer.
-// returns number of bytes written to buf
-uint 
-Packet::pack(u8* buf) 
-{
-    vector<u8> p = pack_eth();
-    int i;
-    for (i = 0; i < p.size(); i++) {
-        buf[i] = p[i];
+/* Writes fields back into the packet bytes; ~0 leaves a field alone */
+void 
+Packet::set_headers(const u32 *hv) 
+{
+    REP(i, NUM_FIELDS) {
+        const FieldDesc &f = FIELDS[i];
+        u16 off = field_base[f.base];
+        if (off == NO_OFFSET || hv[i] == ~0u)
+            continue;
+
+        u8 *p = buff + off + f.offset;
+        u32 w = load_word(p, f.order);
+        w &= ~(f.mask << f.shift);
+        w |= (hv[i] & f.mask) << f.shift;
+        store_word(p, w, f.order);
     }
-    return p.size();
 }
 
-vector<u8> 
-Packet::pack_eth() 
+/* Walks the (possibly stacked) encapsulations down to the innermost
+ * network and transport headers. eth, ip, tcp and udp always describe
+ * the innermost headers, so that flows are keyed on the inner 5-tuple;
+ * eth.proto is the ethertype of the innermost network header. */
+void
+Packet::unpack()
 {
-    vector<u8> rest;
-    switch (eth.proto) {
-        case ETHERTYPE_IP:
-            rest = pack_ip();
-            break;
-
-        case ETHERTYPE_ARP:
-            rest = pack_arp();
-            break;
-    }
-    vector<u8> eth_packed = eth.pack();
-    eth_packed.insert(eth_packed.end(), rest.begin(), rest.end());
-    return eth_packed;
-}
+    Layer layer = LAYER_ETH;
+    u32 off = 0;
+    u32 end = caplen > 0 ? caplen : buff_size;
 
-u8 
-Packet::pack_eth_buf(u8* buf) 
-{
-    u8 rest;
-    switch (eth.proto) {
-        case ETHERTYPE_IP:
-            rest = pack_ip_buf(buf + sizeof(ether_header));
-            break;
+    REP(i, NUM_BASES) field_base[i] = NO_OFFSET;
+    tunnel = LAYER_NONE;
+    l3_off = l4_off = NO_OFFSET;
 
-        case ETHERTYPE_ARP:
-            rest = pack_arp_buf(buf + sizeof(ether_header));
-            break;
+    if (unlikely(skip_ethernet)) {
+        eth.proto = ETHERTYPE_IP;
+        eth.payload = payload;
+        layer = LAYER_IP;
     }
-    return this->eth.pack_buf(buf) + rest;
-}
-
-vector<u8> 
-Packet::pack_ip() 
-{
-    vector<u8> rest;
-    switch (ip.proto) {
-        case IPPROTO_TCP:
-            rest = pack_tcp();
-            break;
 
-        case IPPROTO_UDP:
-            rest = pack_udp();
+    REP(depth, MAX_ENCAP_DEPTH) {
+        u32 key = 0;
+        if (layer == LAYER_NONE || off >= end)
             break;
+        off += parse_layer(layer, off, key);
+        layer = next_layer(layer, key);
     }
-    vector<u8> ip_packed = ip.pack();
-    ip_packed.insert(ip_packed.end(), rest.begin(), rest.end());
-    return ip_packed;
-}
 
-u8 
-Packet::pack_ip_buf(u8* buf) 
-{
-    u8 rest;
-    switch (ip.proto) {
-        case IPPROTO_TCP:
-            rest = pack_tcp_buf(buf + sizeof(struct ip));
-            break;
-
-        case IPPROTO_UDP:
-            rest = pack_udp_buf(buf + sizeof(struct ip));
-            break;
-    }
-    return this->ip.pack_buf(buf) + rest;
+    hdr_len = min(off, end);
+    /* Unknown network protocol: everything parsed so far is the prefix */
+    if (l3_off == NO_OFFSET)
+        l3_off = hdr_len;
 }
 
-void 
-Packet::get_headers_opt(HVArray ret) 
-{
-    if (unlikely(eth.proto != ETHERTYPE_IP))
-        return;
-
-    ip.get_headers_opt(ret);
-    switch (ip.proto) {
-        case IPPROTO_TCP:
-            tcp.get_headers_opt(ret);
-            break;
-
-        case IPPROTO_UDP:
-            udp.get_headers_opt(ret);
-            break;
+/* Parses the header of layer at buff + off. Returns the header length
+ * and sets key to the value selecting the next layer in LAYER_NEXT. */
+u32 
+Packet::parse_layer(Layer layer, u32 off, u32 &key) 
+{
+    const u8 *pkt = buff + off;
+    u32 len = 0;
+
+    switch (layer) {
+        case LAYER_ETH:
+            eth = Ethernet(pkt);
+            /* Only the tags of the outermost frame are diff-encoded */
+            if (off == 0) {
+                REP(i, eth.ntags) {
+                    field_base[BASE_VLAN + i] = sizeof(ether_header) + 4 * i;
+                }
+            }
+            key = eth.proto;
+            return eth.payload - pkt;
+
+        case LAYER_MPLS: {
+            u32 lse;
+            field_base[BASE_MPLS] = off;
+            /* Walk the label stack down to the bottom-of-stack bit */
+            do {
+                lse = ntohl(*(const u32 *) (pkt + len));
+                len += 4;
+            } while (!(lse & 0x100) && off + len < parse_limit());
+            key = pkt[len] >> 4;
+            if (key == 0)
+                len += 4; /* pseudowire control word */
+            return len;
+        }
+
+        case LAYER_IP:
+            /* IP below IP: what we parsed so far was a tunnel */
+            if (field_base[BASE_IP] != NO_OFFSET) {
+                field_base[BASE_OUTER_IP] = field_base[BASE_IP];
+                if (tunnel == LAYER_NONE)
+                    tunnel = LAYER_IP;
+            }
+            ip = IP(pkt);
+            l3_off = off;
+            field_base[BASE_IP] = off;
+            eth.proto = ETHERTYPE_IP;
+            key = ip.proto;
+            return max(ip.hl * 4, (int)sizeof(struct ip));
+
+        case LAYER_ARP:
+            parse_arp(pkt);
+            l3_off = off;
+            eth.proto = ETHERTYPE_ARP;
+            return sizeof(struct arp_eth_header);
+
+        case LAYER_GRE: {
+            u16 flags = ntohs(*(const u16 *) pkt);
+            len = 4;
+            if (flags & 0x8000) /* checksum present */
+                len += 4;
+            if (flags & 0x2000) { /* key present */
+                field_base[BASE_TUNNEL_ID] = off + len;
+                len += 4;
+            }
+            if (flags & 0x1000) /* sequence number present */
+                len += 4;
+            tunnel = LAYER_GRE;
+            key = ntohs(*(const u16 *) (pkt + 2));
+            return len;
+        }
+
+        case LAYER_VXLAN:
+            field_base[BASE_OUTER_UDP] = field_base[BASE_UDP];
+            field_base[BASE_UDP] = NO_OFFSET;
+            /* 32 bits ending with the 24-bit VNI */
+            field_base[BASE_TUNNEL_ID] = off + 3;
+            tunnel = LAYER_VXLAN;
+            key = 0;
+            return 8;
+
+        case LAYER_GTPU: {
+            u8 flags = pkt[0];
+            field_base[BASE_OUTER_UDP] = field_base[BASE_UDP];
+            field_base[BASE_UDP] = NO_OFFSET;
+            field_base[BASE_TUNNEL_ID] = off + 4;
+            field_base[BASE_GTPU] = off;
+            tunnel = LAYER_GTPU;
+            len = 8;
+            if (flags & 0x07) {
+                /* sequence number, N-PDU and extension header chain;
+                 * parsing stops at an extension that doesn't fit */
+                u8 next_ext = pkt[11];
+                len += 4;
+                while (next_ext) {
+                    u32 ext = off + len < parse_limit() ? pkt[len] * 4 : 0;
+                    if (!ext || off + len + ext > parse_limit()) {
+                        key = ~0;
+                        return len;
+                    }
+                    len += ext;
+                    next_ext = pkt[len - 1];
+                }
+            }
+            /* Only G-PDUs carry user traffic */
+            key = pkt[1] == 0xff && off + len < parse_limit() ? pkt[len] >> 4 : ~0;
+            return len;
+        }
+
+        case LAYER_TCP:
+            parse_tcp(pkt);
+            l4_off = off;
+            field_base[BASE_TCP] = off;
+            return max(tcp.off * 4, (int)sizeof(struct tcphdr));
+
+        case LAYER_UDP:
+            parse_udp(pkt);
+            l4_off = off;
+            field_base[BASE_UDP] = off;
+            key = udp.dst;
+            return sizeof(struct udphdr);
+
+        case LAYER_ICMP:
+            parse_icmp(pkt);
+            l4_off = off;
+            return sizeof(struct icmphdr);
+
+        default:
+            return 0;
     }
 }
 
@@ -643,6 +656,7 @@ Packet::nw_proto()
         case ETHERTYPE_IP:
             return ip.proto;
     }
+    return 0;
 }
 
 u32 
@@ -655,6 +669,7 @@ Packet::nw_src()
         case ETHERTYPE_IP:
             return ip.src;
     }
+    return 0;
 }
 
 u32 
@@ -667,6 +682,7 @@ Packet::nw_dst()
         case ETHERTYPE_IP:
             return ip.dst;
     }
+    return 0;
 }
 
 u16 
@@ -682,6 +698,7 @@ Packet::tp_src()
         case IPPROTO_ICMP:
             return icmp.type;
     }
+    return 0;
 }
 
 u16 
@@ -697,39 +714,23 @@ Packet::tp_dst()
         case IPPROTO_ICMP:
             return icmp.code;
     }
+    return 0;
 }
 
+/* The length on the wire: up to the end of the innermost IPv4 packet,
+ * or just the headers of frames without one (ARP, IPv6, ...) */
 u16 
 Packet::infer_len() 
 {
-    int inferred_len = 0;
-    if (!skip_ethernet) {
-        assert (eth.proto == ETHERTYPE_IP);
-        inferred_len += 14;
-    }
-    inferred_len += ip.len;
-    return inferred_len;
+    if (field_base[BASE_IP] == NO_OFFSET)
+        return hdr_len;
+    return l3_off + ip.len;
 }
 
 u16 
 Packet::hdr_size() 
 {
-    int size = 0;
-    if (likely(!skip_ethernet)) {
-        size += sizeof(ether_header);
-    }
-
-    size += sizeof(iphdr);
-    switch (ip.proto) {
-        case IPPROTO_TCP:
-            size += sizeof(struct tcphdr);
-            break;
-
-        case IPPROTO_UDP:
-            size += sizeof(struct udphdr);
-            break;
-    }
-    return size;
+    return hdr_len;
 }
 
 JSON
@@ -740,7 +741,7 @@ Packet::json()
 
     JSON ts_j;
     ts_j["tv_sec"] = V((u64)ts.tv_sec);
-    ts_j["tv_usec"] = V((u64)ts.tv_usec);
+    ts_j["tv_nsec"] = V((u64)ts.tv_nsec);
 
     JSON j;
     j["buff"] = V(hex);
@@ -758,102 +759,17 @@ packet_init()
     a[ETHERTYPE_ARP] = "ARP";
     a[ETHERTYPE_VLAN] = "VLAN";
     a[ETHERTYPE_IPV6] = "IPv6";
+    a[ETHERTYPE_QINQ] = "QinQ";
+    a[ETHERTYPE_MPLS] = "MPLS";
+    a[ETHERTYPE_MPLS_MCAST] = "MPLS-MC";
 #undef a
 
 #define a IPPROTO_TO_STRING
     a[IPPROTO_TCP] = "TCP";
     a[IPPROTO_UDP] = "UDP";
     a[IPPROTO_ICMP] = "ICMP";
-#undef a
-
-#define a HEADER_SIZE_BITS
-    a[TS_SEC] = 64;
-    a[PCAP_SEQ] = 64;
-    a[IP_HL] = 8; // 4??
-    a[IP_TOS_F] = 8;
-    a[IP_LEN] = 16;
-    a[IP_ID] = 16;
-    a[IP_OFF] = 16;
-    a[IP_TTL_F] = 8;
-    a[IP_PROTO] = 8;
-    a[IP_CSUM] = 16;
-    a[IP_SRC] = 32;
-    a[IP_DST] = 32;
-
-    a[TCP_SRC] = 16;
-    a[TCP_DST] = 16;
-    a[TCP_SEQ] = 32;
-    a[TCP_ACK] = 32;
-    a[TCP_OFF] = 8; // 4??
-    a[TCP_FLAGS] = 8; // 6??
-    a[TCP_WIN] = 16;
-    a[TCP_CSUM] = 16;
-    a[TCP_URP] = 16;
-
-    a[UDP_SRC] = 16;
-    a[UDP_DST] = 16;
-    a[UDP_CSUM] = 16;
-    a[UDP_LEN] = 16;
-#undef a
-
-#define a HEADER_WRITE_BITS
-    //a[TS_SEC] = 64;
-    //a[PCAP_SEQ] = 64;
-    a[IP_HL] = 8; // 4??
-    a[IP_TOS_F] = 8;
-    a[IP_LEN] = 16;
-    a[IP_ID] = 16;
-    a[IP_OFF] = 16;
-    a[IP_TTL_F] = 8;
-    a[IP_PROTO] = 8;
-    a[IP_CSUM] = 16;
-    a[IP_SRC] = 32;
-    a[IP_DST] = 32;
-
-    a[TCP_SRC] = 16;
-    a[TCP_DST] = 16;
-    a[TCP_SEQ] = 32;
-    a[TCP_ACK] = 32;
-    a[TCP_OFF] = 8; // 4??
-    a[TCP_FLAGS] = 8; // 6??
-    a[TCP_WIN] = 16;
-    a[TCP_CSUM] = 16;
-    a[TCP_URP] = 16;
-
-    a[UDP_SRC] = 16;
-    a[UDP_DST] = 16;
-    a[UDP_CSUM] = 16;
-    a[UDP_LEN] = 16;
-#undef a
-
-#define a HEADER_NAMES
-    a[TS_SEC] = "TS_SEC";
-    a[PCAP_SEQ] = "PCAP_SEQ";
-    a[IP_HL] = "IP_HL";
-    a[IP_TOS_F] = "IP_TOS";
-    a[IP_LEN] = "IP_LEN";
-    a[IP_ID] = "IP_ID";
-    a[IP_OFF] = "IP_OFF";
-    a[IP_TTL_F] = "IP_TTL";
-    a[IP_PROTO] = "IP_PROTO";
-    a[IP_CSUM] = "IP_CSUM";
-    a[IP_SRC] = "IP_SRC";
-    a[IP_DST] = "IP_DST";
-
-    a[TCP_SRC] = "TCP_SRC";
-    a[TCP_DST] = "TCP_DST";
-    a[TCP_SEQ] = "TCP_SEQ";
-    a[TCP_ACK] = "TCP_ACK";
-    a[TCP_OFF] = "TCP_OFF";
-    a[TCP_FLAGS] = "TCP_FLAGS";
-    a[TCP_WIN] = "TCP_WIN";
-    a[TCP_CSUM] = "TCP_CSUM";
-    a[TCP_URP] = "TCP_URP";
-
-    a[UDP_SRC] = "UDP_SRC";
-    a[UDP_DST] = "UDP_DST";
-    a[UDP_CSUM] = "UDP_CSUM";
-    a[UDP_LEN] = "UDP_LEN";
+    a[IPPROTO_GRE] = "GRE";
+    a[IPPROTO_IPIP] = "IPIP";
 #undef a
 }
 
@@ -870,7 +786,7 @@ print_headers(HeaderValues &a)
 {
     EACH(it, a) {
         printf("%s: %llu (0x%llx)\n",
-                HEADER_NAMES[it->first].c_str(),
+                FIELDS[it->first].name,
                 it->second, it->second);
     }
 }
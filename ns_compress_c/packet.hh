@@ -29,12 +29,32 @@
 #include <netinet/ip_icmp.h>
 
 #include "types.hh"
-
-extern ulong MAX_PKT_SIZE;
-extern ulong PACKET_BUFF_SIZE;
+#include "fields.hh"
+
+/* Sized by the thread that loads packets, as each of the concurrent
+ * runs of ns_compress bench reads captures of its own */
+extern thread_local ulong MAX_PKT_SIZE;
+extern thread_local ulong PACKET_BUFF_SIZE;
+/* Zeroed bytes load() puts past the captured ones, so that a header cut
+ * short by the snaplen is still parsed within the buffer, the same way
+ * every time */
+#define PACKET_SLACK 64
 #define MORE_FRAGMENTS 0x2000
 #define FRAG_OFF_MASK 0x1fff
 
+/* Encapsulations walked by Packet::unpack */
+#define ETHERTYPE_QINQ 0x88a8
+#define ETHERTYPE_QINQ_OLD 0x9100
+#define ETHERTYPE_MPLS 0x8847
+#define ETHERTYPE_MPLS_MCAST 0x8848
+#define ETHERTYPE_TEB 0x6558 /* transparent Ethernet bridging over GRE */
+#define VXLAN_PORT 4789
+#define GTPU_PORT 2152
+
+#define MAX_VLAN_TAGS 2
+#define MAX_ENCAP_DEPTH 12
+#define NO_OFFSET 0xffff
+
 using namespace std;
 
 struct arp_eth_header {
@@ -51,43 +71,25 @@ struct arp_eth_header {
     u32 tip;
 } __attribute__((packed));
 
-enum Header {
-    TS_SEC,
-    PCAP_SEQ,
-    IP_PROTO,
-    IP_SRC,
-    IP_DST,
-
-    TCP_SRC,
-    TCP_DST,
-    UDP_SRC,
-    UDP_DST,
-
-    IP_HL,
-
-    IP_TOS_F,
-    IP_LEN,
-    IP_ID,
-    IP_OFF,
-    IP_TTL_F,
-    IP_CSUM,
-    TCP_SEQ,
-    TCP_ACK,
-    TCP_OFF,
-    TCP_FLAGS,
-    TCP_WIN,
-    TCP_CSUM,
-    TCP_URP,
-
-    UDP_CSUM,
-    UDP_LEN,
+typedef map<Header, u64> HeaderValues;
 
-    /* This should always be at the end */
-    NUM_FIELDS,
+/* Protocol layers known to the parser. Transitions between them are
+ * described by the LAYER_NEXT table in packet.cc. */
+enum Layer {
+    LAYER_ETH,
+    LAYER_MPLS,
+    LAYER_IP,
+    LAYER_ARP,
+    LAYER_GRE,
+    LAYER_VXLAN,
+    LAYER_GTPU,
+    LAYER_TCP,
+    LAYER_UDP,
+    LAYER_ICMP,
+
+    LAYER_NONE,
 };
 
-typedef map<Header, u64> HeaderValues;
-
 struct Ethernet {
     u8 *dst;
     u8 *src;
@@ -95,6 +97,8 @@ struct Ethernet {
     u8 pcp;
     u16 tpid;
     u16 proto;
+    u8 ntags;                     /* stacked 802.1Q/802.1ad tags */
+    u16 tci[MAX_VLAN_TAGS];
     const u8 *payload;
 
     Ethernet();
@@ -129,8 +133,6 @@ struct IP {
     {
         return off & htons(MORE_FRAGMENTS | FRAG_OFF_MASK);
     }
-    HeaderValues get_headers();
-    void get_headers_opt(HVArray ret);
 };
 
 struct ICMP {
@@ -153,8 +155,6 @@ struct TCP {
     TCP(const u8 *pkt);
     vector<u8> pack();
     u8 pack_buf(u8* buf);
-    HeaderValues get_headers();
-    void get_headers_opt(HVArray ret);
 };
 
 struct UDP {
@@ -165,20 +165,25 @@ struct UDP {
     UDP(const u8 *pkt);
     vector<u8> pack();
     u8 pack_buf(u8* buf);
-    HeaderValues get_headers();
-    void get_headers_opt(HVArray ret);
 };
 
 struct Packet {
     const u8 *payload;
+    u32 buff_size = PACKET_BUFF_SIZE;
     u8* buff = new u8[PACKET_BUFF_SIZE];
-    struct timeval ts;
+    struct timespec ts;
+    u32 ifid;          /* capture interface */
     Ethernet eth;
     ARP arp;
     IP ip;
     TCP tcp;
     UDP udp;
     ICMP icmp;
+    u16 field_base[NUM_BASES]; /* header offsets used by FIELDS */
+    u8 tunnel;         /* Layer of the innermost tunnel header */
+    u16 l3_off;        /* offset of the innermost network header */
+    u16 l4_off;        /* offset of the innermost transport header */
+    u16 hdr_len;       /* bytes of headers parsed */
     u32 size;
     int seq;
     int caplen;
@@ -187,57 +192,45 @@ struct Packet {
     Packet() 
     {
         payload = buff;
+        skip_ethernet = 0;
     }
     Packet(const u8 *pkt, u32 sz, int skip_ethernet = 0, u32 packet_number = 0, int caplen = 0, bool do_unpack=true);
 //    ~Packet() {
 //        delete [] buff;
 //    }
 
+    void load(const u8 *pkt, u32 sz, u32 packet_number, int caplen);
     void unpack();
     string str_hex();
-    void apply_diff(Header h, u64 v);
+    void apply_diff(const u32 *prev, const u32 *values, u64 written, bool fixed = false);
     HeaderValues get_headers();
-    uint pack(u8* buf);
-    uint pack_buf(u8* buf) 
-    {
-        return pack_eth_buf(buf);
-    }
-    vector<u8> pack_eth();
-    u8 pack_eth_buf(u8* buf);
-    vector<u8> pack_ip();
-    u8 pack_ip_buf(u8* buf);
-    void unimplemented(const char* s) 
-    {
-        printf("Exiting; %s unimplemented", s);
-        exit(EXIT_FAILURE);
-    }
-    vector<u8> pack_arp() 
+    void set_headers(const u32 *hv);
+    uint pack(u8* buf) 
     {
-        vector<u8> packed;
-        unimplemented("arp");
-        return packed;
+        return pack_buf(buf);
     }
-    u8 pack_arp_buf(u8* buf) 
-    {
-        unimplemented("arp");
-    }
-    vector<u8> pack_udp() 
-    {
-        return udp.pack();
-    }
-    u8 pack_udp_buf(u8* buf) 
+    uint pack_buf(u8* buf) 
     {
-        return udp.pack_buf(buf);
+        memcpy(buf, buff, hdr_len);
+        return hdr_len;
     }
-    vector<u8> pack_tcp() 
+    void get_headers_opt(HVArray ret);
+    u32 parse_layer(Layer layer, u32 off, u32 &key);
+    /* Bound of the label and extension header walks: the captured bytes
+     * and 4 more, within PACKET_SLACK. Per packet, so that packets
+     * can be parsed off the thread that sizes PACKET_BUFF_SIZE. */
+    u32 parse_limit() const
     {
-        return tcp.pack();
+        return caplen > 0 ? caplen + 4 : buff_size;
     }
-    u8 pack_tcp_buf(u8* buf) 
+    /* Whether the headers FIELDS cover are at the same offsets as in
+     * other, so that fields diffed between the two land on the same
+     * bytes. Not so for a 5-tuple seen bare, then tagged or tunneled. */
+    bool same_layout(const Packet &other) const
     {
-        return tcp.pack_buf(buf);
+        return tunnel == other.tunnel
+            && memcmp(field_base, other.field_base, sizeof(field_base)) == 0;
     }
-    void get_headers_opt(HVArray ret);
     void parse_arp(const u8 *pkt) 
     {
         arp = ARP(pkt);
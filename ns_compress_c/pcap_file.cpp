@@ -0,0 +1,511 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+#include <algorithm>
+#include <cstring>
+#include "pcap_file.h"
+
+struct pcap_file_header_raw {
+    u32 magic;
+    u16 version_major;
+    u16 version_minor;
+    int thiszone;
+    u32 sigfigs;
+    u32 snaplen;
+    u32 linktype;
+} __attribute__((packed));
+
+struct pcap_record_header_raw {
+    u32 ts_sec;
+    u32 ts_frac;
+    u32 caplen;
+    u32 len;
+} __attribute__((packed));
+
+static u64 pow10_u64(int n)
+{
+    u64 ret = 1;
+    while (n-- > 0)
+        ret *= 10;
+    return ret;
+}
+
+u64 ticks_to_ns(u64 ticks, u8 tsresol)
+{
+    int n = tsresol & ~TSRESOL_BINARY;
+
+    if (tsresol & TSRESOL_BINARY)
+        return (u64)(((unsigned __int128)ticks * NSEC_PER_SEC) >> n);
+    if (n <= 9)
+        return ticks * pow10_u64(9 - n);
+    return ticks / pow10_u64(n - 9);
+}
+
+u64 ns_to_ticks(u64 ns, u8 tsresol)
+{
+    int n = tsresol & ~TSRESOL_BINARY;
+
+    if (tsresol & TSRESOL_BINARY)
+        return (u64)(((unsigned __int128)ns << n) / NSEC_PER_SEC);
+    if (n <= 9)
+        return ns / pow10_u64(9 - n);
+    return ns * pow10_u64(n - 9);
+}
+
+int capture_format(const u8 *magic)
+{
+    u32 m;
+    memcpy(&m, magic, sizeof(m));
+
+    if (m == PCAPNG_BLOCK_SHB)
+        return FORMAT_PCAPNG;
+    if (m == PCAP_MAGIC_USEC || m == PCAP_MAGIC_NSEC
+            || m == __builtin_bswap32(PCAP_MAGIC_USEC)
+            || m == __builtin_bswap32(PCAP_MAGIC_NSEC))
+        return FORMAT_PCAP;
+    return FORMAT_UNKNOWN;
+}
+
+/* CaptureReader functions */
+
+CaptureReader::CaptureReader()
+{
+    fp = NULL;
+    format = FORMAT_UNKNOWN;
+    swapped = false;
+    section_ifid = 0;
+    buf_size = CAPTURE_SNAPLEN;
+    buf = new u8[buf_size];
+}
+
+bool CaptureReader::open(const char *file_name)
+{
+    FILE *f = strcmp(file_name, "-") == 0 ? stdin : fopen(file_name, "rb");
+    if (!f) {
+        ERR("Cannot open capture %s\n", file_name);
+        return false;
+    }
+    return open(f);
+}
+
+bool CaptureReader::open(FILE *f)
+{
+    u8 magic[4];
+
+    fp = f;
+    ifaces.clear();
+    section_ifid = 0;
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic))
+        return false;
+    format = capture_format(magic);
+
+    if (format == FORMAT_PCAP) {
+        pcap_file_header_raw fh;
+        CaptureInterface iface;
+        memcpy(&fh.magic, magic, sizeof(magic));
+        if (fread((u8 *)&fh + 4, 1, sizeof(fh) - 4, fp) != sizeof(fh) - 4)
+            return false;
+        swapped = fh.magic == __builtin_bswap32(PCAP_MAGIC_USEC)
+                || fh.magic == __builtin_bswap32(PCAP_MAGIC_NSEC);
+        iface.linktype = swap32(fh.linktype);
+        iface.snaplen = swap32(fh.snaplen);
+        iface.tsresol = swap32(fh.magic) == PCAP_MAGIC_NSEC ? TSRESOL_NSEC : TSRESOL_USEC;
+        iface.tsoffset = 0;
+        if (iface.linktype != LINKTYPE_ETHERNET) {
+            ERR("Link type %u is not supported, only Ethernet\n", iface.linktype);
+            return false;
+        }
+        ifaces.push_back(iface);
+        return true;
+    }
+
+    if (format == FORMAT_PCAPNG) {
+        u32 len;
+        if (fread(&len, 1, sizeof(len), fp) != sizeof(len))
+            return false;
+        return read_section_header(len);
+    }
+
+    ERR("Unknown capture format\n");
+    return false;
+}
+
+void CaptureReader::close()
+{
+    if (fp && fp != stdin)
+        fclose(fp);
+    fp = NULL;
+    delete[] buf;
+    buf = NULL;
+}
+
+/* Finest timestamp resolution among the interfaces seen so far, as a
+ * decimal exponent no finer than nanoseconds */
+u8 CaptureReader::finest_tsresol()
+{
+    u8 ret = 0;
+    EACH(it, ifaces) {
+        u8 r = it->tsresol;
+        if (r & TSRESOL_BINARY || r > TSRESOL_NSEC)
+            r = TSRESOL_NSEC;
+        ret = max(ret, r);
+    }
+    return ret ? ret : TSRESOL_USEC;
+}
+
+bool CaptureReader::next(CaptureRecord &rec)
+{
+    if (!fp)
+        return false;
+    if (format == FORMAT_PCAP)
+        return next_pcap(rec);
+    return next_pcapng(rec);
+}
+
+bool CaptureReader::next_pcap(CaptureRecord &rec)
+{
+    pcap_record_header_raw rh;
+    CaptureInterface &iface = ifaces[0];
+
+    if (fread(&rh, 1, sizeof(rh), fp) != sizeof(rh))
+        return false;
+
+    rec.caplen = swap32(rh.caplen);
+    rec.len = swap32(rh.len);
+    rec.ifid = 0;
+    rec.ts_ns = swap32(rh.ts_sec) * NSEC_PER_SEC
+            + ticks_to_ns(swap32(rh.ts_frac), iface.tsresol);
+    rec.data = buf;
+
+    if (rec.caplen > buf_size) {
+        ERR("Capture record of %u bytes is larger than %u\n", rec.caplen, buf_size);
+        return false;
+    }
+    return fread(buf, 1, rec.caplen, fp) == rec.caplen;
+}
+
+/* Grows buf to size bytes, up to PCAPNG_MAX_BLOCK: a block may carry a
+ * packet of CAPTURE_SNAPLEN bytes along with its fields and options */
+bool CaptureReader::reserve(u32 size)
+{
+    if (size <= buf_size)
+        return true;
+    if (size > PCAPNG_MAX_BLOCK)
+        return false;
+    delete[] buf;
+    buf_size = min(max(size, 2 * buf_size), (u32) PCAPNG_MAX_BLOCK);
+    buf = new u8[buf_size];
+    return true;
+}
+
+/* Reads the type and length of the next block and its body into buf;
+ * len is the body length, without the block header and trailer */
+bool CaptureReader::read_block(u32 &type, u32 &len)
+{
+    u32 hdr[2];
+
+    if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr))
+        return false;
+
+    type = swap32(hdr[0]);
+    if (type == PCAPNG_BLOCK_SHB) {
+        /* The byte order of a new section is only known from its body */
+        return read_section_header(hdr[1]) && read_block(type, len);
+    }
+
+    len = swap32(hdr[1]);
+    if (len < 12 || !reserve(len - 8)) {
+        ERR("Bad pcapng block length %u\n", len);
+        return false;
+    }
+    len -= 12;
+    return fread(buf, 1, len + 4, fp) == len + 4;
+}
+
+bool CaptureReader::read_section_header(u32 len)
+{
+    u32 bom;
+
+    if (fread(&bom, 1, sizeof(bom), fp) != sizeof(bom))
+        return false;
+    if (bom == PCAPNG_BYTE_ORDER_MAGIC)
+        swapped = false;
+    else if (bom == __builtin_bswap32(PCAPNG_BYTE_ORDER_MAGIC))
+        swapped = true;
+    else {
+        ERR("Bad pcapng byte order magic\n");
+        return false;
+    }
+
+    /* Interface ids are local to a section; those of the next one are
+     * numbered after the interfaces seen so far */
+    section_ifid = ifaces.size();
+    len = swap32(len);
+    if (len < 16 || !reserve(len - 12))
+        return false;
+    return fread(buf, 1, len - 16 + 4, fp) == len - 16 + 4;
+}
+
+void CaptureReader::read_interface(u32 len)
+{
+    CaptureInterface iface;
+    u32 off = 8;
+
+    iface.linktype = swap16(*(u16 *)buf);
+    iface.snaplen = swap32(*(u32 *)(buf + 4));
+    iface.tsresol = TSRESOL_USEC;
+    iface.tsoffset = 0;
+
+    while (off + 4 <= len) {
+        u16 code = swap16(*(u16 *)(buf + off));
+        u16 olen = swap16(*(u16 *)(buf + off + 2));
+        off += 4;
+        if (code == PCAPNG_OPT_END || off + olen > len)
+            break;
+        if (code == PCAPNG_OPT_IF_TSRESOL && olen == 1)
+            iface.tsresol = buf[off];
+        if (code == PCAPNG_OPT_IF_TSOFFSET && olen == 8) {
+            u64 v;
+            memcpy(&v, buf + off, sizeof(v));
+            iface.tsoffset = swapped ? __builtin_bswap64(v) : v;
+        }
+        off += (olen + 3) & ~3;
+    }
+    if (iface.linktype != LINKTYPE_ETHERNET)
+        ERR("Skipping the packets of interface %u, of link type %u\n",
+                (u32) ifaces.size() - section_ifid, iface.linktype);
+    ifaces.push_back(iface);
+}
+
+bool CaptureReader::next_pcapng(CaptureRecord &rec)
+{
+    u32 type, len;
+
+    while (read_block(type, len)) {
+        switch (type) {
+            case PCAPNG_BLOCK_IDB:
+                if (len < 8)
+                    goto bad_block;
+                read_interface(len);
+                break;
+
+            case PCAPNG_BLOCK_EPB:
+            case PCAPNG_BLOCK_OPB: {
+                u32 *w = (u32 *)buf;
+                u64 ticks;
+
+                /* interface, timestamp, caplen and len */
+                if (len < 20)
+                    goto bad_block;
+                if (type == PCAPNG_BLOCK_EPB)
+                    rec.ifid = swap32(w[0]);
+                else
+                    rec.ifid = swap16(*(u16 *)buf);
+                if (rec.ifid >= ifaces.size() - section_ifid) {
+                    ERR("Packet on undeclared interface %u\n", rec.ifid);
+                    return false;
+                }
+                rec.ifid += section_ifid;
+                if (ifaces[rec.ifid].linktype != LINKTYPE_ETHERNET)
+                    break;
+
+                ticks = (u64)swap32(w[1]) << 32 | swap32(w[2]);
+                rec.ts_ns = ticks_to_ns(ticks, ifaces[rec.ifid].tsresol)
+                        + ifaces[rec.ifid].tsoffset * NSEC_PER_SEC;
+                rec.caplen = min(swap32(w[3]), len - 20);
+                rec.len = swap32(w[4]);
+                rec.data = buf + 20;
+                return true;
+            }
+
+            case PCAPNG_BLOCK_SPB:
+                if (len < 4)
+                    goto bad_block;
+                if (ifaces.size() == section_ifid)
+                    return false;
+                rec.ifid = section_ifid;
+                if (ifaces[rec.ifid].linktype != LINKTYPE_ETHERNET)
+                    break;
+                rec.ts_ns = 0;
+                rec.len = swap32(*(u32 *)buf);
+                rec.caplen = min(min(rec.len, len - 4), ifaces[rec.ifid].snaplen);
+                rec.data = buf + 4;
+                return true;
+
+            default:
+                /* name resolution, statistics, custom blocks, ... */
+                break;
+        }
+    }
+    return false;
+
+bad_block:
+    ERR("Bad pcapng block of type %u, length %u\n", type, len + 12);
+    return false;
+}
+
+/* CaptureMerger functions */
+
+bool CaptureMerger::open(const vector<const char *> &file_names)
+{
+    close();
+    REP(i, (int)file_names.size()) {
+        readers.push_back(new CaptureReader());
+        heads.push_back(CaptureRecord());
+        ifids.push_back(vector<u32>());
+        if (!readers[i]->open(file_names[i]))
+            return false;
+    }
+    REP(i, (int)readers.size()) advance(i);
+    return true;
+}
+
+void CaptureMerger::close()
+{
+    EACH(it, readers) delete *it;
+    readers.clear();
+    heads.clear();
+    ifids.clear();
+    heap.clear();
+    last = -1;
+    num_ifaces = 0;
+}
+
+/* Reads the next record of reader i into the heap; false at its end */
+bool CaptureMerger::advance(int i)
+{
+    auto cmp = [this](int a, int b) { return after(a, b); };
+
+    if (!readers[i]->next(heads[i]))
+        return false;
+    heap.push_back(i);
+    push_heap(heap.begin(), heap.end(), cmp);
+    return true;
+}
+
+/* rec.data is valid until the next call, as the reader it came from is
+ * only advanced then */
+bool CaptureMerger::next(CaptureRecord &rec)
+{
+    auto cmp = [this](int a, int b) { return after(a, b); };
+
+    if (last >= 0)
+        advance(last);
+    if (heap.empty()) {
+        last = -1;
+        return false;
+    }
+    pop_heap(heap.begin(), heap.end(), cmp);
+    last = heap.back();
+    heap.pop_back();
+
+    rec = heads[last];
+    vector<u32> &map = ifids[last];
+    while (map.size() <= rec.ifid)
+        map.push_back(~0u);
+    if (map[rec.ifid] == ~0u)
+        map[rec.ifid] = num_ifaces++;
+    rec.ifid = map[rec.ifid];
+    return true;
+}
+
+/* Finest of the inputs', all of which have read their first record */
+u8 CaptureMerger::finest_tsresol()
+{
+    u8 ret = TSRESOL_USEC;
+    EACH(it, readers) ret = max(ret, (*it)->finest_tsresol());
+    return ret;
+}
+
+/* CaptureWriter functions */
+
+bool CaptureWriter::open(const char *file_name, int format, u8 tsresol)
+{
+    FILE *f = strcmp(file_name, "-") == 0 ? stdout : fopen(file_name, "wb");
+    if (!f) {
+        ERR("Cannot open %s for writing\n", file_name);
+        return false;
+    }
+    return open(f, format, tsresol);
+}
+
+bool CaptureWriter::open(FILE *f, int format, u8 tsresol)
+{
+    fp = f;
+    this->format = format;
+    this->tsresol = format == FORMAT_PCAP && tsresol != TSRESOL_NSEC ? TSRESOL_USEC : tsresol;
+    ifaces_written.clear();
+
+    if (format == FORMAT_PCAP) {
+        pcap_file_header_raw fh;
+        fh.magic = this->tsresol == TSRESOL_NSEC ? PCAP_MAGIC_NSEC : PCAP_MAGIC_USEC;
+        fh.version_major = 2;
+        fh.version_minor = 4;
+        fh.thiszone = 0;
+        fh.sigfigs = 0;
+        fh.snaplen = CAPTURE_SNAPLEN;
+        fh.linktype = LINKTYPE_ETHERNET;
+        return fwrite(&fh, sizeof(fh), 1, fp) == 1;
+    }
+
+    /* Section header: no options, unknown section length */
+    u32 shb[7] = { PCAPNG_BLOCK_SHB, 28, PCAPNG_BYTE_ORDER_MAGIC, 1, 0xffffffff, 0xffffffff, 28 };
+    return fwrite(shb, sizeof(shb), 1, fp) == 1;
+}
+
+void CaptureWriter::close()
+{
+    if (fp && fp != stdout)
+        fclose(fp);
+    else if (fp)
+        fflush(fp);
+    fp = NULL;
+}
+
+/* Declares interfaces up to ifid; all use the writer's resolution */
+void CaptureWriter::write_interface(u32 ifid)
+{
+    while (ifaces_written.size() <= ifid) {
+        u32 idb[8] = { PCAPNG_BLOCK_IDB, 32, LINKTYPE_ETHERNET, CAPTURE_SNAPLEN, 0, 0, 0, 32 };
+        u8 *opt = (u8 *)&idb[4];
+        *(u16 *)opt = PCAPNG_OPT_IF_TSRESOL;
+        *(u16 *)(opt + 2) = 1;
+        opt[4] = tsresol;
+        /* idb[6] is opt_endofopt */
+        fwrite(idb, sizeof(idb), 1, fp);
+        ifaces_written.push_back(1);
+    }
+}
+
+void CaptureWriter::write(const CaptureRecord &rec)
+{
+    static const u8 pad[4] = { 0 };
+
+    if (format == FORMAT_PCAP) {
+        pcap_record_header_raw rh;
+        rh.ts_sec = rec.ts_ns / NSEC_PER_SEC;
+        rh.ts_frac = ns_to_ticks(rec.ts_ns % NSEC_PER_SEC, tsresol);
+        rh.caplen = rec.caplen;
+        rh.len = rec.len;
+        fwrite(&rh, sizeof(rh), 1, fp);
+        fwrite(rec.data, 1, rec.caplen, fp);
+        return;
+    }
+
+    write_interface(rec.ifid);
+
+    u32 padded = (rec.caplen + 3) & ~3;
+    u32 total = 32 + padded;
+    u64 ticks = ns_to_ticks(rec.ts_ns, tsresol);
+    u32 epb[7] = { PCAPNG_BLOCK_EPB, total, rec.ifid, (u32)(ticks >> 32), (u32)ticks,
+        rec.caplen, rec.len };
+
+    fwrite(epb, sizeof(epb), 1, fp);
+    fwrite(rec.data, 1, rec.caplen, fp);
+    fwrite(pad, 1, padded - rec.caplen, fp);
+    fwrite(&total, sizeof(total), 1, fp);
+}
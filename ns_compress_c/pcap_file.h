@@ -0,0 +1,157 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+#ifndef NS_COMPRESS_PCAP_FILE_H
+#define NS_COMPRESS_PCAP_FILE_H
+
+#include <cstdio>
+#include <vector>
+#include "types.hh"
+#include "helper.hh"
+
+using namespace std;
+
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+
+#define PCAPNG_BLOCK_SHB 0x0a0d0d0a
+#define PCAPNG_BLOCK_IDB 1
+#define PCAPNG_BLOCK_OPB 2 /* obsolete packet block */
+#define PCAPNG_BLOCK_SPB 3
+#define PCAPNG_BLOCK_EPB 6
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define PCAPNG_OPT_IF_TSOFFSET 14
+
+/* if_tsresol: 10^-n seconds, or 2^-n seconds with the MSB set */
+#define TSRESOL_USEC 6
+#define TSRESOL_NSEC 9
+#define TSRESOL_BINARY 0x80
+
+#define LINKTYPE_ETHERNET 1
+#define CAPTURE_SNAPLEN 262144
+#define PCAPNG_MAX_BLOCK (16 << 20)
+#define NSEC_PER_SEC 1000000000ULL
+
+enum CaptureFormat {
+    FORMAT_UNKNOWN,
+    FORMAT_PCAP,
+    FORMAT_PCAPNG,
+};
+
+struct CaptureInterface {
+    u16 linktype;
+    u32 snaplen;
+    u8 tsresol;
+    s64 tsoffset;       /* seconds added to every timestamp */
+};
+
+struct CaptureRecord {
+    u64 ts_ns;          /* nanoseconds since the epoch */
+    u32 ifid;
+    u32 caplen;
+    u32 len;
+    const u8 *data;
+};
+
+/* Reads classic pcap (usec or nsec, either byte order) and pcapng */
+struct CaptureReader {
+    FILE *fp;
+    int format;
+    bool swapped;
+    vector<CaptureInterface> ifaces;    /* of all sections so far */
+    u32 section_ifid;   /* first interface of the current section */
+    u8 *buf;
+    u32 buf_size;
+
+    CaptureReader();
+    ~CaptureReader()
+    {
+        close();
+    }
+    bool open(const char *file_name);
+    bool open(FILE *f);
+    void close();
+    bool next(CaptureRecord &rec);
+    u8 finest_tsresol();
+
+    u32 swap32(u32 v)
+    {
+        return swapped ? __builtin_bswap32(v) : v;
+    }
+    u16 swap16(u16 v)
+    {
+        return swapped ? __builtin_bswap16(v) : v;
+    }
+    bool reserve(u32 size);
+    bool read_block(u32 &type, u32 &len);
+    bool read_section_header(u32 len);
+    void read_interface(u32 len);
+    bool next_pcap(CaptureRecord &rec);
+    bool next_pcapng(CaptureRecord &rec);
+};
+
+/* Reads several captures as one, their records merged by timestamp.
+ * Each reader is one record ahead, and a min-heap of those records picks
+ * the next, so the inputs are streamed and never held in memory. The
+ * interfaces of all inputs are numbered in the order their first packet
+ * comes out; records with the same timestamp come out in input order. */
+struct CaptureMerger {
+    vector<CaptureReader *> readers;
+    vector<CaptureRecord> heads;    /* next record of each reader */
+    vector<vector<u32> > ifids;     /* per reader: interface -> merged one */
+    vector<int> heap;               /* readers with a record left */
+    int last;                       /* reader of the record returned last */
+    u32 num_ifaces;
+
+    CaptureMerger() : last(-1), num_ifaces(0) {}
+    ~CaptureMerger()
+    {
+        close();
+    }
+    bool open(const vector<const char *> &file_names);
+    void close();
+    bool next(CaptureRecord &rec);
+    u8 finest_tsresol();
+
+    bool advance(int i);
+    /* Heap order: true if reader a's record comes after reader b's */
+    bool after(int a, int b)
+    {
+        return heads[a].ts_ns != heads[b].ts_ns ? heads[a].ts_ns > heads[b].ts_ns : a > b;
+    }
+};
+
+/* Writes classic pcap or pcapng, one IDB per interface */
+struct CaptureWriter {
+    FILE *fp;
+    int format;
+    u8 tsresol;
+    vector<u8> ifaces_written;
+
+    CaptureWriter()
+    {
+        fp = NULL;
+    }
+    ~CaptureWriter()
+    {
+        close();
+    }
+    bool open(const char *file_name, int format, u8 tsresol = TSRESOL_NSEC);
+    bool open(FILE *f, int format, u8 tsresol = TSRESOL_NSEC);
+    void close();
+    void write(const CaptureRecord &rec);
+    void write_interface(u32 ifid);
+};
+
+int capture_format(const u8 *magic);
+u64 ticks_to_ns(u64 ticks, u8 tsresol);
+u64 ns_to_ticks(u64 ns, u8 tsresol);
+
+#endif //NS_COMPRESS_PCAP_FILE_H
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include "query.h"
+#include "columns.hh"
+#include "pcap_file.h"
+#include "util.hh"
+
+static void query_usage() {
+    fprintf(stderr, "usage: ns_compress query [-g column,...] [-t seconds] [-w column[&mask]=value]...\n"
+            "                         [-a aggregate,...] archive...\n"
+            "columns: time (with -t) and the header fields:");
+    REP(i, NUM_FIELDS) fprintf(stderr, " %s", FIELDS[i].name);
+    fprintf(stderr, "\naggregates: packets, bytes, sum:FIELD, min:FIELD, max:FIELD"
+            " (default packets,bytes)\n");
+    exit(1);
+}
+
+/* Calls parse on each comma-separated item of s */
+template<class F>
+static bool for_each_item(const char *s, F parse) {
+    char buf[256];
+    char *save, *item;
+
+    if (strlen(s) >= sizeof(buf))
+        return false;
+    strcpy(buf, s);
+    for (item = strtok_r(buf, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        if (!parse(item))
+            return false;
+    }
+    return true;
+}
+
+static bool parse_aggregate(const char *s, QueryAggregate &a) {
+    static const struct {
+        const char *name;
+        int agg;
+    } aggs[] = {
+        { "sum:", AGG_SUM },
+        { "min:", AGG_MIN },
+        { "max:", AGG_MAX },
+    };
+
+    a.field = -1;
+    if (strcmp(s, "packets") == 0) {
+        a.agg = AGG_PACKETS;
+        return true;
+    }
+    if (strcmp(s, "bytes") == 0) {
+        a.agg = AGG_BYTES;
+        return true;
+    }
+    for (auto &it : aggs) {
+        size_t len = strlen(it.name);
+        if (strncmp(s, it.name, len) == 0) {
+            a.agg = it.agg;
+            a.field = column_find(s + len);
+            return a.field >= 0 && a.field != COLUMN_TIME;
+        }
+    }
+    return false;
+}
+
+/* column[&mask]=value, numbers in C syntax */
+static bool parse_condition(const char *s, QueryCondition &c) {
+    char name[64];
+    const char *eq = strchr(s, '='), *amp = strchr(s, '&');
+    const char *end = amp && amp < eq ? amp : eq;
+    char *num_end;
+
+    if (!eq || (size_t)(end - s) >= sizeof(name))
+        return false;
+    memcpy(name, s, end - s);
+    name[end - s] = 0;
+    c.field = column_find(name);
+    if (c.field < 0 || c.field == COLUMN_TIME)
+        return false;
+    c.mask = ~0u;
+    if (end == amp) {
+        c.mask = strtoul(amp + 1, &num_end, 0);
+        if (num_end != eq)
+            return false;
+    }
+    c.value = strtoul(eq + 1, &num_end, 0);
+    return eq[1] && !*num_end;
+}
+
+/* ns_compress query ...: group-by aggregates over the header fields of
+ * archives, without rebuilding their packets */
+int query_main(int argc, char *argv[]) {
+    ColumnQuery q;
+    const char *aggs = "packets,bytes";
+    u64 bucket_sec = 0;
+    int o;
+
+    while ((o = getopt(argc, argv, "g:t:w:a:h")) != -1) {
+        switch (o) {
+            case 'g':
+                if (!for_each_item(optarg, [&](const char *s) {
+                        int c = column_find(s);
+                        q.group.push_back(c);
+                        return c >= 0;
+                    }))
+                    query_usage();
+                break;
+            case 't':
+                bucket_sec = strtoull(optarg, NULL, 10);
+                break;
+            case 'w': {
+                QueryCondition c;
+                if (!parse_condition(optarg, c))
+                    query_usage();
+                q.where.push_back(c);
+                break;
+            }
+            case 'a':
+                aggs = optarg;
+                break;
+            default:
+                query_usage();
+        }
+    }
+    if (!for_each_item(aggs, [&](const char *s) {
+            q.aggs.push_back(QueryAggregate());
+            return parse_aggregate(s, q.aggs.back());
+        }))
+        query_usage();
+    /* -t makes the time bucket the first group column */
+    if (bucket_sec && find(q.group.begin(), q.group.end(), COLUMN_TIME) == q.group.end())
+        q.group.insert(q.group.begin(), COLUMN_TIME);
+    q.bucket_ns = bucket_sec * NSEC_PER_SEC;
+    if (optind >= argc || q.aggs.empty()
+            || q.group.size() > QUERY_MAX_COLUMNS || q.aggs.size() > QUERY_MAX_COLUMNS
+            || (find(q.group.begin(), q.group.end(), COLUMN_TIME) != q.group.end() && !bucket_sec))
+        query_usage();
+
+    for (int i = optind; i < argc; i++) {
+        FILE *fp = fopen(argv[i], "rb");
+        if (!fp) {
+            ERR("Cannot open %s\n", argv[i]);
+            return 1;
+        }
+        bool ok = q.run(fp);
+        fclose(fp);
+        if (!ok) {
+            ERR("Cannot query %s\n", argv[i]);
+            return 1;
+        }
+    }
+    q.print(stdout);
+    fprintf(stderr, "%llu packets, %zu groups\n", q.packets, q.rows.size());
+    return 0;
+}
@@ -0,0 +1,13 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+#ifndef NS_COMPRESS_QUERY_H
+#define NS_COMPRESS_QUERY_H
+
+int query_main(int argc, char *argv[]);
+
+#endif //NS_COMPRESS_QUERY_H
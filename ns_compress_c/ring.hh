@@ -0,0 +1,105 @@
+/*
+ * Copyright 2014, Stanford University. This file is licensed under Apache 2.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: nikhilh@cs.stanford.com (Nikhil Handigol)
+ *         jvimal@stanford.edu (Vimal Jeyakumar)
+ *         brandonh@cs.stanford.edu (Brandon Heller)
+ */
+
+#ifndef RING_HH
+#define RING_HH
+
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+#include <sched.h>
+#include "types.hh"
+#include "helper.hh"
+
+using namespace std;
+
+/* Spins a little, then yields, while the other side of a ring catches up */
+static inline void
+ring_wait(int &spins)
+{
+    if (++spins < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else
+        sched_yield();
+}
+
+/* Before C++17, new ignores alignments past that of max_align_t; structs
+ * holding a ring derive from this when they live on the heap, or head and
+ * tail may end up sharing a cache line */
+struct CacheAligned {
+    static void *operator new(size_t size)
+    {
+        void *p;
+        if (posix_memalign(&p, 64, size))
+            throw bad_alloc();
+        return p;
+    }
+    static void operator delete(void *p)
+    {
+        free(p);
+    }
+};
+
+/* Lock-free queue between exactly one producer and one consumer thread.
+ * The producer only writes tail and the consumer only head, each on its
+ * own cache line; N must be a power of two. Pipeline stages pass batch
+ * pointers through these, so that one acquire/release pair covers a
+ * whole batch. */
+template<class T, u32 N>
+struct SpscRing {
+    T items[N];
+    alignas(64) atomic<u32> head;
+    alignas(64) atomic<u32> tail;
+
+    SpscRing() : head(0), tail(0)
+    {
+        static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+    }
+
+    bool try_push(const T &v)
+    {
+        u32 t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == N)
+            return false;
+        items[t & (N - 1)] = v;
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+    bool try_pop(T &v)
+    {
+        u32 h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire))
+            return false;
+        v = items[h & (N - 1)];
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+    void push(const T &v)
+    {
+        int spins = 0;
+        while (!try_push(v))
+            ring_wait(spins);
+    }
+    T pop()
+    {
+        T v;
+        int spins = 0;
+        while (!try_pop(v))
+            ring_wait(spins);
+        return v;
+    }
+    bool empty()
+    {
+        return head.load(memory_order_acquire) == tail.load(memory_order_acquire);
+    }
+};
+
+#endif //RING_HH
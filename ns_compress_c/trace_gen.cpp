@@ -0,0 +1,373 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+#include <cstring>
+#include "trace_gen.h"
+#include "packet.hh"
+
+#define GEN_MSS 1448
+#define GEN_START_SEC 1600000000ULL
+#define VXLAN_OVERHEAD 50
+
+static const char *PROFILE_NAMES[NUM_TRACE_PROFILES] = {
+    "bulk_tcp", "web", "dns", "scan", "tunnel",
+};
+
+static const u32 PROFILE_FLOWS[NUM_TRACE_PROFILES] = {
+    8, 64, 32, 1, 8,
+};
+
+static const u16 SCAN_PORTS[] = {
+    21, 22, 23, 25, 53, 80, 110, 139, 143, 443, 445, 993, 3306, 3389, 8080,
+};
+
+const char *trace_profile_name(int profile)
+{
+    return profile < NUM_TRACE_PROFILES ? PROFILE_NAMES[profile] : "unknown";
+}
+
+int trace_profile_find(const char *name)
+{
+    REP(i, NUM_TRACE_PROFILES) {
+        if (strcmp(name, PROFILE_NAMES[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static inline void put16(u8 *p, u16 v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void put32(u8 *p, u32 v)
+{
+    put16(p, v >> 16);
+    put16(p + 2, v);
+}
+
+static u16 ip_checksum(const u8 *p, int len)
+{
+    u32 sum = 0;
+    for (int i = 0; i < len; i += 2)
+        sum += p[i] << 8 | p[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/* Ethernet + IPv4 header with a valid checksum, returns the offset of
+ * the transport header */
+static u32 build_ip(u8 *pkt, u32 src, u32 dst, u8 ttl, u16 id, u8 proto, u32 ip_len)
+{
+    static const u8 macs[12] = { 0x02, 0, 0, 0, 0, 0x02, 0x02, 0, 0, 0, 0, 0x01 };
+    u8 *ip = pkt + sizeof(struct ether_header);
+
+    memcpy(pkt, macs, sizeof(macs));
+    put16(pkt + 12, ETHERTYPE_IP);
+    ip[0] = 0x45;
+    ip[1] = 0;
+    put16(ip + 2, ip_len);
+    put16(ip + 4, id);
+    put16(ip + 6, 0x4000);
+    ip[8] = ttl;
+    ip[9] = proto;
+    put16(ip + 10, 0);
+    put32(ip + 12, src);
+    put32(ip + 16, dst);
+    put16(ip + 10, ip_checksum(ip, 20));
+    return sizeof(struct ether_header) + 20;
+}
+
+TraceGen::TraceGen(int profile, u64 seed, u64 num_packets, u32 snaplen,
+        u32 concurrent_flows)
+        : rng(seed * 0x100000001b3ULL + profile)
+{
+    this->profile = profile;
+    this->num_packets = num_packets;
+    this->snaplen = snaplen;
+    emitted = 0;
+    ts_ns = GEN_START_SEC * NSEC_PER_SEC;
+    next_host = 1;
+    REP(i, 4) vtep_ipid[i] = rng.next();
+
+    flows.resize(concurrent_flows ? concurrent_flows : PROFILE_FLOWS[profile]);
+    EACH(it, flows) new_flow(*it);
+}
+
+void TraceGen::new_flow(GenFlow &f)
+{
+    u32 h = next_host++;
+
+    memset(&f, 0, sizeof(f));
+    f.addr[0] = 0x0a000000 | (h & 0xffff);
+    f.addr[1] = 0x5db80000 | rng.below(1 << 16);
+    f.port[0] = 32768 + rng.below(28000);
+    f.proto = IPPROTO_TCP;
+    f.seq[0] = rng.next();
+    f.seq[1] = rng.next();
+    f.ipid[0] = rng.next();
+    f.ipid[1] = rng.next();
+    f.vtep = rng.below(4);
+
+    switch (profile) {
+        case TRACE_BULK_TCP:
+        case TRACE_TUNNEL:
+            f.port[1] = 443;
+            f.request = 200;
+            f.response = 1 << 30;
+            break;
+
+        case TRACE_WEB:
+            f.port[1] = rng.below(4) ? 443 : 80;
+            f.request = 300 + rng.below(500);
+            /* mostly small objects, a few large ones */
+            f.response = 200 + rng.below(2000) + (rng.below(8) ? 0 : rng.below(40) * GEN_MSS);
+            break;
+
+        case TRACE_DNS:
+            f.proto = IPPROTO_UDP;
+            f.addr[1] = 0x08080800 | (rng.below(2) * 4 + 4);
+            f.port[1] = 53;
+            break;
+
+        case TRACE_SCAN:
+            f.addr[0] = 0xc6336401;
+            f.addr[1] = 0x0a010000;
+            f.port[0] = 40000 + rng.below(20000);
+            f.ipid[0] = 54321;
+            break;
+    }
+}
+
+u64 TraceGen::gap_ns()
+{
+    switch (profile) {
+        case TRACE_BULK_TCP:
+            return 1200 + rng.below(200);
+        case TRACE_WEB:
+            return rng.below(40000);
+        case TRACE_DNS:
+            return rng.below(100000);
+        case TRACE_SCAN:
+            /* rate limited scanner: periodic, except for replies */
+            return 10000;
+        case TRACE_TUNNEL:
+            return 1500 + rng.below(300);
+        default:
+            return 1000;
+    }
+}
+
+/* Builds a packet of f in direction dir (0 is client to server),
+ * returns its length on the wire */
+u32 TraceGen::build(u8 *pkt, GenFlow &f, int dir, u8 flags, u32 payload_len)
+{
+    u32 l4_len = f.proto == IPPROTO_TCP ? 20 : 8;
+    u32 off = build_ip(pkt, f.addr[dir], f.addr[!dir], dir ? 57 : 64, f.ipid[dir]++,
+            f.proto, 20 + l4_len + payload_len);
+    u8 *l4 = pkt + off;
+
+    put16(l4, f.port[dir]);
+    put16(l4 + 2, f.port[!dir]);
+    if (f.proto == IPPROTO_TCP) {
+        put32(l4 + 4, f.seq[dir]);
+        put32(l4 + 8, flags & TH_ACK ? f.seq[!dir] : 0);
+        l4[12] = 5 << 4;
+        l4[13] = flags;
+        put16(l4 + 14, dir ? 65160 : 502 + rng.below(4));
+        put16(l4 + 16, rng.next());
+        put16(l4 + 18, 0);
+        f.seq[dir] += payload_len + (flags & (TH_SYN | TH_FIN) ? 1 : 0);
+    } else {
+        put16(l4 + 4, 8 + payload_len);
+        put16(l4 + 6, rng.next());
+    }
+
+    /* Payload bytes are only materialized up to the snap length */
+    off += l4_len;
+    u32 fill = min(payload_len, snaplen > off ? snaplen - off : 0);
+    for (u32 i = 0; i < fill; i += 8) {
+        u64 r = rng.next();
+        memcpy(pkt + off + i, &r, min(8u, fill - i));
+    }
+    return off + payload_len;
+}
+
+u32 TraceGen::tcp_step(GenFlow &f, u8 *pkt, bool &done)
+{
+    u32 seg;
+
+    done = false;
+    switch (f.state++) {
+        case 0:
+            return build(pkt, f, 0, TH_SYN, 0);
+        case 1:
+            return build(pkt, f, 1, TH_SYN | TH_ACK, 0);
+        case 2:
+            return build(pkt, f, 0, TH_ACK, 0);
+        case 3:
+            return build(pkt, f, 0, TH_PUSH | TH_ACK, f.request);
+        case 4:
+            seg = min((u32)GEN_MSS, f.response);
+            f.response -= seg;
+            /* delayed acks: one per two segments */
+            if (++f.unacked < 2 && f.response)
+                f.state = 4;
+            return build(pkt, f, 1, f.response ? TH_ACK : TH_PUSH | TH_ACK, seg);
+        case 5:
+            f.unacked = 0;
+            if (f.response)
+                f.state = 4;
+            return build(pkt, f, 0, TH_ACK, 0);
+        case 6:
+            return build(pkt, f, 0, TH_FIN | TH_ACK, 0);
+        case 7:
+            return build(pkt, f, 1, TH_FIN | TH_ACK, 0);
+        default:
+            done = true;
+            return build(pkt, f, 0, TH_ACK, 0);
+    }
+}
+
+u32 TraceGen::dns_step(GenFlow &f, u8 *pkt)
+{
+    static const u8 question[] = {
+        3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+        0, 1, 0, 1,
+    };
+    static const u8 answer[] = {
+        0xc0, 0x0c, 0, 1, 0, 1, 0, 0, 0x0e, 0x10, 0, 4,
+    };
+    u32 off = sizeof(struct ether_header) + 20 + 8;
+    u32 len = 12 + sizeof(question);
+    int dir = f.state;
+    u32 total;
+
+    if (dir == 0) {
+        f.port[0] = 1024 + rng.below(64000);
+        f.seq[0] = rng.below(1 << 16);
+    }
+    if (dir == 1)
+        len += sizeof(answer) + 4;
+
+    total = build(pkt, f, dir, 0, len);
+    u8 *dns = pkt + off;
+    put16(dns, f.seq[0]);
+    put16(dns + 2, dir ? 0x8180 : 0x0100);
+    put16(dns + 4, 1);
+    put16(dns + 6, dir);
+    put32(dns + 8, 0);
+    memcpy(dns + 12, question, sizeof(question));
+    /* the label varies with the query */
+    dns[13] = 'a' + f.seq[0] % 26;
+    if (dir == 1) {
+        memcpy(dns + 12 + sizeof(question), answer, sizeof(answer));
+        put32(dns + 12 + sizeof(question) + sizeof(answer), 0x5db8d822 + f.seq[0] % 64);
+    }
+
+    f.state = !f.state;
+    return total;
+}
+
+u32 TraceGen::scan_step(GenFlow &f, u8 *pkt, bool &done)
+{
+    u32 len;
+
+    done = false;
+    if (f.state == 1) {
+        /* closed port answering the previous probe */
+        f.state = 0;
+        return build(pkt, f, 1, TH_RST | TH_ACK, 0);
+    }
+
+    f.addr[1] = 0x0a010000 | (f.request / nelem(SCAN_PORTS));
+    f.port[1] = SCAN_PORTS[f.request % nelem(SCAN_PORTS)];
+    f.request++;
+    f.ipid[0] = 54321;
+    f.seq[0] = rng.next();
+    f.seq[1] = rng.next();
+    len = build(pkt, f, 0, TH_SYN, 0);
+    if (rng.below(10) == 0)
+        f.state = 1;
+    return len;
+}
+
+/* Wraps the packet in Ethernet/IPv4/UDP/VXLAN between two VTEPs */
+u32 TraceGen::encap_vxlan(u8 *pkt, u32 len, GenFlow &f)
+{
+    u32 caplen = min(len, (u32)sizeof(buf) - VXLAN_OVERHEAD);
+    u32 src = 0xac100001 + f.vtep, dst = 0xac100101 + f.vtep;
+    u32 off;
+
+    memmove(pkt + VXLAN_OVERHEAD, pkt, caplen);
+    off = build_ip(pkt, src, dst, 64, vtep_ipid[f.vtep]++, IPPROTO_UDP,
+            20 + 8 + 8 + len);
+    /* source port from the inner flow hash, as VTEPs do for ECMP */
+    put16(pkt + off, 49152 + ((f.port[0] ^ f.addr[0]) & 0x3fff));
+    put16(pkt + off + 2, VXLAN_PORT);
+    put16(pkt + off + 4, 8 + 8 + len);
+    put16(pkt + off + 6, 0);
+    put32(pkt + off + 8, 0x08000000);
+    put32(pkt + off + 12, (5000 + f.vtep) << 8);
+    return len + VXLAN_OVERHEAD;
+}
+
+bool TraceGen::next(CaptureRecord &rec)
+{
+    if (emitted == num_packets)
+        return false;
+
+    GenFlow &f = flows[rng.below(flows.size())];
+    bool done = false;
+    u32 len;
+
+    switch (profile) {
+        case TRACE_DNS:
+            len = dns_step(f, buf);
+            done = f.state == 0 && rng.below(20) == 0;
+            break;
+        case TRACE_SCAN:
+            len = scan_step(f, buf, done);
+            break;
+        case TRACE_TUNNEL:
+            len = encap_vxlan(buf, tcp_step(f, buf, done), f);
+            break;
+        default:
+            len = tcp_step(f, buf, done);
+            break;
+    }
+    if (done)
+        new_flow(f);
+
+    ts_ns += gap_ns();
+    rec.ts_ns = ts_ns;
+    rec.ifid = 0;
+    rec.len = len;
+    rec.caplen = min(min(len, snaplen), (u32)sizeof(buf));
+    rec.data = buf;
+    emitted++;
+    return true;
+}
+
+/* Writes the remaining packets as a nanosecond pcap */
+u64 TraceGen::write(const char *file_name)
+{
+    CaptureWriter out;
+    CaptureRecord rec;
+    u64 n = 0;
+
+    if (!out.open(file_name, FORMAT_PCAP, TSRESOL_NSEC))
+        return 0;
+    while (next(rec)) {
+        out.write(rec);
+        n++;
+    }
+    out.close();
+    return n;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2020, Tsinghua University. This file is licensed under BSD 3.0,
+ * as described in included LICENSE.txt.
+ *
+ * Author: linh20@mails.tsinghua.eud.cn
+ */
+
+#ifndef NS_COMPRESS_TRACE_GEN_H
+#define NS_COMPRESS_TRACE_GEN_H
+
+#include <vector>
+#include "types.hh"
+#include "pcap_file.h"
+
+using namespace std;
+
+enum TraceProfile {
+    TRACE_BULK_TCP,     /* a few long transfers, MSS segments and delayed acks */
+    TRACE_WEB,          /* many short request/response connections */
+    TRACE_DNS,          /* one-packet UDP queries and answers */
+    TRACE_SCAN,         /* SYNs to sequential hosts and ports, some RSTs */
+    TRACE_TUNNEL,       /* bulk TCP inside VXLAN between a few VTEPs */
+
+    NUM_TRACE_PROFILES,
+};
+
+const char *trace_profile_name(int profile);
+int trace_profile_find(const char *name);
+
+/* xorshift64*: same seed, same trace on every platform */
+struct TraceRng {
+    u64 state;
+
+    explicit TraceRng(u64 seed)
+    {
+        state = seed ? seed : 0x9e3779b97f4a7c15ULL;
+    }
+    u64 next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545f4914f6cdd1dULL;
+    }
+    u32 below(u32 n)
+    {
+        return (u32)(((next() >> 32) * n) >> 32);
+    }
+};
+
+struct GenFlow {
+    u32 addr[2];        /* client, server */
+    u16 port[2];
+    u8 proto;
+    u32 seq[2];
+    u16 ipid[2];
+    u32 request;        /* bytes from the client */
+    u32 response;       /* bytes left to send from the server */
+    u32 unacked;        /* server segments since the last client ack */
+    int state;
+    u32 vtep;           /* index of the tunnel endpoint pair */
+};
+
+/* Deterministic synthetic trace; next() has the CaptureReader interface */
+struct TraceGen {
+    int profile;
+    TraceRng rng;
+    u64 num_packets;
+    u64 emitted;
+    u32 snaplen;
+    u64 ts_ns;
+    u32 next_host;
+    vector<GenFlow> flows;
+    u16 vtep_ipid[4];
+    u8 buf[2048];
+
+    /* concurrent_flows: 0 for the profile's own */
+    TraceGen(int profile, u64 seed, u64 num_packets, u32 snaplen = CAPTURE_SNAPLEN,
+            u32 concurrent_flows = 0);
+    bool next(CaptureRecord &rec);
+    u8 finest_tsresol()
+    {
+        return TSRESOL_NSEC;
+    }
+    u64 write(const char *file_name);
+
+    void new_flow(GenFlow &f);
+    u32 tcp_step(GenFlow &f, u8 *pkt, bool &done);
+    u32 dns_step(GenFlow &f, u8 *pkt);
+    u32 scan_step(GenFlow &f, u8 *pkt, bool &done);
+    u32 build(u8 *pkt, GenFlow &f, int dir, u8 flags, u32 payload_len);
+    u32 encap_vxlan(u8 *pkt, u32 len, GenFlow &f);
+    u64 gap_ns();
+};
+
+#endif //NS_COMPRESS_TRACE_GEN_H
@@ -19,6 +19,7 @@ typedef unsigned short u16;
 typedef unsigned int u32;
 typedef unsigned long long u64;
 typedef unsigned long long ull;
+typedef long long s64;
 typedef u32 *HVArray;
 typedef picojson::object JSON;
 
@@ -107,3 +107,35 @@ ts_diff_usec(struct timeval &end, struct timeval &start)
     us += end.tv_usec - start.tv_usec;
     return us;
 }
+
+/* LEB128: 7 bits per byte, least significant group first, MSB set on
+ * all bytes but the last. Returns the number of bytes written. */
+int 
+uvarint_encode(u64 value, u8 *target) 
+{
+    int len = 0;
+
+    while (value >= 0x80) {
+        target[len++] = (u8)value | 0x80;
+        value >>= 7;
+    }
+    target[len++] = (u8)value;
+    return len;
+}
+
+/* Returns the number of bytes consumed, 0 if src is truncated or
+ * malformed */
+int 
+uvarint_decode(const u8 *src, int avail, u64 *value) 
+{
+    u64 ret = 0;
+
+    for (int i = 0; i < avail && i < UVARINT_MAX_LEN; i++) {
+        ret |= (u64)(src[i] & 0x7f) << (7 * i);
+        if (!(src[i] & 0x80)) {
+            *value = ret;
+            return i + 1;
+        }
+    }
+    return 0;
+}
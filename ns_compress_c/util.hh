@@ -17,6 +17,7 @@
 #include "helper.hh"
 
 #define BUFSIZE (10 << 20)
+#define UVARINT_MAX_LEN 10
 
 using namespace std;
 
@@ -26,5 +27,21 @@ gzFile compressed_read_stream(FILE *fp);
 gzFile compressed_write_stream(FILE *fp);
 int varint_encode(u32 value, u8 *target);
 u32 varint_decode(int len, u8 *src);
+int uvarint_encode(u64 value, u8 *target);
+int uvarint_decode(const u8 *src, int avail, u64 *value);
+
+/* Maps signed values to unsigned ones with small magnitudes first:
+ * 0, -1, 1, -2, ... -> 0, 1, 2, 3, ... */
+static inline u64
+zigzag_encode(s64 value)
+{
+    return ((u64)value << 1) ^ (u64)(value >> 63);
+}
+
+static inline s64
+zigzag_decode(u64 value)
+{
+    return (s64)(value >> 1) ^ -(s64)(value & 1);
+}
 
 #endif //__UTIL_HH__